@@ -46,6 +46,11 @@ void arch_start_cpus(void) {
 		if (acpu_current->lapic_id == limine_cpuinfo->lapic_id)
 			continue;
 #ifdef CONFIG_SMP
+		/* The page allocator needs per-CPU data, so it cannot be called by the AP before it has any */
+		struct page* page = alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(sizeof(struct cpu)));
+		struct cpu* cpu = page_hhdm_virtual(page);
+		memset(cpu, 0, sizeof(*cpu));
+		limine_cpuinfo->extra_argument = (uintptr_t)cpu;
 		atomic_store(&limine_cpuinfo->goto_address, arch_x86_64_asm_ap_start);
 #else
 		atomic_store(&limine_cpuinfo->goto_address, halt);
@@ -61,10 +66,7 @@ static inline void set_cpu(struct cpu* cpu) {
 static struct cpu bsp_cpu;
 
 void arch_x86_64_percpu_ap_init(struct arch_limine_mp_info* cpu_info) {
-	struct page* page = alloc_pages(MM_ZONE_NORMAL | MM_NOFAIL, get_order(sizeof(struct cpu)));
-
-	struct cpu* cpu = page_hhdm_virtual(page);
-	memset(cpu, 0, sizeof(*cpu));
+	struct cpu* cpu = (struct cpu*)cpu_info->extra_argument; /* Allocated by arch_start_cpus() */
 	set_cpu(cpu);
 
 	struct arch_cpu* acpu = &cpu->arch_specific;
@@ -94,3 +96,7 @@ struct cpu* arch_current_cpu(void) {
 	__asm__("movq %%gs:%c1, %0" : "=r"(cpu) : "i"(offsetof(struct cpu, arch_specific.cpu)));
 	return cpu;
 }
+
+u32 arch_cpu_firmware_id(void) {
+	return current_cpu()->arch_specific.lapic_id;
+}
@@ -20,3 +20,6 @@ void arch_x86_64_percpu_ap_init(struct arch_limine_mp_info* cpu_info);
 void arch_x86_64_percpu_bsp_init(void);
 
 struct cpu* arch_current_cpu(void);
+
+/* The ID firmware tables (MADT, SRAT) use for the current CPU */
+u32 arch_cpu_firmware_id(void);
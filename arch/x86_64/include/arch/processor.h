@@ -6,3 +6,10 @@
 
 #define arch_cpu_relax() __asm__ volatile("pause" : : : "memory")
 #define arch_cpu_idle() __asm__ volatile("hlt" : : : "memory")
+
+/* Not serialized, only meant for timing short sections of code */
+static inline u64 arch_cycle_count(void) {
+	u32 low, high;
+	__asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((u64)high << 32) | low;
+}
@@ -2,6 +2,7 @@
 #include <lunar/panic.h>
 #include <lunar/printk.h>
 #include <lunar/format.h>
+#include <lunar/vmm.h>
 #include <x86_64/fault.h>
 
 #define PAGE_FAULT_WAS_PRESENT (1 << 0)
@@ -88,6 +89,11 @@ static int format_reason(char* buf, size_t bufsize, u64 err) {
 
 void arch_x86_64_page_fault(struct isr* isr, struct arch_context* ctx) {
 	(void)isr;
+
+	/* Done before fixups, so writes to a user page that's being migrated don't fail */
+	const u64 migration_fault = PAGE_FAULT_WAS_PRESENT | PAGE_FAULT_CAUSED_BY_WRITE;
+	if ((ctx->err_code & migration_fault) == migration_fault && vm_fault_is_migration(ctx->cr2))
+		return;
 	if (do_fixup(ctx))
 		return;
 
@@ -17,11 +17,7 @@
 #define PTE_COUNT (PAGE_SIZE / sizeof(pte_t))
 
 static struct page* alloc_table(void) {
-	struct page* page = alloc_page(MM_ZONE_NORMAL);
-	if (!page)
-		return NULL;
-	memset(page_hhdm_virtual(page), 0, PAGE_SIZE);
-	return page;
+	return alloc_page(MM_ZONE_NORMAL | MM_ZERO);
 }
 
 static void free_table_physical(physaddr_t physical) {
@@ -263,7 +259,11 @@ int arch_pagetable_update(pte_t* pagetable, uintptr_t virtual, physaddr_t physic
 	return 0;
 }
 
-/* TODO: Because this function does not free page tables, this breaks hugepage support. This will need to be resolved elsewhere, but is not a priority since the VMM does not support hugepages (yet) */
+/*
+ * A huge mapping is torn down by clearing its PMD entry, since the walk stops there. Page tables are
+ * never freed here, so unmapping small pages can leave an empty table behind. Mapping a huge page over
+ * it later unlinks it with arch_pagetable_prune(), and the VMM frees it once the TLB's are flushed.
+ */
 int arch_pagetable_unmap(pte_t* pagetable, uintptr_t virtual) {
 	if (!is_virtual_canonical(virtual))
 		return -EINVAL;
@@ -283,6 +283,29 @@ int arch_pagetable_unmap(pte_t* pagetable, uintptr_t virtual) {
 	return 0;
 }
 
+int arch_pagetable_prune(pte_t* pagetable, uintptr_t virtual, physaddr_t* table) {
+	if (!is_virtual_canonical(virtual) || virtual & (PMD_SIZE - 1))
+		return -EINVAL;
+
+	pte_t* pte;
+	size_t page_size = PMD_SIZE;
+	int err = walk_pagetable(pagetable, virtual, false, false, &page_size, &pte);
+	if (err)
+		return err;
+	if (!(*pte & PT_PRESENT) || *pte & PT_HUGEPAGE)
+		return -ENOENT;
+
+	const pte_t* entries = table_virtual(*pte);
+	for (size_t i = 0; i < PTE_COUNT; i++) {
+		if (entries[i])
+			return -EBUSY;
+	}
+
+	*table = *pte & ~(0xFFF | PT_NX);
+	*pte = 0;
+	return 0;
+}
+
 physaddr_t arch_pagetable_get_physical(pte_t* pagetable, uintptr_t virtual) {
 	if (!is_virtual_canonical(virtual))
 		return 0;
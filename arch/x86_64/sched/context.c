@@ -55,6 +55,9 @@ int arch_context_init(struct context* context) {
 	if (!r)
 		return -ENOMEM;
 
+	/* fxrstor runs on the first switch-in, an all-zero region is a valid image */
+	memset(r, 0, sizeof(*r));
+
 	context->arch_extended_context.fxsave_region = r;
 	context->arch_extended_context.user_gsbase = NULL;
 	context->arch_extended_context.user_fsbase = NULL;
@@ -44,10 +44,23 @@ struct tmpfs_mount {
 static const struct vnode_ops tmpfs_node_ops_alias __attribute__((alias("tmpfs_node_ops")));
 static struct slab_cache* tmpnode_cache;
 
+/* The ops never change, and nothing holds the mutex of a node that's being destroyed */
+static void tmpfs_node_ctor(void* obj) {
+	struct tmpfs_node* tnode = obj;
+	tnode->vnode.ops = &tmpfs_node_ops_alias;
+	mutex_init(&tnode->vnode.mtx);
+}
+
+/* VOP_INIT() without what tmpfs_node_ctor() already did */
 static struct tmpfs_node* new_node(struct mount* mount, enum vtype type, int flags) {
 	struct tmpfs_node* ret = slab_cache_alloc(tmpnode_cache);
-	if (ret)
-		VOP_INIT(&ret->vnode, type, &tmpfs_node_ops_alias, flags, mount);
+	if (ret) {
+		ret->vnode.type = type;
+		ret->vnode.flags = flags;
+		ret->vnode.belongs_to = mount;
+		memset(&ret->vnode.un, 0, sizeof(ret->vnode.un));
+		atomic_store_explicit(&ret->vnode.refcnt, 1, ATOMIC_RELAXED);
+	}
 	return ret;
 }
 
@@ -298,7 +311,10 @@ static int tmpfs_write(struct vnode* vnode, const void* buf, size_t count, off_t
 
 	struct tmpfs_block* block = tnode->typedata.data;
 	if (end > block->data.file.cap) {
+		/* Grow geometrically, so appending doesn't reallocate and copy the whole file on every write */
 		size_t new_cap = (end + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+		if (new_cap < block->data.file.cap * 2)
+			new_cap = block->data.file.cap * 2;
 		u8* new_data = vmalloc(new_cap);
 		if (!new_data)
 			return -ENOMEM;
@@ -667,7 +683,7 @@ static const struct filesystem_type __filesystem_type tmpfs_type = {
 };
 
 static void tmpfs_init(void) {
-	tmpnode_cache = slab_cache_create(sizeof(struct tmpfs_node), alignof(struct tmpfs_node), MM_ZONE_NORMAL, NULL, NULL);
+	tmpnode_cache = slab_cache_create(sizeof(struct tmpfs_node), alignof(struct tmpfs_node), MM_ZONE_NORMAL, tmpfs_node_ctor, NULL);
 	if (!tmpnode_cache)
 		out_of_memory();
 	int err = vfs_register(&tmpfs_type);
@@ -100,6 +100,21 @@ int arch_pagetable_update(pte_t* pagetable, uintptr_t virtual, physaddr_t physic
  */
 int arch_pagetable_unmap(pte_t* pagetable, uintptr_t virtual);
 
+/**
+ * @brief Unlink an empty page table, so a huge page can be mapped in its place
+ *
+ * The table isn't freed, since other CPU's can use it until their TLB's are flushed.
+ *
+ * @param[in] pagetable The page table to use
+ * @param[in] virtual The address the huge page is going to be mapped at
+ * @param[out] table Where the physical address of the unlinked table is stored
+ *
+ * @retval -ENOENT There is no page table at that address
+ * @retval -EBUSY The page table isn't empty
+ * @retval 0 Successful
+ */
+int arch_pagetable_prune(pte_t* pagetable, uintptr_t virtual, physaddr_t* table);
+
 /**
  * @brief Get the physical address from a virtual address
  *
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <lunar/types.h>
+#include <lunar/list.h>
+
+struct avl_node {
+	struct avl_node* parent, *left, *right;
+	int height;
+};
+
+/*
+ * The tree doesn't know about keys, the caller walks it to find where a node goes. If augment isn't NULL,
+ * it's called on a node every time one of its children changes, so it can recompute anything it keeps
+ * about its subtree from its children. The children are always up to date when it's called.
+ */
+struct avl_tree {
+	struct avl_node* root;
+	void (*augment)(struct avl_node* node);
+};
+
+#define AVL_TREE_INITIALIZER(a) { .root = NULL, .augment = (a) }
+#define avl_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void avl_tree_init(struct avl_tree* tree, void (*augment)(struct avl_node*)) {
+	tree->root = NULL;
+	tree->augment = augment;
+}
+
+/**
+ * @brief Insert a node into a tree
+ *
+ * The caller finds the place for the node by walking down the tree from the root, and
+ * passes the last node it visited along with the child pointer it stopped at.
+ *
+ * @param tree The tree
+ * @param node The node to insert
+ * @param parent The parent of the new node, NULL if the tree is empty
+ * @param link The child pointer of the parent, or the root of the tree, that's NULL
+ */
+void avl_insert(struct avl_tree* tree, struct avl_node* node, struct avl_node* parent, struct avl_node** link);
+
+/**
+ * @brief Remove a node from a tree
+ *
+ * @param tree The tree
+ * @param node The node to remove
+ */
+void avl_erase(struct avl_tree* tree, struct avl_node* node);
+
+/**
+ * @brief Recompute the augmented data of a node and all of its ancestors
+ *
+ * Has to be called when something augment() uses changes outside of the tree.
+ *
+ * @param tree The tree
+ * @param node The node that changed
+ */
+void avl_propagate(struct avl_tree* tree, struct avl_node* node);
+
+/**
+ * @brief Get the first node of a tree in order
+ * @return NULL if the tree is empty
+ */
+struct avl_node* avl_first(const struct avl_tree* tree);
+
+/**
+ * @brief Get the last node of a tree in order
+ * @return NULL if the tree is empty
+ */
+struct avl_node* avl_last(const struct avl_tree* tree);
+
+/**
+ * @brief Get the next node in order
+ * @return NULL if the node is the last one
+ */
+struct avl_node* avl_next(const struct avl_node* node);
+
+/**
+ * @brief Get the previous node in order
+ * @return NULL if the node is the first one
+ */
+struct avl_node* avl_prev(const struct avl_node* node);
@@ -1,8 +1,26 @@
 #pragma once
 
+#include <lunar/types.h>
+
 /**
  * @brief Get a value for a command line argument
  * @param arg The command line argument
  * @return The argument value string
  */
 const char* cmdline_get(const char* arg);
+
+/**
+ * @brief Get a value for a command line argument before the command line is parsed
+ *
+ * This reads the command line given by the bootloader directly, so it can be used
+ * before the heap is initialized.
+ *
+ * @param[in] arg The command line argument
+ * @param[out] out Where the value string is copied to
+ * @param[in] size The size of the output buffer
+ *
+ * @retval 0 Successful
+ * @retval -ENOENT Argument not found
+ * @retval -E2BIG Value does not fit in the output buffer
+ */
+int cmdline_get_early(const char* arg, char* out, size_t size);
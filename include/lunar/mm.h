@@ -2,22 +2,59 @@
 
 #include <lunar/types.h>
 #include <lunar/list.h>
+#include <lunar/avltree.h>
 #include <lunar/mutex.h>
+#include <lunar/numa.h>
 #include <arch/page.h>
 
 struct vma;
+struct mm;
+struct slab;
+struct slab_cache;
 
 #define PAGE_FLAG_RESERVED (1 << 0) /* Reserved by firmware, the kernel, or the bootloader */
+#define PAGE_FLAG_BUDDY_FREE (1 << 1) /* Head of a block sitting on a buddy free list */
+#define PAGE_FLAG_CMA (1 << 2) /* In the contiguous memory region, never given to the buddy allocator */
+#define PAGE_FLAG_HUGETLB (1 << 3) /* Part of a huge page from the pools reserved at boot */
+#define PAGE_FLAG_SLAB (1 << 4) /* Backs the objects of a slab, see page->slab */
+#define PAGE_FLAG_CACHED (1 << 5) /* Head of a block sitting in a per-CPU page cache */
 
+#define PAGE_FLAGS_MASK 0xffu
+#define PAGE_ORDER_SHIFT 8
+#define PAGE_ORDER_MASK (0x1fu << PAGE_ORDER_SHIFT)
+#define PAGE_ZONE_SHIFT 13
+#define PAGE_ZONE_MASK (0x3u << PAGE_ZONE_SHIFT) /* Index of the zone, not the MM_ZONE_* flag */
+#define PAGE_NODE_SHIFT 15
+#define PAGE_NODE_MASK (0x7u << PAGE_NODE_SHIFT)
+
+#define PAGE_LINK_NONE U32_MAX
+
+/*
+ * Two of these fit in a cache line. Links are page indexes relative to the base of the memory area, and
+ * the flags, order, zone and node are all packed into info so they can be changed together atomically.
+ */
 struct page {
-	int flags;
-	struct {
-		atomic(struct page*) head;
-		atomic(unsigned int) order;
-	} buddy;
-	atomic(long) refcnt;
+	atomic(u32) info; /* Read with page_flags(), page_order(), page_zone(), and page_node() */
+	atomic(i32) refcnt;
+	atomic(u32) head; /* How many pages before this one the head of the block is, 0 for the head */
+	union {
+		struct {
+			u32 prev, next;
+		} link; /* Free list link, only used by the free list buddy engine while the page is free */
+		struct {
+			struct mm* mm;
+			uintptr_t virtual;
+		} mapping; /* Where a movable page is mapped, mm is NULL if the page can't be migrated */
+		struct {
+			struct slab_cache* cache;
+			struct slab* slab;
+		} slab; /* The slab the page belongs to, only while PAGE_FLAG_SLAB is set */
+	};
 };
 
+static_assert(sizeof(struct page) == 32, "struct page must stay 32 bytes");
+static_assert(MAX_NUMA_NODES <= (PAGE_NODE_MASK >> PAGE_NODE_SHIFT) + 1, "Node doesn't fit in struct page");
+
 struct vmm_range {
 	uintptr_t start, end;
 	bool grows_down;
@@ -27,6 +64,7 @@ struct vmm_range {
 struct mm {
 	pte_t* pagetable;
 	struct list_head vma_list; /* struct vma */
+	struct avl_tree vma_tree; /* The same VMA's as vma_list, by address */
 	struct vmm_range segment, brk, mmap, stack;
 	mutex_t mutex;
 };
@@ -74,11 +112,49 @@ typedef enum {
 	MM_ZONE_DMA32 = (1 << 1), /* Memory less than 4GiB */
 	MM_ZONE_NORMAL = (1 << 2), /* Memory above 4GiB */
 	MM_NOFAIL = (1 << 3), /* Allocation will never fail */
-	MM_ATOMIC = (1 << 4) /* Allocation cannot sleep */
+	MM_ATOMIC = (1 << 4), /* Allocation cannot sleep */
+	MM_ZERO = (1 << 5), /* Memory is zeroed */
+	MM_MOVABLE = (1 << 6) /* Pages will only be mapped through vmalloc() or vm_map_user(), and can be moved */
 } mm_t;
 
 #define MAX_ORDER 11
 
+#define HUGEPAGE_ORDER_2MB 9
+#define HUGEPAGE_ORDER_1GB 18
+
+static_assert(HUGEPAGE_ORDER_1GB <= PAGE_ORDER_MASK >> PAGE_ORDER_SHIFT, "Order doesn't fit in struct page");
+
+#define PAGE_CACHE_MAX_ORDER 3 /* Highest order that goes through the per-CPU page cache */
+#define PAGE_CACHE_CAPACITY 64 /* Must be a power of two */
+#define PAGE_CACHE_ZONE_COUNT 3
+
+struct page_cache_list {
+	unsigned int head, count; /* Ring buffer, hot blocks are at the head, cold blocks at the tail */
+	physaddr_t blocks[PAGE_CACHE_CAPACITY];
+};
+
+/* Per-CPU cache of free blocks that sits in front of the buddy allocator, only touched with IRQ's off */
+struct page_cache {
+	struct page_cache_list lists[PAGE_CACHE_ZONE_COUNT][2][PAGE_CACHE_MAX_ORDER + 1]; /* [zone][atomic][order] */
+	unsigned long hits[PAGE_CACHE_MAX_ORDER + 1], misses[PAGE_CACHE_MAX_ORDER + 1];
+	unsigned long refills[PAGE_CACHE_MAX_ORDER + 1], drains[PAGE_CACHE_MAX_ORDER + 1];
+};
+
+#define MM_ZONE_COUNT 3
+#define MM_LATENCY_BUCKETS 16
+#define MM_LATENCY_FIRST_SHIFT 7 /* The first latency bucket is everything under 2^7 cycles */
+
+static_assert(MM_ZONE_COUNT <= (PAGE_ZONE_MASK >> PAGE_ZONE_SHIFT) + 1, "Zone doesn't fit in struct page");
+
+/* Per-CPU allocator statistics, only touched with IRQ's off */
+struct mm_stats {
+	unsigned long allocs[MM_ZONE_COUNT][MAX_ORDER + 1], frees[MM_ZONE_COUNT][MAX_ORDER + 1];
+	unsigned long fallbacks[MM_ZONE_COUNT]; /* Allocations that had to use a smaller zone, by the zone that was used */
+	unsigned long retries, failures;
+	unsigned long alloc_latency[MAX_ORDER + 1][MM_LATENCY_BUCKETS]; /* Cycles, in power of two buckets */
+	unsigned long free_latency[MAX_ORDER + 1][MM_LATENCY_BUCKETS];
+};
+
 static inline unsigned int get_order(size_t size) {
 	if (size <= PAGE_SIZE)
 		return 0;
@@ -108,6 +184,19 @@ int get_page_from_address(physaddr_t address, struct page** page);
  */
 void mm_get_free_pages(size_t* total_page_count, size_t* free_page_count);
 
+/**
+ * @brief Allocate physical pages from a NUMA node
+ *
+ * If the node doesn't have enough memory, the other nodes are tried in order of distance.
+ *
+ * @param mm_flags The flags for how the allocation should be done
+ * @param order 2 ^ order pages to allocate (0 for one page, 1 for 2 pages, 2 for 4 pages)
+ * @param node The preferred node, NUMA_NO_NODE for the node of the current CPU
+ *
+ * @return A pointer to the page struct
+ */
+struct page* alloc_pages_node(mm_t mm_flags, unsigned int order, int node);
+
 /**
  * @brief Allocate physical pages
  *
@@ -116,7 +205,24 @@ void mm_get_free_pages(size_t* total_page_count, size_t* free_page_count);
  *
  * @return A pointer to the page struct
  */
-struct page* alloc_pages(mm_t mm_flags, unsigned int order);
+static inline struct page* alloc_pages(mm_t mm_flags, unsigned int order) {
+	return alloc_pages_node(mm_flags, order, NUMA_NO_NODE);
+}
+
+/**
+ * @brief Allocate many single physical pages at once
+ *
+ * The area lock is taken once per batch of blocks instead of once per page, and the pages
+ * are split from the largest blocks available, so they're usually physically contiguous.
+ * Every page is independent, and must be released with release_page() on its own.
+ *
+ * @param[in] mm_flags The flags for how the allocation should be done
+ * @param[in] count The number of pages to allocate
+ * @param[out] out Where the page structs are stored
+ *
+ * @return The number of pages allocated, less than count if memory ran out
+ */
+size_t alloc_pages_bulk(mm_t mm_flags, size_t count, struct page** out);
 
 /**
  * @brief Allocate a physical page
@@ -127,13 +233,92 @@ static inline struct page* alloc_page(mm_t mm_flags) {
 	return alloc_pages(mm_flags, 0);
 }
 
+/**
+ * @brief Allocate physically contiguous memory for a device
+ *
+ * The contiguous memory region (mm.cma on the command line, in MiB) is used when there is one,
+ * and the movable pages borrowing the run are moved somewhere else. Otherwise, or if the region
+ * has no room, the buddy allocator is used.
+ *
+ * @param size The size of the allocation in bytes
+ * @param mm_flags The flags for how the allocation should be done, MM_ATOMIC never moves pages
+ *
+ * @return The first page struct of the run, NULL on failure
+ */
+struct page* dma_alloc_contiguous(size_t size, mm_t mm_flags);
+
+/**
+ * @brief Free memory from dma_alloc_contiguous()
+ * @param page The page returned by dma_alloc_contiguous()
+ * @param size The size that was allocated
+ */
+void dma_free_contiguous(struct page* page, size_t size);
+
+/**
+ * @brief Allocate a huge page from the pools reserved at boot
+ *
+ * The pools are sized with mm.hugepages_2mb and mm.hugepages_1gb on the command line. A huge
+ * page is a block like any other, so it can be mapped with VMM_HUGETLB, and it goes back to
+ * its pool when the last reference is released.
+ *
+ * @param order HUGEPAGE_ORDER_2MB or HUGEPAGE_ORDER_1GB
+ * @param mm_flags Only MM_ZERO is used
+ *
+ * @return The head page, NULL if the pool is empty
+ */
+struct page* alloc_hugepage(unsigned int order, mm_t mm_flags);
+
+/**
+ * @brief Get the size of a huge page pool
+ * @param[in] order HUGEPAGE_ORDER_2MB or HUGEPAGE_ORDER_1GB
+ * @param[out] total The number of huge pages in the pool
+ * @param[out] free The number of huge pages that aren't allocated
+ */
+void hugepage_get_counts(unsigned int order, size_t* total, size_t* free);
+
 /**
  * @brief Get the head page of the block containing the page
  * @param page The page to get the head of
  * @return The head of the page
  */
 static inline struct page* page_head(const struct page* page) {
-	return atomic_load(&page->buddy.head);
+	return (struct page*)page - atomic_load(&page->head);
+}
+
+/**
+ * @brief Get the PAGE_FLAG_* flags of a page
+ * @param page The page
+ * @return The flags
+ */
+static inline unsigned int page_flags(const struct page* page) {
+	return atomic_load(&page->info) & PAGE_FLAGS_MASK;
+}
+
+/**
+ * @brief Get the order of a block
+ * @param page The head of the block
+ * @return The order of the block, 0 for pages that aren't the head of a block
+ */
+static inline unsigned int page_order(const struct page* page) {
+	return (atomic_load(&page->info) & PAGE_ORDER_MASK) >> PAGE_ORDER_SHIFT;
+}
+
+/**
+ * @brief Get the zone a page belongs to
+ * @param page The page
+ * @return The MM_ZONE_* flag of the zone
+ */
+static inline unsigned int page_zone(const struct page* page) {
+	return 1u << ((atomic_load(&page->info) & PAGE_ZONE_MASK) >> PAGE_ZONE_SHIFT);
+}
+
+/**
+ * @brief Get the NUMA node a page belongs to
+ * @param page The page
+ * @return The node, 0 until the node of the page is known
+ */
+static inline unsigned int page_node(const struct page* page) {
+	return (atomic_load(&page->info) & PAGE_NODE_MASK) >> PAGE_NODE_SHIFT;
 }
 
 /**
@@ -175,4 +360,50 @@ static inline physaddr_t page_to_physaddr(const struct page* page) {
 	return hhdm_physical(page_hhdm_virtual(page));
 }
 
+/* Something that can give memory back when a zone runs low, see register_shrinker() */
+struct shrinker {
+	const char* name;
+	unsigned long (*count)(struct shrinker* shrinker); /* How many pages scan could free right now */
+	unsigned long (*scan)(struct shrinker* shrinker, unsigned long target); /* Returns how many pages were freed */
+	unsigned long calls, freed; /* Only written with the shrinker registry locked */
+	struct list_node link;
+};
+
+/**
+ * @brief Add a shrinker to the registry
+ *
+ * Shrinkers are called by the background reclaim thread when a zone drops below its low watermark,
+ * and by allocations that can sleep when they fail. They can be called with locks held further up
+ * the stack, so they should only try to take locks. Not safe to call from an atomic context.
+ *
+ * @param shrinker The shrinker, name, count, and scan have to be set
+ */
+void register_shrinker(struct shrinker* shrinker);
+
+/**
+ * @brief Remove a shrinker from the registry
+ *
+ * Once this returns the shrinker isn't being called anymore. Not safe to call from an atomic context.
+ *
+ * @param shrinker The shrinker
+ */
+void unregister_shrinker(struct shrinker* shrinker);
+
+/**
+ * @brief Print page allocator statistics
+ */
+void mm_dump_stats(void);
+
+/**
+ * @brief Print the free blocks and lock contention of every memory area
+ */
+void mm_dump_areas(void);
+
+/**
+ * @brief Run the memory allocator benchmarks, and print the results
+ *
+ * Not safe to call from an atomic context.
+ */
+void mm_run_benchmarks(void);
+
 void out_of_memory(void);
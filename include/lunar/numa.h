@@ -0,0 +1,54 @@
+#pragma once
+
+#include <lunar/types.h>
+
+#define MAX_NUMA_NODES 8
+#define NUMA_NO_NODE (-1)
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/**
+ * @brief Get the number of NUMA nodes
+ *
+ * This is always at least 1, even if there is no SRAT.
+ *
+ * @return The number of nodes
+ */
+unsigned int numa_node_count(void);
+
+/**
+ * @brief Get the NUMA node of the current CPU
+ * @return The node, 0 if the CPU isn't described by the SRAT
+ */
+unsigned int numa_node_id(void);
+
+/**
+ * @brief Get the NUMA node a physical address belongs to
+ * @param address The physical address
+ * @return The node, 0 if the address isn't described by the SRAT
+ */
+unsigned int numa_node_of_address(physaddr_t address);
+
+/**
+ * @brief Get the distance between two NUMA nodes
+ *
+ * Uses the SLIT if it exists, otherwise NUMA_LOCAL_DISTANCE or NUMA_REMOTE_DISTANCE
+ * is returned.
+ *
+ * @param from The node the access is made from
+ * @param to The node being accessed
+ *
+ * @return The relative distance
+ */
+unsigned int numa_distance(unsigned int from, unsigned int to);
+
+/**
+ * @brief Get the nodes sorted by distance from a node
+ *
+ * The first entry is always the node itself.
+ *
+ * @param node The node to sort by
+ * @return An array of numa_node_count() nodes
+ */
+const unsigned int* numa_fallback_order(unsigned int node);
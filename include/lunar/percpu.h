@@ -16,6 +16,9 @@ struct cpu {
 	struct semaphore softirqd_sem;
 	long softirq_count;
 	bool need_resched;
+	struct page_cache page_cache;
+	struct mm_stats mm_stats;
+	unsigned int numa_node;
 	struct arch_cpu arch_specific;
 };
 static_assert(sizeof(((struct cpu*)0)->softirq_mask) >= SOFTIRQ_COUNT, "sizeof(((struct cpu*)0)->softirq_mask) >= SOFTIRQ_COUNT");
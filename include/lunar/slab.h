@@ -10,47 +10,72 @@
 
 #include <arch/asm/errno.h>
 
+/* At the end of the slab's own pages, unless the cache keeps its slabs off-slab */
 struct slab {
-	struct page* self_page;
-	struct {
-		void* virtual;
-		struct page* page;
-	} base;
-	struct {
-		u8* virtual;
-		struct page* page;
-	} free;
+	struct page* page; /* Head of the block the objects are in */
+	void* base; /* The first object */
+	u8* free; /* Bitmap of the objects in use, right before the slab when it's on-slab */
 	size_t in_use;
 	struct list_node link;
 };
 
+#define SLAB_MAGAZINE_MAX 62 /* Keeps a magazine at 512 bytes */
+
+struct slab_magazine;
+struct slab_cpu;
+
+#define SLAB_ALIGN_CACHE_LINE 64 /* Pass to slab_cache_create() to keep objects from sharing cache lines */
+
 struct slab_cache {
 	struct page* self_page;
 	void (*ctor)(void*);
 	void (*dtor)(void*);
 	struct list_head full, partial, empty;
+	unsigned long empty_slabs; /* Slabs on the empty list */
 	size_t obj_size;
-	unsigned long obj_count;
+	unsigned long obj_count; /* Objects per slab */
+	unsigned int order; /* Order of the block every slab is in */
+	bool off_slab; /* Are the slab and its bitmap allocated separately? */
 	size_t align;
+	size_t color_step; /* Distance between the starting offsets of slabs */
+	unsigned int colors, color_next; /* How many starting offsets fit in the leftover space, and the next one */
+	bool coloring;
 	mm_t mm_flags;
 	union {
 		spinlock_t spinlock;
 		mutex_t mutex;
 	};
+	struct slab_cpu* cpus; /* Per-CPU magazines indexed by sched ID, only touched with IRQ's off */
+	u32 cpu_count;
+	unsigned int magazine_size, depot_max; /* See slab_cache_tune() */
+	struct {
+		struct slab_magazine* full, *empty;
+		unsigned long full_count, empty_count, exchanges;
+		spinlock_t lock;
+	} depot; /* Magazines that aren't loaded on any CPU */
+	struct list_node link; /* In the list of every cache */
 };
 
 /**
  * @brief Create a new slab cache
  *
- * If zero is passed to align, it will set it to 8. Not safe to call from an atomic context.
+ * If zero is passed to align, it will set it to 8. The size of the slabs is picked to waste as little
+ * memory as possible, and whatever is left over is used to start each new slab at a different cache line,
+ * so the objects of different slabs don't all compete for the same cache sets. Not safe to call from an
+ * atomic context.
+ *
+ * Objects are kept constructed while they're free. The constructor runs on every object of a slab when the
+ * slab is created, and the destructor runs on them when the slab is released, so objects have to be given
+ * back in their constructed state. Both are called with the cache locked and can't use the cache.
  *
  * @param obj_size The size of the object. This will be rounded to the alignment
- * @param align The alignment of the object, must be a power of 2
+ * @param align The alignment of the object, must be a power of 2 no larger than PAGE_SIZE.
+ * SLAB_ALIGN_CACHE_LINE gives every object its own cache lines.
  * @param mm_flags The MM flags for this cache
- * @param ctor Object constructor
- * @param dtor Object destructor
+ * @param ctor Object constructor, can be NULL
+ * @param dtor Object destructor, can be NULL
  *
- * @return NULL if align isn't a power of 2, or there is no memory
+ * @return NULL if align isn't valid, or there is no memory
  */
 struct slab_cache* slab_cache_create(size_t obj_size, size_t align, 
 		mm_t mm_flags, void (*ctor)(void*), void (*dtor)(void*));
@@ -72,7 +97,8 @@ int slab_cache_destroy(struct slab_cache* cache);
 /**
  * @brief Allocate memory from a slab cache
  *
- * This function will automatically try to grow the cache if all slabs are full.
+ * Objects come from the current CPU's magazines first, which doesn't take the cache lock. Otherwise this
+ * function will automatically try to grow the cache if all slabs are full.
  * Safe to call from an interrupt context assuming the cache was created with MM_ATOMIC.
  *
  * @param cache The cache to allocate from
@@ -83,16 +109,80 @@ void* slab_cache_alloc(struct slab_cache* cache);
 /**
  * @brief Free memory from a slab cache
  *
- * If the object isn't in any slab, it will print an error message and just return.
+ * The object goes into the current CPU's magazines when there is room. If it goes back to the slabs and
+ * isn't in any of them, it will print an error message and just return.
  * Safe to call from an interrupt context assuming the cache was created with MM_ATOMIC.
  *
  * @param obj The object to free
  */
 void slab_cache_free(struct slab_cache* cache, void* obj);
 
+/**
+ * @brief Allocate many objects from a slab cache at once
+ *
+ * The objects come straight from the slabs with one hold of the cache lock, whole slabs at a time.
+ * Safe to call from an interrupt context assuming the cache was created with MM_ATOMIC.
+ *
+ * @param cache The cache to allocate from
+ * @param mm_flags MM_ATOMIC if the caller can't sleep, MM_ZERO to zero the objects. The zone comes from the cache.
+ * @param count The number of objects to allocate
+ * @param objs Where the objects are stored, must have room for count pointers
+ *
+ * @retval 0 Success
+ * @retval -ENOMEM There is no memory, nothing was allocated
+ * @retval -EWOULDBLOCK MM_ATOMIC was passed, but the cache wasn't created with it
+ * @retval -EINVAL MM_ZERO was passed, but the cache has a constructor
+ */
+int slab_cache_alloc_bulk(struct slab_cache* cache, mm_t mm_flags, size_t count, void** objs);
+
+/**
+ * @brief Free many objects from a slab cache at once
+ *
+ * The objects go back to the slabs with one hold of the cache lock, skipping the magazines.
+ * Safe to call from an interrupt context assuming the cache was created with MM_ATOMIC.
+ *
+ * @param cache The cache the objects are from
+ * @param count The number of objects
+ * @param objs The objects to free
+ */
+void slab_cache_free_bulk(struct slab_cache* cache, size_t count, void** objs);
+
+/**
+ * @brief Turn slab coloring on or off for a slab cache
+ *
+ * Coloring is on by default. Only slabs created after the call are affected.
+ *
+ * @param cache The cache
+ * @param enable Whether new slabs should start at different offsets
+ */
+void slab_cache_set_coloring(struct slab_cache* cache, bool enable);
+
+/**
+ * @brief Change the per-CPU magazine tunables of a slab cache
+ *
+ * A new magazine size only applies to magazines created after the call, and the full magazines in the
+ * depot are given back to the slabs. Not safe to call from an atomic context.
+ *
+ * @param cache The cache to tune
+ * @param magazine_size Objects per magazine, zero makes allocations and frees skip the magazines
+ * @param depot_max How many full and how many empty magazines the depot can hold
+ *
+ * @retval 0 Success
+ * @retval -EINVAL magazine_size is larger than SLAB_MAGAZINE_MAX
+ * @retval -ENOTSUP The cache can't have magazines
+ */
+int slab_cache_tune(struct slab_cache* cache, unsigned int magazine_size, unsigned int depot_max);
+
 /**
  * @brief Allocate kernel memory
  *
+ * With MM_ZERO, the memory is zeroed. Allocations backed by whole pages get them
+ * from the pool of pre-zeroed pages when possible.
+ *
+ * Small allocations come from size classes that are multiples of 8 bytes, so memory
+ * is only guaranteed to be aligned to 8 bytes, or BIGGEST_ALIGNMENT when the size is
+ * a multiple of it. Allocations too big for the size classes are page aligned.
+ *
  * @param size The size of the allocation
  * @param mm_flags Conditions for the allocation
  *
@@ -109,10 +199,25 @@ void* kmalloc(size_t size, mm_t mm_flags);
  */
 void kfree(void* ptr);
 
+/**
+ * @brief Get the usable size of an allocation
+ *
+ * This is the size of the size class the allocation came from, which can be more than
+ * what was asked for. With CONFIG_HEAP_HARDENING, it's what was asked for rounded up
+ * to 8 bytes, since anything past that is the canary.
+ *
+ * @param ptr The allocation, can be NULL
+ *
+ * @return The usable size of the allocation
+ */
+size_t ksize(const void* ptr);
+
 /**
  * @brief Resize a block of memory
  *
- * If `old` is NULL, this function just returns kmalloc(new_size).
+ * If `old` is NULL, this function just returns kmalloc(new_size). When the size class
+ * of `old` can still hold new_size, `old` is returned as it is. With MM_ZERO, only the
+ * memory past ksize(old) is zeroed.
  *
  * @param old The old pointer
  * @param new_size The size of the new block
@@ -122,11 +227,33 @@ void kfree(void* ptr);
  */
 void* krealloc(void* old, size_t new_size, mm_t mm_flags);
 
+/**
+ * @brief Allocate many blocks of kernel memory of the same size
+ *
+ * Sizes that are backed by a slab cache take the cache lock once for all of the blocks.
+ *
+ * @param size The size of every allocation
+ * @param mm_flags Conditions for the allocations
+ * @param count The number of allocations
+ * @param ptrs Where the pointers are stored, must have room for count pointers
+ *
+ * @retval 0 Success
+ * @retval -ENOMEM There is no memory, nothing was allocated
+ */
+int kmalloc_bulk(size_t size, mm_t mm_flags, size_t count, void** ptrs);
+
+/**
+ * @brief Free many blocks of kernel memory
+ *
+ * Runs of blocks from the same slab cache are freed together. NULL pointers are skipped.
+ *
+ * @param count The number of pointers
+ * @param ptrs The pointers to free
+ */
+void kfree_bulk(size_t count, void** ptrs);
+
 static inline void* kzalloc(size_t size, mm_t mm_flags) {
-	void* ptr = kmalloc(size, mm_flags);
-	if (ptr)
-		memset(ptr, 0, size);
-	return ptr;
+	return kmalloc(size, mm_flags | MM_ZERO);
 }
 
 static inline void* kcalloc(size_t ecount, size_t esize, mm_t mm_flags) {
@@ -28,6 +28,18 @@ struct mm* current_mm(void);
  */
 void vm_pagetable_teardown_leaf(physaddr_t address);
 
+/**
+ * @brief Check if a page fault was caused by a page being migrated
+ *
+ * Writes to a page fault while compaction copies it to another physical page. The
+ * fault handler just returns so the write is retried, which succeeds once the new
+ * page is mapped.
+ *
+ * @param address The faulting address
+ * @return true if the fault should be retried
+ */
+bool vm_fault_is_migration(uintptr_t address);
+
 /**
  * @brief Map pages into kernel space
  *
@@ -91,6 +103,19 @@ int vm_unmap(void* virtual, size_t page_count, int flags);
  */
 void vm_unmap_force(void* virtual, size_t page_count, int flags);
 
+/**
+ * @brief Unmap kernel pages without flushing the TLB right away
+ *
+ * The pages are kept and the addresses stay reserved until the next lazy purge, which
+ * flushes the TLB of every CPU once for everything vfree() and this function left behind.
+ * Pages in the range that aren't mapped are skipped. Falls back to vm_unmap_force when
+ * there is no memory to keep track of the pages.
+ *
+ * @param virtual The virtual address to unmap
+ * @param page_count The number of pages to unmap
+ */
+void vm_unmap_lazy(void* virtual, size_t page_count);
+
 /**
  * @brief Map pages into user space
  *
@@ -161,6 +186,10 @@ void* vmalloc(size_t size);
 /**
  * @brief Re-allocate memory allocated by vmalloc()
  *
+ * Shrinking happens in place. Growing maps new pages right after the memory when nothing
+ * else is mapped there, otherwise the pages are mapped again at a new address along with
+ * the new ones, so the contents are never copied.
+ *
  * @param ptr The original pointer
  * @param size The new size
  *
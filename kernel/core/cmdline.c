@@ -21,6 +21,35 @@ const char* cmdline_get(const char* arg) {
 	return ret;
 }
 
+int cmdline_get_early(const char* arg, char* out, size_t size) {
+	const struct limine_executable_file_response* response = g_limine_executable_file_request.response;
+	if (!response || !response->executable_file->string)
+		return -ENOENT;
+
+	const size_t arg_len = strlen(arg);
+	const char* tok = response->executable_file->string;
+	while (*tok) {
+		while (*tok == ' ')
+			tok++;
+		size_t tok_len = 0;
+		while (tok[tok_len] && tok[tok_len] != ' ')
+			tok_len++;
+
+		if (tok_len > arg_len && tok[arg_len] == '=' && strncmp(tok, arg, arg_len) == 0) {
+			size_t value_len = tok_len - arg_len - 1;
+			if (value_len >= size)
+				return -E2BIG;
+			memcpy(out, tok + arg_len + 1, value_len);
+			out[value_len] = '\0';
+			return 0;
+		}
+
+		tok += tok_len;
+	}
+
+	return -ENOENT;
+}
+
 static void cmdline_init(void) {
 	const struct limine_executable_file_response* response = g_limine_executable_file_request.response;
 	if (!response)
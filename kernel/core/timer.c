@@ -190,6 +190,19 @@ void do_timer_events(struct timer* source) {
 		spinlock_release(&timer_lock);
 }
 
+/* An event is off every list by the time it's freed, and always goes back to the cache it came from */
+static void event_ctor(void* obj) {
+	struct timer_event* event = obj;
+	event->cache = event_cache;
+	list_node_init(&event->link);
+}
+
+static void atomic_event_ctor(void* obj) {
+	struct timer_event* event = obj;
+	event->cache = atomic_event_cache;
+	list_node_init(&event->link);
+}
+
 void* alloc_timer_event_handle(int flags) {
 	if (flags & TIMER_FLAG_EVENT_ALLOC_AUTOFREE)
 		flags |= TIMER_FLAG_EVENT_ALLOC_ATOMIC;
@@ -202,14 +215,14 @@ void* alloc_timer_event_handle(int flags) {
 		ret->timer = NULL;
 		ret->handler = (struct timer_event_handler){ .fn = NULL, .arg = NULL };
 		ret->flags = flags & (TIMER_FLAG_EVENT_ALLOC_ATOMIC | TIMER_FLAG_EVENT_ALLOC_AUTOFREE);
-		ret->cache = cache;
-		list_node_init(&ret->link);
 	}
 	return ret;
 }
 
 void free_timer_event_handle(void* handle) {
-	slab_cache_free(((struct timer_event*)handle)->cache, handle);
+	struct timer_event* event = handle;
+	bug(list_node_linked(&event->link));
+	slab_cache_free(event->cache, event);
 }
 
 int arm_timer_event_handle(void* handle, time_t us, const struct timer_event_handler* handler, int flags) {
@@ -342,8 +355,8 @@ static void timers_init(void) {
 
 	const size_t te_sz = sizeof(struct timer_event);
 	const size_t te_align = alignof(struct timer_event);
-	event_cache = slab_cache_create(te_sz, te_align, MM_ZONE_NORMAL, NULL, NULL);
-	atomic_event_cache = slab_cache_create(te_sz, te_align, MM_ZONE_NORMAL | MM_ATOMIC, NULL, NULL);
+	event_cache = slab_cache_create(te_sz, te_align, MM_ZONE_NORMAL, event_ctor, NULL);
+	atomic_event_cache = slab_cache_create(te_sz, te_align, MM_ZONE_NORMAL | MM_ATOMIC, atomic_event_ctor, NULL);
 	if (!event_cache || !atomic_event_cache)
 		out_of_memory();
 
@@ -1,5 +1,6 @@
 #include <lunar/printk.h>
 #include <lunar/input.h>
+#include <lunar/mm.h>
 #include <acpi/sleep.h>
 #include "internal.h"
 
@@ -46,13 +47,34 @@ static int sysrq_loglevel(unsigned int keycode) {
 	return -EINVAL;
 }
 
+static int sysrq_meminfo(unsigned int keycode) {
+	(void)keycode;
+	mm_dump_stats();
+	return 0;
+}
+
+static int sysrq_mmareas(unsigned int keycode) {
+	(void)keycode;
+	mm_dump_areas();
+	return 0;
+}
+
+static int sysrq_mmbench(unsigned int keycode) {
+	(void)keycode;
+	mm_run_benchmarks();
+	return 0;
+}
+
 static unsigned int loglevel_keycodes[] = {
 	KEYCODE_0, KEYCODE_1, KEYCODE_2, KEYCODE_3, KEYCODE_4, KEYCODE_5, KEYCODE_6, KEYCODE_RESERVED
 };
 
 static struct sysrq sysrq_arr[] = {
 	{ .name = "reboot", .multiple_keycodes = false, .keycode = KEYCODE_B, .help = "Reboot the system (b)", .func = sysrq_reboot },
-	{ .name = "loglevel", .multiple_keycodes = true, .keycodes = loglevel_keycodes, .help = "Set the loglevel (0,6)", .func = sysrq_loglevel }
+	{ .name = "loglevel", .multiple_keycodes = true, .keycodes = loglevel_keycodes, .help = "Set the loglevel (0,6)", .func = sysrq_loglevel },
+	{ .name = "meminfo", .multiple_keycodes = false, .keycode = KEYCODE_M, .help = "Dump memory allocator statistics (m)", .func = sysrq_meminfo },
+	{ .name = "mmareas", .multiple_keycodes = false, .keycode = KEYCODE_A, .help = "Dump memory areas (a)", .func = sysrq_mmareas },
+	{ .name = "mmbench", .multiple_keycodes = false, .keycode = KEYCODE_P, .help = "Run memory allocator benchmarks (p)", .func = sysrq_mmbench }
 };
 
 void do_sysrq(unsigned int keycode) {
@@ -0,0 +1,161 @@
+#include <lunar/common.h>
+#include <lunar/avltree.h>
+
+static inline int avl_height(const struct avl_node* node) {
+	return node ? node->height : 0;
+}
+
+/* Recompute the height and the augmented data of a node from its children */
+static void avl_fix(struct avl_tree* tree, struct avl_node* node) {
+	const int left = avl_height(node->left);
+	const int right = avl_height(node->right);
+	node->height = (left > right ? left : right) + 1;
+	if (tree->augment)
+		tree->augment(node);
+}
+
+static void avl_replace_child(struct avl_tree* tree, struct avl_node* parent, struct avl_node* old, struct avl_node* new) {
+	if (!parent)
+		tree->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static struct avl_node* avl_rotate_left(struct avl_tree* tree, struct avl_node* node) {
+	struct avl_node* right = node->right;
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+	right->parent = node->parent;
+	avl_replace_child(tree, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
+
+	avl_fix(tree, node);
+	avl_fix(tree, right);
+	return right;
+}
+
+static struct avl_node* avl_rotate_right(struct avl_tree* tree, struct avl_node* node) {
+	struct avl_node* left = node->left;
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+	left->parent = node->parent;
+	avl_replace_child(tree, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+
+	avl_fix(tree, node);
+	avl_fix(tree, left);
+	return left;
+}
+
+/* Rebalance from a node up to the root, every node on the way is fixed so the augmented data stays right */
+static void avl_rebalance(struct avl_tree* tree, struct avl_node* node) {
+	while (node) {
+		avl_fix(tree, node);
+		const int balance = avl_height(node->left) - avl_height(node->right);
+		if (balance > 1) {
+			if (avl_height(node->left->left) < avl_height(node->left->right))
+				avl_rotate_left(tree, node->left);
+			node = avl_rotate_right(tree, node);
+		} else if (balance < -1) {
+			if (avl_height(node->right->right) < avl_height(node->right->left))
+				avl_rotate_right(tree, node->right);
+			node = avl_rotate_left(tree, node);
+		}
+		node = node->parent;
+	}
+}
+
+void avl_insert(struct avl_tree* tree, struct avl_node* node, struct avl_node* parent, struct avl_node** link) {
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 1;
+	*link = node;
+	avl_rebalance(tree, node);
+}
+
+void avl_erase(struct avl_tree* tree, struct avl_node* node) {
+	struct avl_node* start;
+	if (!node->left || !node->right) {
+		struct avl_node* child = node->left ? node->left : node->right;
+		if (child)
+			child->parent = node->parent;
+		avl_replace_child(tree, node->parent, node, child);
+		start = node->parent;
+	} else {
+		/* The successor takes the place of the node */
+		struct avl_node* successor = node->right;
+		while (successor->left)
+			successor = successor->left;
+
+		if (successor->parent != node) {
+			start = successor->parent;
+			start->left = successor->right;
+			if (successor->right)
+				successor->right->parent = start;
+			successor->right = node->right;
+			node->right->parent = successor;
+		} else {
+			start = successor;
+		}
+
+		successor->left = node->left;
+		node->left->parent = successor;
+		successor->parent = node->parent;
+		successor->height = node->height;
+		avl_replace_child(tree, node->parent, node, successor);
+	}
+
+	avl_rebalance(tree, start);
+}
+
+void avl_propagate(struct avl_tree* tree, struct avl_node* node) {
+	if (!tree->augment)
+		return;
+	for (; node; node = node->parent)
+		tree->augment(node);
+}
+
+struct avl_node* avl_first(const struct avl_tree* tree) {
+	struct avl_node* node = tree->root;
+	while (node && node->left)
+		node = node->left;
+	return node;
+}
+
+struct avl_node* avl_last(const struct avl_tree* tree) {
+	struct avl_node* node = tree->root;
+	while (node && node->right)
+		node = node->right;
+	return node;
+}
+
+struct avl_node* avl_next(const struct avl_node* node) {
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct avl_node*)node;
+	}
+	while (node->parent && node->parent->right == node)
+		node = node->parent;
+	return node->parent;
+}
+
+struct avl_node* avl_prev(const struct avl_node* node) {
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct avl_node*)node;
+	}
+	while (node->parent && node->parent->left == node)
+		node = node->parent;
+	return node->parent;
+}
@@ -0,0 +1,434 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/vmm.h>
+#include <lunar/slab.h>
+#include <lunar/string.h>
+#include <lunar/printk.h>
+#include <lunar/panic.h>
+#include <lunar/timekeeper.h>
+
+#include "internal.h"
+
+/*
+ * Small benchmarks for the memory allocators, run from sysrq. Every benchmark prints its own
+ * results, the numbers are only meant to be compared between runs on the same machine.
+ */
+
+struct mm_bench {
+	const char* name;
+	void (*func)(void);
+};
+
+static inline time_t bench_now_ns(void) {
+	return timespec_ns(time_fromboot());
+}
+
+static inline unsigned long long bench_rate(size_t count, time_t ns) {
+	return (unsigned long long)count * 1000000000ull / (ns > 0 ? (unsigned long long)ns : 1);
+}
+
+#define VMALLOC_BENCH_SIZE (64ul << 20)
+#define VMALLOC_BENCH_ITERATIONS 8
+
+static void bench_vmalloc(void) {
+	const size_t page_count = VMALLOC_BENCH_SIZE >> PAGE_SHIFT;
+	time_t total = 0;
+	unsigned int done = 0;
+	for (; done < VMALLOC_BENCH_ITERATIONS; done++) {
+		time_t start = bench_now_ns();
+		void* ptr = vmalloc(VMALLOC_BENCH_SIZE);
+		total += bench_now_ns() - start;
+		if (!ptr)
+			break;
+		vfree(ptr);
+	}
+
+	printk(PRINTK_INFO "mm: bench vmalloc(%lu MiB) x%u: %lld us total, %llu pages/s\n",
+			VMALLOC_BENCH_SIZE >> 20, done, (long long)(total / 1000), bench_rate(page_count * done, total));
+}
+
+static void bench_alloc_pages_bulk(void) {
+	const size_t page_count = VMALLOC_BENCH_SIZE >> PAGE_SHIFT;
+	struct page** pages = vmalloc(page_count * sizeof(*pages));
+	if (!pages)
+		return;
+
+	/* Compare single page allocations to bulk allocations of the same size */
+	time_t start = bench_now_ns();
+	size_t single = 0;
+	for (; single < page_count; single++) {
+		pages[single] = alloc_page(MM_ZONE_NORMAL);
+		if (!pages[single])
+			break;
+	}
+	time_t single_ns = bench_now_ns() - start;
+	for (size_t i = 0; i < single; i++)
+		release_page(pages[i]);
+
+	start = bench_now_ns();
+	size_t bulk = alloc_pages_bulk(MM_ZONE_NORMAL, page_count, pages);
+	time_t bulk_ns = bench_now_ns() - start;
+	for (size_t i = 0; i < bulk; i++)
+		release_page(pages[i]);
+
+	printk(PRINTK_INFO "mm: bench alloc_page() x%zu: %llu pages/s, alloc_pages_bulk(%zu): %llu pages/s\n",
+			single, bench_rate(single, single_ns), bulk, bench_rate(bulk, bulk_ns));
+	vfree(pages);
+}
+
+#define CMA_BENCH_ROUNDS 32
+#define CMA_BENCH_BUFFERS 64
+#define CMA_BENCH_MAX_PAGES 64
+#define CMA_BENCH_SIZE (4ul << 20)
+
+static inline u32 bench_random(u32* state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/* Returns false if a buffer changed, which means a page was moved wrong */
+static bool bench_cma_check(const u8* buf, size_t size, u8 pattern) {
+	for (size_t i = 0; i < size; i++) {
+		if (buf[i] != pattern)
+			return false;
+	}
+	return true;
+}
+
+/* Churn vmalloc() buffers, which borrow from the contiguous region, between contiguous allocations that have to move them */
+static void bench_cma(void) {
+	u8* bufs[CMA_BENCH_BUFFERS] = { NULL };
+	size_t sizes[CMA_BENCH_BUFFERS];
+	u8 patterns[CMA_BENCH_BUFFERS];
+	u32 state = 0x2545f491;
+	unsigned int done = 0, corrupted = 0;
+	time_t total = 0;
+
+	for (unsigned int round = 0; round < CMA_BENCH_ROUNDS; round++) {
+		for (unsigned int n = 0; n < CMA_BENCH_BUFFERS / 2; n++) {
+			const unsigned int slot = bench_random(&state) % CMA_BENCH_BUFFERS;
+			if (bufs[slot]) {
+				corrupted += !bench_cma_check(bufs[slot], sizes[slot], patterns[slot]);
+				vfree(bufs[slot]);
+			}
+
+			sizes[slot] = ((bench_random(&state) % CMA_BENCH_MAX_PAGES) + 1) << PAGE_SHIFT;
+			patterns[slot] = bench_random(&state);
+			bufs[slot] = vmalloc(sizes[slot]);
+			if (bufs[slot])
+				memset(bufs[slot], patterns[slot], sizes[slot]);
+		}
+
+		time_t start = bench_now_ns();
+		struct page* page = dma_alloc_contiguous(CMA_BENCH_SIZE, MM_ZONE_DMA32);
+		total += bench_now_ns() - start;
+		if (!page)
+			continue;
+		memset(page_hhdm_virtual(page), 0xa5, CMA_BENCH_SIZE);
+		dma_free_contiguous(page, CMA_BENCH_SIZE);
+		done++;
+	}
+
+	for (unsigned int slot = 0; slot < CMA_BENCH_BUFFERS; slot++) {
+		if (!bufs[slot])
+			continue;
+		corrupted += !bench_cma_check(bufs[slot], sizes[slot], patterns[slot]);
+		vfree(bufs[slot]);
+	}
+
+	printk(PRINTK_INFO "mm: bench dma_alloc_contiguous(%lu MiB) %u/%u succeeded, %lld us average, %u buffers corrupted\n",
+			CMA_BENCH_SIZE >> 20, done, CMA_BENCH_ROUNDS, (long long)(total / 1000 / CMA_BENCH_ROUNDS), corrupted);
+	mm_dump_stats();
+}
+
+#define VMALLOC_CHURN_REGIONS 100000
+#define VMALLOC_CHURN_ROUNDS 4
+
+/* Keep a lot of small regions around and free and allocate random ones, which is what the region tree is for */
+static void bench_vmalloc_churn(void) {
+	void** regions = vmalloc(VMALLOC_CHURN_REGIONS * sizeof(*regions));
+	if (!regions)
+		return;
+
+	size_t count = 0;
+	time_t start = bench_now_ns();
+	for (; count < VMALLOC_CHURN_REGIONS; count++) {
+		regions[count] = vmalloc(PAGE_SIZE);
+		if (!regions[count])
+			break;
+	}
+	const time_t fill = bench_now_ns() - start;
+
+	u32 state = 0x5eed;
+	unsigned long ops = 0, failures = 0;
+	start = bench_now_ns();
+	for (size_t i = 0; count && i < count * VMALLOC_CHURN_ROUNDS; i++) {
+		const size_t slot = bench_random(&state) % count;
+		vfree(regions[slot]);
+		regions[slot] = vmalloc(((bench_random(&state) % 4) + 1) << PAGE_SHIFT);
+		failures += !regions[slot];
+		ops++;
+	}
+	const time_t churn = bench_now_ns() - start;
+
+	for (size_t i = 0; i < count; i++)
+		vfree(regions[i]);
+	vfree(regions);
+
+	printk(PRINTK_INFO "mm: bench vmalloc churn over %zu regions: %lld ns per vmalloc() to fill, %lld ns per vfree() and vmalloc() after, %lu failures\n",
+			count, (long long)(fill / (count ? count : 1)), (long long)(churn / (ops ? ops : 1)), failures);
+}
+
+#define VFREE_BENCH_REGIONS 4096
+#define VFREE_BENCH_PAGES 4 /* About a kernel stack */
+
+/* Free a lot of small regions in a row, like the reaper does with thread stacks */
+static void bench_vfree(void) {
+	void** regions = vmalloc(VFREE_BENCH_REGIONS * sizeof(*regions));
+	if (!regions)
+		return;
+
+	size_t count = 0;
+	for (; count < VFREE_BENCH_REGIONS; count++) {
+		regions[count] = vmalloc(VFREE_BENCH_PAGES << PAGE_SHIFT);
+		if (!regions[count])
+			break;
+	}
+
+	const long saved = vmalloc_lazy_ipis_saved();
+	const time_t start = bench_now_ns();
+	for (size_t i = 0; i < count; i++)
+		vfree(regions[i]);
+	const time_t total = bench_now_ns() - start;
+	const long ipis = vmalloc_lazy_ipis_saved() - saved;
+	vfree(regions);
+
+	printk(PRINTK_INFO "mm: bench vfree(%lu KiB) x%zu: %lld ns average, %ld IPIs saved, %llu IPIs saved per second\n",
+			(unsigned long)((VFREE_BENCH_PAGES << PAGE_SHIFT) >> 10), count, (long long)(total / (count ? count : 1)), ipis,
+			bench_rate(ipis > 0 ? ipis : 0, total));
+}
+
+#define PAGE_CHURN_SLOTS 4096
+#define PAGE_CHURN_ITERATIONS (1ul << 20)
+#define PAGE_CHURN_MAX_ORDER (PAGE_CACHE_MAX_ORDER + 2) /* Some of the orders skip the page cache */
+#define BENCH_CACHE_LINE 64
+
+/*
+ * Random allocations and frees of small blocks, which is mostly struct page traffic on the buddy free lists. There's
+ * no way to read the cache miss counters, so the descriptor footprint is printed next to the time instead.
+ */
+static void bench_page_churn(void) {
+	struct page** slots = vmalloc(PAGE_CHURN_SLOTS * sizeof(*slots));
+	if (!slots)
+		return;
+	memset(slots, 0, PAGE_CHURN_SLOTS * sizeof(*slots));
+
+	u32 state = 0x9e3779b9;
+	unsigned long failures = 0;
+	time_t start = bench_now_ns();
+	for (unsigned long i = 0; i < PAGE_CHURN_ITERATIONS; i++) {
+		const u32 random = bench_random(&state);
+		struct page** slot = &slots[random % PAGE_CHURN_SLOTS];
+		if (*slot)
+			release_page(*slot);
+		*slot = alloc_pages(MM_ZONE_NORMAL, (random >> 16) % (PAGE_CHURN_MAX_ORDER + 1));
+		failures += !*slot;
+	}
+	time_t total = bench_now_ns() - start;
+
+	for (size_t i = 0; i < PAGE_CHURN_SLOTS; i++) {
+		if (slots[i])
+			release_page(slots[i]);
+	}
+	vfree(slots);
+
+	size_t total_pages, free_pages;
+	mm_get_free_pages(&total_pages, &free_pages);
+	printk(PRINTK_INFO "mm: bench page churn x%lu: %lld ns average, %lu failures\n",
+			PAGE_CHURN_ITERATIONS, (long long)(total / PAGE_CHURN_ITERATIONS), failures);
+	printk(PRINTK_INFO "mm: bench struct page is %zu bytes, %zu per cache line, %zu KiB for %zu pages\n",
+			sizeof(struct page), BENCH_CACHE_LINE / sizeof(struct page), (total_pages * sizeof(struct page)) >> 10, total_pages);
+}
+
+#define SLAB_BENCH_OBJECTS (1ul << 20)
+#define SLAB_BENCH_OBJ_SIZE 32
+
+/* Returns the time it took to free everything, or -1 if the objects couldn't be allocated */
+static time_t bench_slab_free_pass(struct slab_cache* cache, void** objs) {
+	size_t count = 0;
+	for (; count < SLAB_BENCH_OBJECTS; count++) {
+		objs[count] = slab_cache_alloc(cache);
+		if (!objs[count])
+			break;
+	}
+
+	/* Free in a different order than the objects were allocated, so the slabs are all over the place */
+	u32 state = 0xdeadbeef;
+	for (size_t i = count; i > 1; i--) {
+		const size_t j = bench_random(&state) % i;
+		void* tmp = objs[i - 1];
+		objs[i - 1] = objs[j];
+		objs[j] = tmp;
+	}
+
+	time_t start = bench_now_ns();
+	for (size_t i = 0; i < count; i++)
+		slab_cache_free(cache, objs[i]);
+	time_t total = bench_now_ns() - start;
+	return count == SLAB_BENCH_OBJECTS ? total : -1;
+}
+
+/* The first pass goes straight to the slabs, which is where the lookup happens */
+static void bench_slab_free(void) {
+	void** objs = vmalloc(SLAB_BENCH_OBJECTS * sizeof(*objs));
+	if (!objs)
+		return;
+	struct slab_cache* cache = slab_cache_create(SLAB_BENCH_OBJ_SIZE, 0, MM_ZONE_NORMAL, NULL, NULL);
+	if (!cache) {
+		vfree(objs);
+		return;
+	}
+
+	slab_cache_tune(cache, 0, 0);
+	const time_t slabs = bench_slab_free_pass(cache, objs);
+	slab_cache_tune(cache, SLAB_MAGAZINE_MAX, 8);
+	const time_t magazines = bench_slab_free_pass(cache, objs);
+	if (slabs < 0 || magazines < 0)
+		printk(PRINTK_ERR "mm: bench slab_cache_free() couldn't allocate %lu objects\n", SLAB_BENCH_OBJECTS);
+	else
+		printk(PRINTK_INFO "mm: bench slab_cache_free() x%lu: %lld ns average to the slabs, %lld ns average with magazines\n",
+				SLAB_BENCH_OBJECTS, (long long)(slabs / SLAB_BENCH_OBJECTS), (long long)(magazines / SLAB_BENCH_OBJECTS));
+
+	bug(slab_cache_destroy(cache) != 0);
+	vfree(objs);
+}
+
+#define SLAB_COLOR_BENCH_SLABS 512
+#define SLAB_COLOR_BENCH_OBJ_SIZE 600 /* Leaves enough of a page over for 8 colors */
+#define SLAB_COLOR_BENCH_ROUNDS 2048
+
+/* Time walking the first object of every slab, which all land on the same cache sets without coloring */
+static time_t bench_slab_color_pass(bool coloring, void** objs, size_t max_objs) {
+	struct slab_cache* cache = slab_cache_create(SLAB_COLOR_BENCH_OBJ_SIZE, 0, MM_ZONE_NORMAL, NULL, NULL);
+	if (!cache)
+		return -1;
+	slab_cache_set_coloring(cache, coloring);
+	slab_cache_tune(cache, 0, 0); /* So the objects come out of the slabs in order */
+
+	const size_t per_slab = cache->obj_count;
+	const size_t count = per_slab * SLAB_COLOR_BENCH_SLABS < max_objs ? per_slab * SLAB_COLOR_BENCH_SLABS : max_objs;
+	size_t allocated = 0;
+	for (; allocated < count; allocated++) {
+		objs[allocated] = slab_cache_alloc(cache);
+		if (!objs[allocated])
+			break;
+		*(volatile unsigned long*)objs[allocated] = allocated;
+	}
+
+	time_t total = -1;
+	if (allocated == count) {
+		unsigned long sum = 0;
+		time_t start = bench_now_ns();
+		for (unsigned int round = 0; round < SLAB_COLOR_BENCH_ROUNDS; round++) {
+			for (size_t i = 0; i < count; i += per_slab)
+				sum += *(volatile unsigned long*)objs[i];
+		}
+		total = bench_now_ns() - start;
+		(void)sum;
+	}
+
+	for (size_t i = 0; i < allocated; i++)
+		slab_cache_free(cache, objs[i]);
+	bug(slab_cache_destroy(cache) != 0);
+	return total;
+}
+
+static void bench_slab_color(void) {
+	const size_t max_objs = (PAGE_SIZE / SLAB_COLOR_BENCH_OBJ_SIZE) * SLAB_COLOR_BENCH_SLABS;
+	void** objs = vmalloc(max_objs * sizeof(*objs));
+	if (!objs)
+		return;
+
+	const time_t plain = bench_slab_color_pass(false, objs, max_objs);
+	const time_t colored = bench_slab_color_pass(true, objs, max_objs);
+	if (plain < 0 || colored < 0) {
+		printk(PRINTK_ERR "mm: bench slab coloring couldn't allocate %u slabs\n", SLAB_COLOR_BENCH_SLABS);
+	} else {
+		const size_t loads = SLAB_COLOR_BENCH_SLABS * SLAB_COLOR_BENCH_ROUNDS;
+		printk(PRINTK_INFO "mm: bench slab walk over %u slabs x%u: %lld ps per load without coloring, %lld ps with coloring\n",
+				SLAB_COLOR_BENCH_SLABS, SLAB_COLOR_BENCH_ROUNDS, (long long)(plain * 1000 / loads),
+				(long long)(colored * 1000 / loads));
+	}
+	vfree(objs);
+}
+
+#define KMALLOC_BENCH_COUNT 16384
+
+static const size_t kmalloc_bench_sizes[] = { 8, 24, 40, 72, 100, 136, 200, 300 };
+
+/* What a kmalloc of this size used to take, when every cache was a power of two from 256 bytes */
+static size_t kmalloc_bench_old_size(size_t size) {
+	size_t total = ROUND_UP(size, 16) + 32 + sizeof(size_t);
+	size_t old = 256;
+	while (old < total)
+		old <<= 1;
+	return old;
+}
+
+static void bench_kmalloc(void) {
+	void** objs = vmalloc(KMALLOC_BENCH_COUNT * sizeof(*objs));
+	if (!objs)
+		return;
+
+	for (size_t i = 0; i < ARRAY_SIZE(kmalloc_bench_sizes); i++) {
+		const size_t size = kmalloc_bench_sizes[i];
+		size_t total, free_before, free_after;
+		mm_get_free_pages(&total, &free_before);
+
+		time_t start = bench_now_ns();
+		size_t allocated = 0;
+		for (; allocated < KMALLOC_BENCH_COUNT; allocated++) {
+			objs[allocated] = kmalloc(size, MM_ZONE_NORMAL);
+			if (!objs[allocated])
+				break;
+		}
+		const time_t alloc_ns = bench_now_ns() - start;
+		mm_get_free_pages(&total, &free_after);
+
+		start = bench_now_ns();
+		for (size_t j = 0; j < allocated; j++)
+			kfree(objs[j]);
+		const time_t free_ns = bench_now_ns() - start;
+
+		/* Other allocations can happen at the same time, so the footprint is only roughly right */
+		const size_t used = free_before > free_after ? (free_before - free_after) << PAGE_SHIFT : 0;
+		printk(PRINTK_INFO "mm: bench kmalloc(%zu) x%zu: %lld ns alloc, %lld ns free, ~%zu bytes per object (was %zu)\n",
+				size, allocated, (long long)(alloc_ns / (allocated ? allocated : 1)),
+				(long long)(free_ns / (allocated ? allocated : 1)), used / (allocated ? allocated : 1),
+				kmalloc_bench_old_size(size));
+	}
+
+	vfree(objs);
+}
+
+static const struct mm_bench benchmarks[] = {
+	{ .name = "alloc_pages_bulk", .func = bench_alloc_pages_bulk },
+	{ .name = "page_churn", .func = bench_page_churn },
+	{ .name = "slab_free", .func = bench_slab_free },
+	{ .name = "slab_color", .func = bench_slab_color },
+	{ .name = "kmalloc", .func = bench_kmalloc },
+	{ .name = "vmalloc", .func = bench_vmalloc },
+	{ .name = "vmalloc_churn", .func = bench_vmalloc_churn },
+	{ .name = "vfree", .func = bench_vfree },
+	{ .name = "cma", .func = bench_cma }
+};
+
+void mm_run_benchmarks(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+		printk(PRINTK_INFO "mm: Running benchmark %s\n", benchmarks[i].name);
+		benchmarks[i].func();
+	}
+}
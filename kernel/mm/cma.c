@@ -0,0 +1,337 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/sched.h>
+#include <lunar/spinlock.h>
+#include <lunar/string.h>
+#include <lunar/printk.h>
+#include <lunar/panic.h>
+#include <lunar/cmdline.h>
+#include <lunar/convert.h>
+
+#include "internal.h"
+
+/*
+ * The contiguous memory region is taken out of memblock at boot, so the buddy allocator never sees it. While
+ * nothing needs it, movable allocations borrow pages from the top of it. dma_alloc_contiguous() isolates a run
+ * from the bottom, so nothing new lands in it, and moves whatever is borrowing the run somewhere else.
+ */
+
+#define CMA_ALIGN (PAGE_SIZE << MAX_ORDER)
+#define CMA_DMA32_START 0x1000000
+#define CMA_DMA32_END 0x100000000
+#define CMA_MIGRATE_ATTEMPTS 16 /* Per page, a page that isn't mapped yet can't be moved */
+
+#define ULONG_BITS (sizeof(unsigned long) * 8)
+
+static physaddr_t cma_base = 0;
+static size_t cma_page_count = 0;
+static unsigned long* cma_used = NULL; /* Page is allocated, either borrowed or part of a contiguous allocation */
+static unsigned long* cma_isolated = NULL; /* Page is in a contiguous allocation, or one being made */
+static size_t cma_free_count = 0;
+static size_t cma_movable_hint = 0; /* Where the last borrowed page was found, searches go down from here */
+static SPINLOCK_DEFINE(cma_lock);
+
+static atomic(unsigned int) cma_busy = atomic_init(0); /* Contiguous allocations in progress */
+static atomic(unsigned long) cma_borrowed = atomic_init(0);
+static atomic(unsigned long) cma_contig_allocs = atomic_init(0);
+static atomic(unsigned long) cma_contig_failures = atomic_init(0);
+static atomic(unsigned long) cma_fallbacks = atomic_init(0);
+static atomic(unsigned long) cma_migrated = atomic_init(0);
+
+static inline bool cma_test(const unsigned long* bitmap, size_t i) {
+	return bitmap[i / ULONG_BITS] & (1ul << (i % ULONG_BITS));
+}
+
+static inline void cma_set(unsigned long* bitmap, size_t i) {
+	bitmap[i / ULONG_BITS] |= 1ul << (i % ULONG_BITS);
+}
+
+static inline void cma_clear(unsigned long* bitmap, size_t i) {
+	bitmap[i / ULONG_BITS] &= ~(1ul << (i % ULONG_BITS));
+}
+
+static inline struct page* cma_page(size_t i) {
+	return physaddr_to_page(cma_base + ((physaddr_t)i << PAGE_SHIFT));
+}
+
+static inline size_t cma_index(const struct page* page) {
+	return (page_to_physaddr(page) - cma_base) >> PAGE_SHIFT;
+}
+
+/* DMA allocations can't use the region if it's above what they can address */
+static bool cma_usable(mm_t mm_flags) {
+	if (!cma_page_count)
+		return false;
+	if ((mm_flags & (MM_ZONE_DMA | MM_ZONE_DMA32 | MM_ZONE_NORMAL)) == 0 || mm_flags & MM_ZONE_NORMAL)
+		return true;
+	return mm_flags & MM_ZONE_DMA32 && cma_base + ((physaddr_t)cma_page_count << PAGE_SHIFT) <= CMA_DMA32_END;
+}
+
+/* Find a page that's neither used nor isolated, searching down from the hint and wrapping around once */
+static size_t cma_find_free(void) {
+	const size_t word_count = (cma_page_count + ULONG_BITS - 1) / ULONG_BITS;
+	size_t word = cma_movable_hint / ULONG_BITS;
+	for (size_t n = 0; n < word_count; n++) {
+		unsigned long free = ~(cma_used[word] | cma_isolated[word]);
+		if (word == word_count - 1 && cma_page_count % ULONG_BITS)
+			free &= (1ul << (cma_page_count % ULONG_BITS)) - 1;
+		if (free)
+			return word * ULONG_BITS + ULONG_BITS - 1 - __builtin_clzl(free);
+		word = word ? word - 1 : word_count - 1;
+	}
+	return SIZE_MAX;
+}
+
+size_t cma_alloc_movable(mm_t mm_flags, size_t count, struct page** out) {
+	if (!cma_usable(mm_flags) || atomic_load(&cma_busy))
+		return 0;
+
+	size_t got = 0;
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+	while (got < count && cma_free_count) {
+		const size_t i = cma_find_free();
+		if (i == SIZE_MAX)
+			break;
+		cma_set(cma_used, i);
+		cma_free_count--;
+		cma_movable_hint = i;
+		out[got++] = cma_page(i);
+	}
+	spinlock_release_irq_restore(&cma_lock, &irq_flags);
+
+	for (size_t i = 0; i < got; i++) {
+		bug(atomic_load(&out[i]->refcnt) != 0);
+		hold_page(out[i]);
+		if (mm_flags & MM_ZERO)
+			memset(page_hhdm_virtual(out[i]), 0, PAGE_SIZE);
+	}
+	if (got) {
+		mm_account_pages(got);
+		atomic_add_fetch(&cma_borrowed, got);
+	}
+	return got;
+}
+
+void cma_release_page(struct page* page) {
+	const size_t i = cma_index(page);
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+	bug(!cma_test(cma_used, i));
+	cma_clear(cma_used, i);
+	cma_free_count++;
+	spinlock_release_irq_restore(&cma_lock, &irq_flags);
+	mm_account_pages(-1);
+}
+
+/*
+ * Isolate the pages in [first, first + count), returns SIZE_MAX on success. Otherwise nothing is isolated, and the
+ * index of the page that was in the way is returned. Atomic allocations can't move pages, so borrowed pages are in
+ * the way for them.
+ */
+static size_t cma_isolate(size_t first, size_t count, bool atomic) {
+	size_t ret = SIZE_MAX;
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+	for (size_t i = first + count; i-- > first;) {
+		if (cma_test(cma_isolated, i) || (atomic && cma_test(cma_used, i))) {
+			ret = i;
+			break;
+		}
+	}
+	if (ret == SIZE_MAX) {
+		for (size_t i = first; i < first + count; i++)
+			cma_set(cma_isolated, i);
+	}
+	spinlock_release_irq_restore(&cma_lock, &irq_flags);
+	return ret;
+}
+
+static void cma_unisolate(size_t first, size_t count) {
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+	for (size_t i = first; i < first + count; i++)
+		cma_clear(cma_isolated, i);
+	spinlock_release_irq_restore(&cma_lock, &irq_flags);
+}
+
+static bool cma_page_used(size_t i) {
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+	const bool used = cma_test(cma_used, i);
+	spinlock_release_irq_restore(&cma_lock, &irq_flags);
+	return used;
+}
+
+/* Move every borrowed page out of an isolated run, nothing new can be borrowed from it while this runs */
+static int cma_evacuate(size_t first, size_t count) {
+	for (size_t i = first; i < first + count; i++) {
+		unsigned int attempts = 0;
+		while (cma_page_used(i)) {
+			if (attempts++ >= CMA_MIGRATE_ATTEMPTS)
+				return -EBUSY;
+
+			/*
+			 * The owner may free it at any time, which makes vm_migrate_page() fail. A page vfree() or a
+			 * freed stack left for the next lazy purge can't be migrated either, but the purge frees it.
+			 */
+			struct page* new = alloc_page(MM_ZONE_NORMAL);
+			if (!new)
+				return -ENOMEM;
+			struct page* page = cma_page(i);
+			if (vm_migrate_page(page, new)) {
+				release_page(new);
+				if (!vmalloc_purge_lazy())
+					sched_yield();
+				continue;
+			}
+
+			/* The old page was left with no references, so it's free now */
+			atomic_add_fetch(&cma_migrated, 1);
+			cma_release_page(page);
+		}
+	}
+
+	return 0;
+}
+
+static struct page* cma_alloc_contiguous(size_t count, mm_t mm_flags) {
+	const bool atomic = mm_flags & MM_ATOMIC;
+	unsigned int align_order = get_order(count << PAGE_SHIFT);
+	if (align_order > MAX_ORDER)
+		align_order = MAX_ORDER;
+	const size_t align = 1ul << align_order;
+
+	atomic_add_fetch(&cma_busy, 1);
+	struct page* ret = NULL;
+	size_t first = 0;
+	while (first + count <= cma_page_count) {
+		const size_t blocker = cma_isolate(first, count, atomic);
+		if (blocker != SIZE_MAX) {
+			first = ROUND_UP(blocker + 1, align);
+			continue;
+		}
+		if (!atomic && cma_evacuate(first, count)) {
+			cma_unisolate(first, count);
+			first += align;
+			continue;
+		}
+
+		/* Every page in the run is free, and stays isolated until it's freed */
+		unsigned long irq_flags;
+		spinlock_acquire_irq_save(&cma_lock, &irq_flags);
+		for (size_t i = first; i < first + count; i++) {
+			bug(cma_test(cma_used, i));
+			cma_set(cma_used, i);
+		}
+		cma_free_count -= count;
+		spinlock_release_irq_restore(&cma_lock, &irq_flags);
+
+		ret = cma_page(first);
+		for (size_t i = 0; i < count; i++)
+			hold_page(&ret[i]);
+		mm_account_pages(count);
+		break;
+	}
+	atomic_sub_fetch(&cma_busy, 1);
+
+	if (ret && mm_flags & MM_ZERO)
+		memset(page_hhdm_virtual(ret), 0, count << PAGE_SHIFT);
+	return ret;
+}
+
+struct page* dma_alloc_contiguous(size_t size, mm_t mm_flags) {
+	if (unlikely(size == 0))
+		return NULL;
+	mm_flags &= ~MM_MOVABLE;
+
+	const size_t count = ROUND_UP(size, PAGE_SIZE) >> PAGE_SHIFT;
+	if (cma_usable(mm_flags) && count <= cma_page_count) {
+		struct page* page = cma_alloc_contiguous(count, mm_flags);
+		if (page) {
+			atomic_add_fetch(&cma_contig_allocs, 1);
+			return page;
+		}
+	}
+
+	/* Small enough for the buddy allocator, which is all there is without a region */
+	struct page* page = NULL;
+	const unsigned int order = get_order(size);
+	if (order <= MAX_ORDER)
+		page = alloc_pages(mm_flags, order);
+	if (page)
+		atomic_add_fetch(&cma_fallbacks, 1);
+	else
+		atomic_add_fetch(&cma_contig_failures, 1);
+	return page;
+}
+
+void dma_free_contiguous(struct page* page, size_t size) {
+	if (!(page_flags(page) & PAGE_FLAG_CMA)) {
+		release_page(page);
+		return;
+	}
+
+	/* Pages that something else still holds stay used until they're released */
+	const size_t count = ROUND_UP(size, PAGE_SIZE) >> PAGE_SHIFT;
+	for (size_t i = 0; i < count; i++)
+		release_page(&page[i]);
+	cma_unisolate(cma_index(page), count);
+}
+
+void cma_dump_stats(void) {
+	if (!cma_page_count)
+		return;
+	printk(PRINTK_INFO "mm: cma %zu/%zu pages free, borrowed %lu, contiguous allocs %lu, failures %lu, buddy fallbacks %lu, migrated %lu\n",
+			cma_free_count, cma_page_count, atomic_load(&cma_borrowed), atomic_load(&cma_contig_allocs),
+			atomic_load(&cma_contig_failures), atomic_load(&cma_fallbacks), atomic_load(&cma_migrated));
+}
+
+void cma_reserve(physaddr_t limit) {
+	char str[24];
+	unsigned long long mib = 0;
+	if (cmdline_get_early("mm.cma", str, sizeof(str)))
+		return;
+	if (kstrtoull(str, 0, &mib) || mib > (PHYSADDR_MAX >> 20)) {
+		printk(PRINTK_ERR "mm: Invalid value for mm.cma: %s\n", str);
+		return;
+	}
+	if (mib == 0)
+		return;
+
+	/* Prefer memory that DMA32 devices can reach */
+	const size_t size = ROUND_UP(mib << 20, CMA_ALIGN);
+	physaddr_t base = memblock_alloc_raw(size, CMA_ALIGN, CMA_DMA32_START, limit < CMA_DMA32_END ? limit : CMA_DMA32_END);
+	if (!base)
+		base = memblock_alloc_raw(size, CMA_ALIGN, CMA_DMA32_START, limit);
+	if (!base) {
+		printk(PRINTK_ERR "mm: Failed to reserve %llu MiB for cma\n", mib);
+		return;
+	}
+
+	const size_t page_count = size >> PAGE_SHIFT;
+	const size_t bitmap_size = ROUND_UP(page_count, ULONG_BITS) / 8;
+	const physaddr_t used = memblock_alloc(bitmap_size, sizeof(unsigned long), 0, PHYSADDR_MAX);
+	const physaddr_t isolated = memblock_alloc(bitmap_size, sizeof(unsigned long), 0, PHYSADDR_MAX);
+	if (!used || !isolated) {
+		printk(PRINTK_ERR "mm: Failed to allocate the cma bitmaps\n");
+		return;
+	}
+
+	cma_base = base;
+	cma_page_count = page_count;
+	cma_used = hhdm_virtual(used);
+	cma_isolated = hhdm_virtual(isolated);
+}
+
+void cma_init(void) {
+	if (!cma_page_count)
+		return;
+
+	for (size_t i = 0; i < cma_page_count; i++)
+		page_info_update(cma_page(i), PAGE_FLAGS_MASK, PAGE_FLAG_CMA);
+	cma_free_count = cma_page_count;
+	cma_movable_hint = cma_page_count - 1;
+	printk(PRINTK_INFO "mm: cma region %#lx-%#lx (%zu MiB)\n",
+			cma_base, cma_base + ((physaddr_t)cma_page_count << PAGE_SHIFT), cma_page_count >> (20 - PAGE_SHIFT));
+}
@@ -9,91 +9,275 @@
 #include <lunar/mm.h>
 #include <lunar/vmm.h>
 
-#define HEAP_CANARY_XOR 0xdecafc0ffeeUL
+#include "internal.h"
+
 #define HEAP_ALIGN BIGGEST_ALIGNMENT
+#define HEAP_MIN_ALIGN sizeof(size_t) /* Sizes are rounded to this */
 #define HEAP_ZERO_SIZE_PTR ((void*)HEAP_ALIGN)
 
-struct alloc_info {
-	size_t size;
-	bool cache_backing;
-	union {
-		struct slab_cache* cache;
-		struct page* page;
-	} backing_un;
-} __attribute__((aligned(BIGGEST_ALIGNMENT)));
-static_assert((sizeof(struct alloc_info) & (HEAP_ALIGN - 1)) == 0, "struct alloc_info is broken");
+/*
+ * Allocations don't have a header. kfree() and ksize() find the cache an allocation came from in the
+ * struct page of its memory, and anything too big for the caches is a whole block of pages, which
+ * has its order in the struct page of the head.
+ */
 
-#define CACHE_COUNT 27
-static struct slab_cache* normal_caches[CACHE_COUNT];
-static struct slab_cache* atomic_caches[CACHE_COUNT];
+#ifdef CONFIG_HEAP_HARDENING
 
-static struct slab_cache* get_cache(size_t size, mm_t mm_flags) {
-	struct slab_cache** caches = normal_caches;
-	size_t count = ARRAY_SIZE(normal_caches);
-	if (mm_flags & MM_ATOMIC) {
-		caches = atomic_caches;
-		count = ARRAY_SIZE(atomic_caches);
+/*
+ * A canary goes right after the memory that was asked for, and the size that was asked for goes in
+ * the last word of the object, where it can be found again from the size of the object.
+ */
+#define HEAP_CANARY_XOR 0xdecafc0ffeeUL
+#define HEAP_DEBUG_SIZE (sizeof(size_t) * 2)
+
+static void heap_debug_set(void* ptr, size_t size, size_t obj_size) {
+	*(size_t*)((u8*)ptr + size) = (uintptr_t)ptr ^ HEAP_CANARY_XOR;
+	*(size_t*)((u8*)ptr + obj_size - sizeof(size_t)) = size;
+}
+
+/* Make sure nothing wrote past the end of an allocation, returns the size that was asked for */
+static size_t heap_debug_check(const void* ptr, size_t obj_size) {
+	const size_t size = *(const size_t*)((const u8*)ptr + obj_size - sizeof(size_t));
+	bug(size > obj_size - HEAP_DEBUG_SIZE);
+	bug(*(const size_t*)((const u8*)ptr + size) != ((uintptr_t)ptr ^ HEAP_CANARY_XOR));
+	return size;
+}
+
+#else
+#define HEAP_DEBUG_SIZE 0
+#endif /* CONFIG_HEAP_HARDENING */
+
+/*
+ * The small size classes go up in 8 and 16 byte steps, after that there's a class halfway between every
+ * power of two up to a page. Objects are aligned to the largest power of two their class is a multiple of,
+ * up to HEAP_ALIGN. Nothing asks the DMA zones for small allocations, so they only get the powers of two
+ * from 256 bytes.
+ */
+static const u32 heap_classes[] = {
+	8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 8192, 16384, 32768, 65536
+};
+
+#define HEAP_CLASS_COUNT ARRAY_SIZE(heap_classes)
+#define HEAP_SMALL_MAX 192 /* Largest size looked up in heap_small_index */
+#define HEAP_MAX_ORDER 16 /* Order of the largest class */
+#define HEAP_DMA_MIN_ORDER 8
+
+enum heap_zone {
+	HEAP_ZONE_DMA,
+	HEAP_ZONE_DMA32,
+	HEAP_ZONE_NORMAL,
+	HEAP_ZONE_COUNT
+};
+
+static u8 heap_small_index[HEAP_SMALL_MAX / 8 + 1]; /* Class of every size up to HEAP_SMALL_MAX, by size / 8 rounded up */
+static u8 heap_order_index[HEAP_MAX_ORDER + 1]; /* Class of every power of two */
+static struct slab_cache* heap_caches[2][HEAP_ZONE_COUNT][HEAP_CLASS_COUNT]; /* By MM_ATOMIC, zone, and class */
+
+static inline unsigned int heap_size_order(size_t size) {
+	return size > 1 ? sizeof(unsigned long) * 8 - __builtin_clzl(size - 1) : 0;
+}
+
+/* Size has to be at most the largest class */
+static unsigned int heap_class_index(size_t size, bool powers_of_two) {
+	if (powers_of_two) {
+		const unsigned int order = heap_size_order(size);
+		return heap_order_index[order > HEAP_DMA_MIN_ORDER ? order : HEAP_DMA_MIN_ORDER];
 	}
+	if (size <= HEAP_SMALL_MAX)
+		return heap_small_index[(size + 7) >> 3];
+
+	/* The class before a power of two is either the one halfway there, or the last power of two */
+	unsigned int index = heap_order_index[heap_size_order(size)];
+	if (heap_classes[index - 1] >= size)
+		index--;
+	return index;
+}
 
-	for (size_t i = 0; i < count; i++) {
-		if (mm_flags == caches[i]->mm_flags && size <= caches[i]->obj_size)
-			return caches[i];
+static struct slab_cache* get_cache(size_t size, mm_t mm_flags) {
+	if (size > heap_classes[HEAP_CLASS_COUNT - 1])
+		return NULL;
+
+	enum heap_zone zone;
+	switch (mm_flags & ~MM_ATOMIC) {
+	case MM_ZONE_DMA:
+		zone = HEAP_ZONE_DMA;
+		break;
+	case MM_ZONE_DMA32:
+		zone = HEAP_ZONE_DMA32;
+		break;
+	case MM_ZONE_NORMAL:
+		zone = HEAP_ZONE_NORMAL;
+		break;
+	default:
+		return NULL; /* Anything else goes straight to the page allocator */
 	}
 
+	return heap_caches[!!(mm_flags & MM_ATOMIC)][zone][heap_class_index(size, zone != HEAP_ZONE_NORMAL)];
+}
+
+/* Get the cache an allocation came from, or the block of pages it is when it's NULL */
+static struct slab_cache* heap_lookup(const void* ptr, struct page** page) {
+	*page = physaddr_to_page(hhdm_physical(ptr));
+	bug(*page == NULL);
+	if (page_flags(*page) & PAGE_FLAG_SLAB)
+		return (*page)->slab.cache;
+
+	/* Has to be the start of the block */
+	bug((uintptr_t)ptr & (PAGE_SIZE - 1) || atomic_load(&(*page)->head) != 0);
 	return NULL;
 }
 
+static inline size_t heap_object_size(struct slab_cache* cache, struct page* page) {
+	return cache ? cache->obj_size : PAGE_SIZE << page_order(page);
+}
+
+/* Set up the debug data of an allocation if there is any */
+static inline void heap_finish(void* ptr, size_t size, size_t obj_size) {
+#ifdef CONFIG_HEAP_HARDENING
+	heap_debug_set(ptr, size, obj_size);
+#else
+	(void)ptr;
+	(void)size;
+	(void)obj_size;
+#endif /* CONFIG_HEAP_HARDENING */
+}
+
+/* Make sure an allocation is intact before it's freed */
+static inline void heap_check(const void* ptr, struct slab_cache* cache, struct page* page) {
+#ifdef CONFIG_HEAP_HARDENING
+	heap_debug_check(ptr, heap_object_size(cache, page));
+#else
+	(void)ptr;
+	(void)cache;
+	(void)page;
+#endif /* CONFIG_HEAP_HARDENING */
+}
+
+/* Round a size up and add the debug data, returns 0 if it's too large */
+static size_t heap_total_size(size_t* size) {
+	if (*size >= SIZE_MAX - HEAP_MIN_ALIGN - HEAP_DEBUG_SIZE)
+		return 0;
+	*size = ROUND_UP(*size, HEAP_MIN_ALIGN);
+	return *size + HEAP_DEBUG_SIZE;
+}
+
 void* kmalloc(size_t size, mm_t mm_flags) {
 	if (size == 0)
 		return HEAP_ZERO_SIZE_PTR;
-	if (size >= SIZE_MAX - HEAP_ALIGN)
+	const size_t total_size = heap_total_size(&size);
+	if (!total_size)
 		return NULL;
-	size = ROUND_UP(size, HEAP_ALIGN);
 
-	size_t total_size;
-	if (__builtin_add_overflow(size, sizeof(struct alloc_info) + sizeof(size_t), &total_size))
-		return NULL;
-
-	struct alloc_info* ai = NULL;
-	struct slab_cache* cache = get_cache(total_size, mm_flags);
-	struct page* page = NULL;
-	if (cache)
-		ai = slab_cache_alloc(cache);
-	if (!ai) {
-		page = alloc_pages(mm_flags, get_order(total_size));
+	void* ptr = NULL;
+	size_t obj_size = 0;
+	struct slab_cache* cache = get_cache(total_size, mm_flags & ~MM_ZERO);
+	if (cache) {
+		ptr = slab_cache_alloc(cache);
+		if (ptr && mm_flags & MM_ZERO)
+			memset(ptr, 0, size);
+		obj_size = cache->obj_size;
+	}
+	if (!ptr) {
+		const unsigned int order = get_order(total_size);
+		struct page* page = alloc_pages(mm_flags, order);
 		if (!page)
 			return NULL;
-		cache = NULL;
-		ai = page_hhdm_virtual(page);
+		ptr = page_hhdm_virtual(page);
+		obj_size = PAGE_SIZE << order;
 	}
 
-	ai->size = size;
-	ai->cache_backing = !!cache;
-	if (ai->cache_backing)
-		ai->backing_un.cache = cache;
-	else
-		ai->backing_un.page = page;
-
-	u8* ret = (u8*)(ai + 1);
-	size_t* canary = (size_t*)(ret + size);
-	*canary = (uintptr_t)ret ^ HEAP_CANARY_XOR;
-	return ret;
+	heap_finish(ptr, size, obj_size);
+	return ptr;
 }
 
 void kfree(void* ptr) {
 	if (ptr == NULL || ptr == HEAP_ZERO_SIZE_PTR)
 		return;
 
-	struct alloc_info* ai = (struct alloc_info*)ptr - 1;
-	size_t* canary = (size_t*)((u8*)ptr + ai->size);
-	bug(*canary != ((uintptr_t)ptr ^ HEAP_CANARY_XOR));
-
-	size_t total_size;
-	bug(__builtin_add_overflow(ai->size, sizeof(struct alloc_info) + sizeof(size_t), &total_size) == true);
-	if (ai->cache_backing)
-		slab_cache_free(ai->backing_un.cache, ai);
+	struct page* page;
+	struct slab_cache* cache = heap_lookup(ptr, &page);
+	heap_check(ptr, cache, page);
+	if (cache)
+		slab_cache_free(cache, ptr);
 	else
-		release_page(ai->backing_un.page);
+		release_page(page);
+}
+
+size_t ksize(const void* ptr) {
+	if (ptr == NULL || ptr == HEAP_ZERO_SIZE_PTR)
+		return 0;
+
+	struct page* page;
+	struct slab_cache* cache = heap_lookup(ptr, &page);
+#ifdef CONFIG_HEAP_HARDENING
+	return heap_debug_check(ptr, heap_object_size(cache, page));
+#else
+	return heap_object_size(cache, page);
+#endif /* CONFIG_HEAP_HARDENING */
+}
+
+int kmalloc_bulk(size_t size, mm_t mm_flags, size_t count, void** ptrs) {
+	if (size == 0) {
+		for (size_t i = 0; i < count; i++)
+			ptrs[i] = HEAP_ZERO_SIZE_PTR;
+		return 0;
+	}
+
+	const size_t total_size = heap_total_size(&size);
+	if (!total_size)
+		return -ENOMEM;
+
+	/* Too big for the caches, so there's no lock to save */
+	struct slab_cache* cache = get_cache(total_size, mm_flags & ~MM_ZERO);
+	if (!cache) {
+		for (size_t i = 0; i < count; i++) {
+			ptrs[i] = kmalloc(size, mm_flags);
+			if (!ptrs[i]) {
+				kfree_bulk(i, ptrs);
+				return -ENOMEM;
+			}
+		}
+		return 0;
+	}
+
+	if (slab_cache_alloc_bulk(cache, mm_flags & (MM_ATOMIC | MM_ZERO), count, ptrs))
+		return -ENOMEM;
+	for (size_t i = 0; i < count; i++)
+		heap_finish(ptrs[i], size, cache->obj_size);
+	return 0;
+}
+
+#define HEAP_FREE_BATCH 32
+
+void kfree_bulk(size_t count, void** ptrs) {
+	struct slab_cache* batch_cache = NULL;
+	void* batch[HEAP_FREE_BATCH];
+	size_t batched = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (ptrs[i] == NULL || ptrs[i] == HEAP_ZERO_SIZE_PTR)
+			continue;
+
+		struct page* page;
+		struct slab_cache* cache = heap_lookup(ptrs[i], &page);
+		heap_check(ptrs[i], cache, page);
+		if (!cache) {
+			release_page(page);
+			continue;
+		}
+
+		/* Batches only hold objects from one cache */
+		if (batched == HEAP_FREE_BATCH || (batched && cache != batch_cache)) {
+			slab_cache_free_bulk(batch_cache, batched, batch);
+			batched = 0;
+		}
+		batch_cache = cache;
+		batch[batched++] = ptrs[i];
+	}
+
+	if (batched)
+		slab_cache_free_bulk(batch_cache, batched, batch);
 }
 
 void* krealloc(void* old, size_t new_size, mm_t mm_flags) {
@@ -104,10 +288,24 @@ void* krealloc(void* old, size_t new_size, mm_t mm_flags) {
 		return NULL;
 	}
 
-	new_size = ROUND_UP(new_size, HEAP_ALIGN);
-
-	struct alloc_info* old_alloc_info = (struct alloc_info*)old - 1;
-	size_t old_size = old_alloc_info->size;
+	struct page* page;
+	struct slab_cache* cache = heap_lookup(old, &page);
+	const size_t obj_size = heap_object_size(cache, page);
+#ifdef CONFIG_HEAP_HARDENING
+	const size_t old_size = heap_debug_check(old, obj_size);
+#else
+	const size_t old_size = obj_size;
+#endif /* CONFIG_HEAP_HARDENING */
+
+	/* Nothing has to move if the object is already big enough */
+	size_t size = new_size;
+	const size_t total_size = heap_total_size(&size);
+	if (total_size && total_size <= obj_size) {
+		if (mm_flags & MM_ZERO && size > old_size)
+			memset((u8*)old + old_size, 0, size - old_size);
+		heap_finish(old, size, obj_size);
+		return old;
+	}
 
 	void* new = kmalloc(new_size, mm_flags);
 	if (!new)
@@ -120,36 +318,44 @@ void* krealloc(void* old, size_t new_size, mm_t mm_flags) {
 	return new;
 }
 
-static inline mm_t next_zone(mm_t zone) {
-	switch (zone) {
-	case MM_ZONE_DMA:
-		return MM_ZONE_DMA32;
-	case MM_ZONE_DMA32:
-		return MM_ZONE_NORMAL;
-	default:
-		return MM_ZONE_DMA;
-	}
-}
+static bool cache_set_init(struct slab_cache** caches, mm_t mm_flags) {
+	for (unsigned int i = 0; i < HEAP_CLASS_COUNT; i++) {
+		const size_t size = heap_classes[i];
+		if (!(mm_flags & MM_ZONE_NORMAL) && ((size & (size - 1)) || size < (1ul << HEAP_DMA_MIN_ORDER)))
+			continue;
 
-static bool cache_set_init(struct slab_cache** caches, size_t count, mm_t mm_extra) {
-	size_t size = 256;
-	mm_t zone = MM_ZONE_DMA;
-	for (size_t i = 0; i < count; i++) {
-		caches[i] = slab_cache_create(size, HEAP_ALIGN, zone | mm_extra, NULL, NULL);
+		const size_t align = (size & -size) < HEAP_ALIGN ? (size & -size) : HEAP_ALIGN;
+		caches[i] = slab_cache_create(size, align, mm_flags, NULL, NULL);
 		if (!caches[i])
 			return false;
-		zone = next_zone(zone);
-		if (zone == MM_ZONE_DMA && i != 0)
-			size *= 2;
 	}
 
 	return true;
 }
 
 static void heap_init(void) {
-	if (!cache_set_init(normal_caches, ARRAY_SIZE(normal_caches), 0) ||
-			!cache_set_init(atomic_caches, ARRAY_SIZE(atomic_caches), MM_ATOMIC))
-		out_of_memory();
+	static_assert(ARRAY_SIZE(heap_classes) <= U8_MAX, "Too many heap size classes");
+	for (unsigned int i = 0, size = 0; size <= HEAP_SMALL_MAX; size += 8) {
+		while (heap_classes[i] < size)
+			i++;
+		heap_small_index[size >> 3] = i;
+	}
+	for (unsigned int i = 0, order = 0; order <= HEAP_MAX_ORDER; order++) {
+		while (heap_classes[i] < (1u << order))
+			i++;
+		heap_order_index[order] = i;
+	}
+
+	static const mm_t zones[HEAP_ZONE_COUNT] = {
+		[HEAP_ZONE_DMA] = MM_ZONE_DMA,
+		[HEAP_ZONE_DMA32] = MM_ZONE_DMA32,
+		[HEAP_ZONE_NORMAL] = MM_ZONE_NORMAL
+	};
+	for (unsigned int zone = 0; zone < HEAP_ZONE_COUNT; zone++) {
+		if (!cache_set_init(heap_caches[0][zone], zones[zone]) ||
+				!cache_set_init(heap_caches[1][zone], zones[zone] | MM_ATOMIC))
+			out_of_memory();
+	}
 }
 
 INIT_TASK_DECLARE(zones_init_task, hhdm_init_task);
@@ -0,0 +1,210 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/string.h>
+#include <lunar/printk.h>
+#include <lunar/panic.h>
+#include <lunar/cmdline.h>
+#include <lunar/convert.h>
+
+#include "internal.h"
+
+/*
+ * Huge pages are reserved from memblock at boot, so they can be handed out no matter how fragmented the buddy
+ * allocator gets. The free pages of a pool are a lock-free stack of indexes, and the head of the stack has a
+ * generation count next to the index, so a page that's taken and put back between a load and a compare exchange
+ * can't be mistaken for the old head.
+ */
+
+#define HUGEPAGE_STACK_EMPTY 0 /* Indexes on the stack are stored plus one */
+
+struct hugepage_pool {
+	const char* name;
+	const char* arg;
+	unsigned int order;
+	size_t count;
+	physaddr_t* addresses; /* Sorted in descending order */
+	u32* next; /* Next index on the free stack, plus one */
+	atomic(u64) free_head; /* Generation in the upper 32 bits, index plus one in the lower 32 bits */
+	atomic(unsigned long) free_count, allocs, frees, failures;
+};
+
+static struct hugepage_pool pools[] = {
+	{ .name = "2MiB", .arg = "mm.hugepages_2mb", .order = HUGEPAGE_ORDER_2MB },
+	{ .name = "1GiB", .arg = "mm.hugepages_1gb", .order = HUGEPAGE_ORDER_1GB }
+};
+
+static struct hugepage_pool* hugepage_pool(unsigned int order) {
+	for (size_t i = 0; i < ARRAY_SIZE(pools); i++) {
+		if (pools[i].order == order)
+			return &pools[i];
+	}
+	return NULL;
+}
+
+static size_t hugepage_pop(struct hugepage_pool* pool) {
+	u64 head = atomic_load(&pool->free_head);
+	u64 new;
+	do {
+		const u32 index = head & 0xffffffff;
+		if (index == HUGEPAGE_STACK_EMPTY)
+			return SIZE_MAX;
+
+		/* May be stale if someone else took the page, but then the exchange fails */
+		new = (((head >> 32) + 1) << 32) | pool->next[index - 1];
+	} while (!atomic_compare_exchange_weak(&pool->free_head, &head, new));
+
+	return (head & 0xffffffff) - 1;
+}
+
+static void hugepage_push(struct hugepage_pool* pool, size_t index) {
+	u64 head = atomic_load(&pool->free_head);
+	u64 new;
+	do {
+		pool->next[index] = head & 0xffffffff;
+		new = (((head >> 32) + 1) << 32) | (index + 1);
+	} while (!atomic_compare_exchange_weak(&pool->free_head, &head, new));
+}
+
+struct page* alloc_hugepage(unsigned int order, mm_t mm_flags) {
+	struct hugepage_pool* pool = hugepage_pool(order);
+	if (unlikely(!pool)) {
+		printk(PRINTK_ERR "mm: %s(order: %u) failed: no pool of that order\n", __func__, order);
+		return NULL;
+	}
+
+	const size_t index = hugepage_pop(pool);
+	if (index == SIZE_MAX) {
+		atomic_add_fetch(&pool->failures, 1);
+		return NULL;
+	}
+	atomic_sub_fetch(&pool->free_count, 1);
+	atomic_add_fetch(&pool->allocs, 1);
+
+	struct page* page = physaddr_to_page(pool->addresses[index]);
+	bug(atomic_load(&page->refcnt) != 0);
+	hold_page(page);
+	if (mm_flags & MM_ZERO)
+		memset(page_hhdm_virtual(page), 0, PAGE_SIZE << order);
+	return page;
+}
+
+void hugepage_free(struct page* page) {
+	const physaddr_t address = page_to_physaddr(page);
+	struct hugepage_pool* pool = hugepage_pool(page_order(page));
+	bug(!pool);
+
+	size_t low = 0;
+	size_t high = pool->count;
+	while (low < high) {
+		const size_t mid = low + ((high - low) >> 1);
+		if (pool->addresses[mid] == address) {
+			hugepage_push(pool, mid);
+			atomic_add_fetch(&pool->free_count, 1);
+			atomic_add_fetch(&pool->frees, 1);
+			return;
+		}
+		if (pool->addresses[mid] > address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	bug("Huge page isn't in its pool");
+}
+
+void hugepage_get_counts(unsigned int order, size_t* total, size_t* free) {
+	const struct hugepage_pool* pool = hugepage_pool(order);
+	*total = pool ? pool->count : 0;
+	*free = pool ? atomic_load(&pool->free_count) : 0;
+}
+
+void hugepage_dump_stats(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(pools); i++) {
+		const struct hugepage_pool* pool = &pools[i];
+		if (!pool->count)
+			continue;
+		printk(PRINTK_INFO "mm: %s huge pages %lu/%zu free, allocs %lu, frees %lu, failures %lu\n",
+				pool->name, atomic_load(&pool->free_count), pool->count, atomic_load(&pool->allocs),
+				atomic_load(&pool->frees), atomic_load(&pool->failures));
+	}
+}
+
+static void hugepage_pool_reserve(struct hugepage_pool* pool, physaddr_t limit) {
+	char str[24];
+	unsigned long long count;
+	if (cmdline_get_early(pool->arg, str, sizeof(str)))
+		return;
+	if (kstrtoull(str, 0, &count) || count >= U32_MAX) {
+		printk(PRINTK_ERR "mm: Invalid value for %s: %s\n", pool->arg, str);
+		return;
+	}
+	if (count == 0)
+		return;
+
+	const physaddr_t addresses = memblock_alloc_raw(count * sizeof(*pool->addresses), sizeof(*pool->addresses), 0, PHYSADDR_MAX);
+	const physaddr_t next = memblock_alloc_raw(count * sizeof(*pool->next), sizeof(*pool->next), 0, PHYSADDR_MAX);
+	if (!addresses || !next) {
+		printk(PRINTK_ERR "mm: Failed to allocate the %s huge page pool\n", pool->name);
+		return;
+	}
+	pool->addresses = hhdm_virtual(addresses);
+	pool->next = hhdm_virtual(next);
+
+	/* Memory that's initialized at boot is used first, so the deferred page init jobs don't have to run early */
+	const size_t size = PAGE_SIZE << pool->order;
+	size_t got = 0;
+	while (got < count) {
+		physaddr_t base = memblock_alloc_raw(size, size, 0, limit);
+		if (!base)
+			base = memblock_alloc_raw(size, size, 0, PHYSADDR_MAX);
+		if (!base)
+			break;
+		pool->addresses[got++] = base;
+	}
+
+	if (got < count)
+		printk(PRINTK_WARN "mm: Only reserved %zu/%llu %s huge pages\n", got, count, pool->name);
+	pool->count = got;
+
+	/* Only the pages above the limit can be out of order, since memblock allocates top down */
+	for (size_t i = 1; i < got; i++) {
+		const physaddr_t address = pool->addresses[i];
+		size_t j = i;
+		for (; j > 0 && pool->addresses[j - 1] < address; j--)
+			pool->addresses[j] = pool->addresses[j - 1];
+		pool->addresses[j] = address;
+	}
+}
+
+void hugepage_reserve(physaddr_t limit) {
+	/* The largest pages go first, so the smaller ones don't break up the aligned ranges */
+	for (size_t i = ARRAY_SIZE(pools); i-- > 0;)
+		hugepage_pool_reserve(&pools[i], limit);
+}
+
+void hugepage_init(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(pools); i++) {
+		struct hugepage_pool* pool = &pools[i];
+		if (!pool->count)
+			continue;
+
+		/* Every huge page is a block that's never split, so the page structs stay pointed at the head */
+		const size_t pages = 1ul << pool->order;
+		for (size_t j = 0; j < pool->count; j++) {
+			/* A 1 GiB page can cross into another deferred page init job, which has to run first too */
+			struct page* head = physaddr_to_page(pool->addresses[j]);
+			physaddr_to_page(pool->addresses[j] + (PAGE_SIZE << pool->order) - PAGE_SIZE);
+			for (size_t k = 0; k < pages; k++) {
+				page_info_update(&head[k], PAGE_FLAGS_MASK, PAGE_FLAG_HUGETLB);
+				atomic_store(&head[k].head, k);
+			}
+			page_info_update(head, PAGE_ORDER_MASK, pool->order << PAGE_ORDER_SHIFT);
+			pool->next[j] = j + 2 <= pool->count ? j + 2 : HUGEPAGE_STACK_EMPTY;
+		}
+
+		atomic_store(&pool->free_head, 1);
+		atomic_store(&pool->free_count, pool->count);
+		mm_account_pages(pool->count << pool->order);
+		printk(PRINTK_INFO "mm: Reserved %zu %s huge pages\n", pool->count, pool->name);
+	}
+}
@@ -7,8 +7,17 @@ struct vma {
 	pgprot_t prot;
 	int vmm_flags;
 	struct list_node link;
+	struct avl_node node;
+	size_t gap; /* Unmapped space between the top of the previous VMA and the start of this one */
+	size_t max_gap; /* Largest gap in the subtree */
 };
 
+/**
+ * @brief Recompute the largest gap of a VMA's subtree, the augment callback of a VMA tree
+ * @param node The tree node of the VMA
+ */
+void vma_augment(struct avl_node* node);
+
 /**
  * @brief Free all VMA's in a list
  * @param list The start of the list
@@ -99,3 +108,293 @@ void tlb_batch_flush(struct tlb_batch* batch);
  * @param page The page to release after flushing (optional)
  */
 void tlb_batch_add(struct tlb_batch* batch, uintptr_t virtual, struct page* page);
+
+/**
+ * @brief Flush every TLB entry on every CPU
+ *
+ * Not safe to call from an atomic context, as this may acquire mutexes.
+ */
+void tlb_flush_all(void);
+
+/**
+ * @brief Start flushing TLB entries with interrupts disabled
+ *
+ * Takes the shootdown lock before disabling interrupts, so no other CPU can be waiting
+ * for this one to answer a shootdown while it waits for theirs. Nothing between this and
+ * tlb_shootdown_end() may sleep.
+ *
+ * @return The interrupt flags to give to tlb_shootdown_end()
+ */
+unsigned long tlb_shootdown_begin(void);
+
+/**
+ * @brief Flush a page from the TLB of every CPU
+ *
+ * Can only be called between tlb_shootdown_begin() and tlb_shootdown_end().
+ *
+ * @param virtual The virtual address of the page
+ */
+void tlb_shootdown_page(uintptr_t virtual);
+
+/**
+ * @brief Stop flushing TLB entries with interrupts disabled
+ * @param irq_flags The flags tlb_shootdown_begin() returned
+ */
+void tlb_shootdown_end(unsigned long irq_flags);
+
+/**
+ * @brief Get the number of IPI's a TLB shootdown sends
+ * @return The number of other CPU's, 0 if shootdowns aren't enabled yet
+ */
+unsigned int tlb_shootdown_ipi_cost(void);
+
+/**
+ * @brief Print the TLB shootdown counters
+ */
+void tlb_dump_stats(void);
+
+/**
+ * @brief Print the lazy vfree() counters
+ */
+void vmalloc_dump_stats(void);
+
+/**
+ * @brief Get the number of IPI's lazy vfree() has saved so far
+ * @return The shootdown IPI's skipped, minus the ones the purges sent
+ */
+long vmalloc_lazy_ipis_saved(void);
+
+/**
+ * @brief Give back the pages lazy vfree() is holding
+ *
+ * Only tries to lock the kernel mm, so it doesn't do anything if the mm is busy.
+ *
+ * @return The number of pages released
+ */
+unsigned long vmalloc_purge_lazy(void);
+
+/**
+ * @brief Split the memory zones by NUMA node
+ *
+ * Called once the NUMA topology is known, after this allocations prefer the requested node.
+ */
+void zones_numa_init(void);
+
+/**
+ * @brief Take a page from the pool of pre-zeroed pages
+ * @return The page (already held), NULL if the pool is empty
+ */
+struct page* zero_pool_take(void);
+
+/**
+ * @brief Print the zeroed page pool counters
+ */
+void zero_pool_dump_stats(void);
+
+/**
+ * @brief Print the magazine counters of every slab cache that has used its magazines
+ */
+void slab_dump_stats(void);
+
+/**
+ * @brief Ask the registered shrinkers for memory
+ *
+ * Not safe to call from an atomic context.
+ *
+ * @param target How many pages are wanted
+ * @param wait Wait for the registry if someone else is reclaiming, otherwise give up right away
+ *
+ * @return How many pages were freed, can be more than target
+ */
+unsigned long shrink_memory(unsigned long target, bool wait);
+
+/**
+ * @brief Print the counters of every shrinker
+ */
+void shrinker_dump_stats(void);
+
+/**
+ * @brief Get the page struct of a physical address without holding it
+ *
+ * Deferred page structs are initialized first.
+ *
+ * @param address The physical address
+ * @return The page struct, NULL if the address isn't backed by the page array
+ */
+struct page* physaddr_to_page(physaddr_t address);
+
+/**
+ * @brief Atomically replace some of the packed info bits of a page
+ * @param page The page
+ * @param mask The bits to replace
+ * @param value The new bits, already shifted into place
+ * @return The old info
+ */
+static inline u32 page_info_update(struct page* page, u32 mask, u32 value) {
+	u32 old = atomic_load(&page->info);
+	u32 new;
+	do {
+		new = (old & ~mask) | (value & mask);
+	} while (!atomic_compare_exchange_weak(&page->info, &old, new));
+	return old;
+}
+
+/**
+ * @brief Add to the count of pages in use, for memory the buddy allocator doesn't own
+ * @param count The number of pages, negative when they're freed
+ */
+void mm_account_pages(long count);
+
+/**
+ * @brief Reserve the contiguous memory region from memblock
+ *
+ * Sized by mm.cma on the command line, nothing is reserved if it isn't set.
+ *
+ * @param limit The region has to be below this address
+ */
+void cma_reserve(physaddr_t limit);
+
+/**
+ * @brief Mark the pages of the contiguous memory region, after the page array is initialized
+ */
+void cma_init(void);
+
+/**
+ * @brief Borrow single pages from the contiguous memory region for a movable allocation
+ *
+ * Nothing is borrowed while a contiguous allocation is being made.
+ *
+ * @param[in] mm_flags The flags of the allocation
+ * @param[in] count The number of pages wanted
+ * @param[out] out Where the page structs are stored, already held
+ *
+ * @return The number of pages borrowed
+ */
+size_t cma_alloc_movable(mm_t mm_flags, size_t count, struct page** out);
+
+/**
+ * @brief Give a page of the contiguous memory region back once its refcount hits zero
+ * @param page The page
+ */
+void cma_release_page(struct page* page);
+
+/**
+ * @brief Print the contiguous memory region counters
+ */
+void cma_dump_stats(void);
+
+/**
+ * @brief Reserve the huge page pools from memblock
+ *
+ * Sized by mm.hugepages_2mb and mm.hugepages_1gb on the command line.
+ *
+ * @param limit Pages are taken from below this address first
+ */
+void hugepage_reserve(physaddr_t limit);
+
+/**
+ * @brief Set up the page structs of the huge page pools, after the page array is initialized
+ */
+void hugepage_init(void);
+
+/**
+ * @brief Give a huge page back to its pool once its refcount hits zero
+ * @param page The head page
+ */
+void hugepage_free(struct page* page);
+
+/**
+ * @brief Print the huge page pool counters
+ */
+void hugepage_dump_stats(void);
+
+/**
+ * @brief Move a movable page to another physical page
+ *
+ * The page has to be mapped in exactly one place, and that mapping has to be the only
+ * reference to the page. On success the mapping takes over the caller's reference to new,
+ * and the old page is left with a zero reference count without being freed.
+ *
+ * @param page The page to move
+ * @param new The page to move it to
+ *
+ * @retval 0 Successful
+ * @retval -EBUSY The page isn't movable right now
+ */
+int vm_migrate_page(struct page* page, struct page* new);
+
+/**
+ * @brief Add a range of usable memory to the early allocator
+ *
+ * Only used by zones_init(), touching or overlapping ranges are merged.
+ *
+ * @param base The physical base of the range
+ * @param size The size of the range
+ *
+ * @retval 0 Successful
+ * @retval -ENOMEM Out of space for ranges
+ * @retval -EPERM The buddy allocator already took over
+ */
+int memblock_add(physaddr_t base, size_t size);
+
+/**
+ * @brief Reserve a range of memory in the early allocator
+ *
+ * @param base The physical base of the range
+ * @param size The size of the range
+ *
+ * @retval 0 Successful
+ * @retval -ENOMEM Out of space for ranges
+ * @retval -EPERM The buddy allocator already took over
+ */
+int memblock_reserve(physaddr_t base, size_t size);
+
+/**
+ * @brief Allocate memory from the early allocator without clearing it
+ *
+ * The highest free range in [min, max) is used. The memory is never freed.
+ *
+ * @param size The size of the allocation
+ * @param align The alignment of the allocation
+ * @param min The lowest address the allocation can start at
+ * @param max The address the allocation has to end below
+ *
+ * @return The physical address, 0 on failure
+ */
+physaddr_t memblock_alloc_raw(size_t size, size_t align, physaddr_t min, physaddr_t max);
+
+/**
+ * @brief Allocate zeroed memory from the early allocator
+ *
+ * See memblock_alloc_raw().
+ *
+ * @return The physical address, 0 on failure
+ */
+physaddr_t memblock_alloc(size_t size, size_t align, physaddr_t min, physaddr_t max);
+
+/**
+ * @brief Check if any part of a range is reserved in the early allocator
+ * @param base The physical base of the range
+ * @param size The size of the range
+ * @return true if anything in the range is reserved
+ */
+bool memblock_is_reserved(physaddr_t base, size_t size);
+
+/**
+ * @brief Call a function for every free range of whole pages in [start, end)
+ *
+ * Safe to call from multiple CPU's at once after memblock_freeze().
+ *
+ * @param start The lowest address to look at
+ * @param end The address to stop at
+ * @param func The function to call, with the page aligned range
+ * @param arg Passed to func
+ */
+void memblock_for_each_free(physaddr_t start, physaddr_t end, void (*func)(physaddr_t base, physaddr_t end, void* arg), void* arg);
+
+/**
+ * @brief Stop the early allocator from changing
+ *
+ * Called once the buddy allocator is about to take over the free memory.
+ */
+void memblock_freeze(void);
@@ -0,0 +1,197 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/string.h>
+#include <lunar/printk.h>
+
+#include "internal.h"
+
+/*
+ * The early range allocator, used until the buddy allocator exists. It keeps two sorted lists of ranges,
+ * the usable memory and the ranges reserved out of it, and ranges are merged as they're inserted. Allocations
+ * are made top down. zones_init() gives everything that isn't reserved to the buddy allocator, and after that
+ * the lists are only read, so the page init jobs can find the free memory in their areas.
+ */
+
+#define MEMBLOCK_INIT_RANGES 128
+
+struct memblock_range {
+	physaddr_t base, end;
+};
+
+struct memblock_type {
+	struct memblock_range* ranges; /* Sorted by base, never overlapping or touching */
+	size_t count, capacity;
+};
+
+static struct memblock_range memory_init[MEMBLOCK_INIT_RANGES];
+static struct memblock_range reserved_init[MEMBLOCK_INIT_RANGES];
+static struct memblock_type memory = { .ranges = memory_init, .count = 0, .capacity = MEMBLOCK_INIT_RANGES };
+static struct memblock_type reserved = { .ranges = reserved_init, .count = 0, .capacity = MEMBLOCK_INIT_RANGES };
+static bool frozen = false;
+
+/* Find the highest free range of a size in [min, max), returns 0 if nothing fits */
+static physaddr_t memblock_find(size_t size, size_t align, physaddr_t min, physaddr_t max) {
+	for (size_t i = memory.count; i-- > 0;) {
+		const struct memblock_range* range = &memory.ranges[i];
+		const physaddr_t low = range->base > min ? range->base : min;
+		physaddr_t end = range->end < max ? range->end : max;
+		while (end > low && end - low >= size) {
+			const physaddr_t base = ROUND_DOWN(end - size, align);
+			if (base < low)
+				break;
+
+			/* Move below the lowest reserved range that's in the way, the first one found since they're sorted */
+			bool overlaps = false;
+			for (size_t j = 0; j < reserved.count && reserved.ranges[j].base < base + size; j++) {
+				if (reserved.ranges[j].end > base) {
+					end = reserved.ranges[j].base;
+					overlaps = true;
+					break;
+				}
+			}
+			if (!overlaps)
+				return base;
+		}
+	}
+
+	return 0;
+}
+
+static int memblock_insert(struct memblock_type* type, physaddr_t base, physaddr_t end);
+
+/* The old array is never given back, since it's either static or too small to matter */
+static int memblock_grow(struct memblock_type* type) {
+	const size_t capacity = type->capacity * 2;
+	const size_t size = ROUND_UP(capacity * sizeof(*type->ranges), PAGE_SIZE);
+	const physaddr_t phys = memblock_find(size, PAGE_SIZE, 0, PHYSADDR_MAX);
+	if (!phys)
+		return -ENOMEM;
+
+	struct memblock_range* ranges = hhdm_virtual(phys);
+	memcpy(ranges, type->ranges, type->count * sizeof(*ranges));
+	type->ranges = ranges;
+	type->capacity = capacity;
+	return memblock_insert(&reserved, phys, phys + size);
+}
+
+static int memblock_insert(struct memblock_type* type, physaddr_t base, physaddr_t end) {
+	if (unlikely(end <= base))
+		return -EINVAL;
+
+	/* Growing can insert into the reserved list, so it has to be done before anything is looked at */
+	if (type->count == type->capacity) {
+		int err = memblock_grow(type);
+		if (err)
+			return err;
+	}
+
+	/* Every range that overlaps or touches the new one is merged into it */
+	size_t first = 0;
+	while (first < type->count && type->ranges[first].end < base)
+		first++;
+	size_t last = first;
+	while (last < type->count && type->ranges[last].base <= end) {
+		if (type->ranges[last].base < base)
+			base = type->ranges[last].base;
+		if (type->ranges[last].end > end)
+			end = type->ranges[last].end;
+		last++;
+	}
+
+	if (first == last) {
+		memmove(&type->ranges[first + 1], &type->ranges[first], (type->count - first) * sizeof(*type->ranges));
+		type->count++;
+	} else if (last - first > 1) {
+		memmove(&type->ranges[first + 1], &type->ranges[last], (type->count - last) * sizeof(*type->ranges));
+		type->count -= last - first - 1;
+	}
+	type->ranges[first] = (struct memblock_range){ .base = base, .end = end };
+	return 0;
+}
+
+int memblock_add(physaddr_t base, size_t size) {
+	if (unlikely(frozen))
+		return -EPERM;
+	return memblock_insert(&memory, base, base + size);
+}
+
+int memblock_reserve(physaddr_t base, size_t size) {
+	if (unlikely(frozen))
+		return -EPERM;
+	return memblock_insert(&reserved, base, base + size);
+}
+
+physaddr_t memblock_alloc_raw(size_t size, size_t align, physaddr_t min, physaddr_t max) {
+	if (unlikely(frozen)) {
+		printk(PRINTK_ERR "mm: %s() called after the buddy allocator took over\n", __func__);
+		return 0;
+	}
+	if (unlikely(size == 0 || align == 0))
+		return 0;
+
+	const physaddr_t base = memblock_find(size, align, min, max);
+	if (!base || memblock_insert(&reserved, base, base + size))
+		return 0;
+	return base;
+}
+
+physaddr_t memblock_alloc(size_t size, size_t align, physaddr_t min, physaddr_t max) {
+	const physaddr_t base = memblock_alloc_raw(size, align, min, max);
+	if (base)
+		memset(hhdm_virtual(base), 0, size);
+	return base;
+}
+
+bool memblock_is_reserved(physaddr_t base, size_t size) {
+	size_t low = 0;
+	size_t high = reserved.count;
+	while (low < high) {
+		const size_t mid = low + ((high - low) >> 1);
+		const struct memblock_range* r = &reserved.ranges[mid];
+		if (base + size <= r->base)
+			high = mid;
+		else if (base >= r->end)
+			low = mid + 1;
+		else
+			return true;
+	}
+	return false;
+}
+
+void memblock_for_each_free(physaddr_t start, physaddr_t end, void (*func)(physaddr_t base, physaddr_t end, void* arg), void* arg) {
+	size_t j = 0;
+	for (size_t i = 0; i < memory.count; i++) {
+		physaddr_t base = memory.ranges[i].base > start ? memory.ranges[i].base : start;
+		const physaddr_t top = memory.ranges[i].end < end ? memory.ranges[i].end : end;
+		while (base < top) {
+			while (j < reserved.count && reserved.ranges[j].end <= base)
+				j++;
+
+			physaddr_t stop = top;
+			if (j < reserved.count && reserved.ranges[j].base < top) {
+				if (reserved.ranges[j].base <= base) {
+					base = reserved.ranges[j].end;
+					continue;
+				}
+				stop = reserved.ranges[j].base;
+			}
+
+			/* Partially reserved pages aren't free */
+			const physaddr_t page_base = ROUND_UP(base, PAGE_SIZE);
+			const physaddr_t page_end = ROUND_DOWN(stop, PAGE_SIZE);
+			if (page_base < page_end)
+				func(page_base, page_end, arg);
+			base = stop;
+		}
+	}
+}
+
+void memblock_freeze(void) {
+	physaddr_t total = 0;
+	for (size_t i = 0; i < reserved.count; i++)
+		total += reserved.ranges[i].end - reserved.ranges[i].base;
+
+	frozen = true;
+	printk(PRINTK_INFO "mm: memblock has %zu memory ranges, %zu reserved ranges (%lu KiB)\n",
+			memory.count, reserved.count, total >> 10);
+}
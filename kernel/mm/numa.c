@@ -0,0 +1,225 @@
+#include <lunar/common.h>
+#include <lunar/numa.h>
+#include <lunar/percpu.h>
+#include <lunar/irq.h>
+#include <lunar/slab.h>
+#include <lunar/printk.h>
+#include <lunar/init.h>
+
+#include <uacpi/uacpi.h>
+#include <uacpi/acpi.h>
+#include <uacpi/tables.h>
+
+#include "internal.h"
+
+#define MAX_NUMA_RANGES 64
+
+struct numa_range {
+	physaddr_t base, end;
+	unsigned int node;
+};
+
+struct numa_cpu {
+	u32 id; /* The ID the firmware uses for the CPU */
+	unsigned int node;
+};
+
+static struct numa_range ranges[MAX_NUMA_RANGES];
+static unsigned int range_count = 0;
+
+static struct numa_cpu* cpus = NULL;
+static size_t cpu_count = 0;
+
+static u32 node_pxm[MAX_NUMA_NODES]; /* Proximity domain of every node */
+static unsigned int node_count = 1;
+static u8 distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+static unsigned int fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+unsigned int numa_node_count(void) {
+	return node_count;
+}
+
+unsigned int numa_node_id(void) {
+	unsigned long irq_flags = local_irq_save();
+	unsigned int node = current_cpu()->numa_node;
+	local_irq_restore(irq_flags);
+	return node;
+}
+
+unsigned int numa_node_of_address(physaddr_t address) {
+	for (unsigned int i = 0; i < range_count; i++) {
+		if (address >= ranges[i].base && address < ranges[i].end)
+			return ranges[i].node;
+	}
+	return 0;
+}
+
+unsigned int numa_distance(unsigned int from, unsigned int to) {
+	if (from >= node_count || to >= node_count)
+		return NUMA_REMOTE_DISTANCE;
+	return distances[from][to];
+}
+
+const unsigned int* numa_fallback_order(unsigned int node) {
+	return fallback[node < node_count ? node : 0];
+}
+
+/* Proximity domains can be any 32 bit value, so they're given node numbers in the order they're found */
+static int pxm_to_node(u32 pxm) {
+	for (unsigned int node = 0; node < node_count; node++) {
+		if (node_pxm[node] == pxm)
+			return node;
+	}
+	if (node_count >= MAX_NUMA_NODES) {
+		printk(PRINTK_WARN "numa: Too many nodes, proximity domain %u ignored\n", pxm);
+		return -ENOSPC;
+	}
+
+	node_pxm[node_count] = pxm;
+	return node_count++;
+}
+
+static void srat_add_memory(const struct acpi_srat_memory_affinity* mem) {
+	if (!(mem->flags & ACPI_SRAT_MEMORY_ENABLED) || mem->length == 0)
+		return;
+	if (range_count >= ARRAY_SIZE(ranges)) {
+		printk(PRINTK_WARN "numa: Too many memory ranges, %#lx-%#lx ignored\n",
+				mem->address, mem->address + mem->length);
+		return;
+	}
+
+	int node = pxm_to_node(mem->proximity_domain);
+	if (node < 0)
+		return;
+	ranges[range_count++] = (struct numa_range){ .base = mem->address, .end = mem->address + mem->length, .node = node };
+	printk(PRINTK_INFO "numa: Node %d: %#lx-%#lx\n", node, mem->address, mem->address + mem->length);
+}
+
+static void srat_add_cpu(u32 id, u32 pxm) {
+	int node = pxm_to_node(pxm);
+	if (node < 0)
+		return;
+	cpus[cpu_count++] = (struct numa_cpu){ .id = id, .node = node };
+}
+
+static void srat_parse(struct acpi_srat* srat) {
+	const struct acpi_entry_hdr* end = (struct acpi_entry_hdr*)((u8*)srat + srat->hdr.length);
+
+	/* Count the CPU's first, so the array can be allocated */
+	size_t max_cpus = 0;
+	for (const struct acpi_entry_hdr* entry = (struct acpi_entry_hdr*)(srat + 1); entry < end;
+			entry = (struct acpi_entry_hdr*)((u8*)entry + entry->length)) {
+		if (unlikely(entry->length == 0))
+			break;
+		if (entry->type == ACPI_SRAT_ENTRY_TYPE_PROCESSOR_AFFINITY || entry->type == ACPI_SRAT_ENTRY_TYPE_X2APIC_AFFINITY)
+			max_cpus++;
+	}
+	if (max_cpus) {
+		cpus = kcalloc(max_cpus, sizeof(*cpus), MM_ZONE_NORMAL);
+		if (!cpus)
+			out_of_memory();
+	}
+
+	for (const struct acpi_entry_hdr* entry = (struct acpi_entry_hdr*)(srat + 1); entry < end;
+			entry = (struct acpi_entry_hdr*)((u8*)entry + entry->length)) {
+		if (unlikely(entry->length == 0))
+			break;
+
+		switch (entry->type) {
+		case ACPI_SRAT_ENTRY_TYPE_PROCESSOR_AFFINITY: {
+			const struct acpi_srat_processor_affinity* cpu = (const void*)entry;
+			if (!(cpu->flags & ACPI_SRAT_PROCESSOR_ENABLED))
+				break;
+			u32 pxm = cpu->proximity_domain_low | ((u32)cpu->proximity_domain_high[0] << 8) |
+				((u32)cpu->proximity_domain_high[1] << 16) | ((u32)cpu->proximity_domain_high[2] << 24);
+			srat_add_cpu(cpu->id, pxm);
+			break;
+		}
+		case ACPI_SRAT_ENTRY_TYPE_X2APIC_AFFINITY: {
+			const struct acpi_srat_x2apic_affinity* cpu = (const void*)entry;
+			if (cpu->flags & ACPI_SRAT_X2APIC_ENABLED)
+				srat_add_cpu(cpu->id, cpu->proximity_domain);
+			break;
+		}
+		case ACPI_SRAT_ENTRY_TYPE_MEMORY_AFFINITY:
+			srat_add_memory((const void*)entry);
+			break;
+		}
+	}
+}
+
+static void slit_parse(const struct acpi_slit* slit) {
+	u64 localities = slit->num_localities;
+	if (slit->hdr.length < sizeof(*slit) + localities * localities) {
+		printk(PRINTK_ERR "numa: SLIT is too small for %lu localities\n", localities);
+		return;
+	}
+
+	for (unsigned int from = 0; from < node_count; from++) {
+		for (unsigned int to = 0; to < node_count; to++) {
+			if (node_pxm[from] < localities && node_pxm[to] < localities)
+				distances[from][to] = slit->matrix[node_pxm[from] * localities + node_pxm[to]];
+		}
+	}
+}
+
+static unsigned int numa_cpu_node(u32 id) {
+	for (size_t i = 0; i < cpu_count; i++) {
+		if (cpus[i].id == id)
+			return cpus[i].node;
+	}
+	return 0;
+}
+
+static void numa_init(void) {
+	node_pxm[0] = 0;
+
+	uacpi_table table;
+	if (uacpi_table_find_by_signature(ACPI_SRAT_SIGNATURE, &table) == UACPI_STATUS_OK) {
+		node_count = 0;
+		srat_parse(table.ptr);
+		uacpi_table_unref(&table);
+		if (node_count == 0)
+			node_count = 1;
+	}
+
+	for (unsigned int from = 0; from < node_count; from++) {
+		for (unsigned int to = 0; to < node_count; to++)
+			distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+	}
+	if (node_count > 1 && uacpi_table_find_by_signature(ACPI_SLIT_SIGNATURE, &table) == UACPI_STATUS_OK) {
+		slit_parse(table.ptr);
+		uacpi_table_unref(&table);
+	}
+
+	/* Sort the nodes by distance, the node itself always goes first */
+	for (unsigned int node = 0; node < node_count; node++) {
+		unsigned int* order = fallback[node];
+		order[0] = node;
+		unsigned int n = 1;
+		for (unsigned int other = 0; other < node_count; other++) {
+			if (other == node)
+				continue;
+			unsigned int j = n++;
+			while (j > 1 && distances[node][order[j - 1]] > distances[node][other]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = other;
+		}
+	}
+
+	current_cpu()->numa_node = numa_cpu_node(arch_cpu_firmware_id());
+	if (node_count > 1) {
+		printk(PRINTK_INFO "numa: %u nodes\n", node_count);
+		zones_numa_init();
+	}
+}
+
+static void numa_ap_init(void) {
+	current_cpu()->numa_node = numa_cpu_node(arch_cpu_firmware_id());
+}
+
+INIT_TASK_DECLARE(acpi_tables_init_task, heap_init_task, zones_init_task);
+INIT_TASK_DEFINE(numa_init_task, INIT_TASK_SCOPE_BSP, numa_init, &acpi_tables_init_task, &heap_init_task, &zones_init_task);
+INIT_TASK_DEFINE(numa_ap_init_task, INIT_TASK_SCOPE_AP, numa_ap_init, &numa_init_task);
@@ -0,0 +1,65 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/mutex.h>
+#include <lunar/printk.h>
+
+#include "internal.h"
+
+/*
+ * The shrinkers are asked for what's still missing in the order they were registered, so the ones
+ * that are cheapest to take memory from should be registered first. Direct reclaim can happen with
+ * the registry already locked further up the stack (a shrinker that allocates), so it only tries.
+ */
+
+static LIST_HEAD_DEFINE(shrinkers);
+static MUTEX_DEFINE(shrinker_lock);
+
+void register_shrinker(struct shrinker* shrinker) {
+	shrinker->calls = 0;
+	shrinker->freed = 0;
+	list_node_init(&shrinker->link);
+
+	mutex_acquire(&shrinker_lock);
+	list_add_tail(&shrinkers, &shrinker->link);
+	mutex_release(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker* shrinker) {
+	mutex_acquire(&shrinker_lock);
+	list_remove(&shrinker->link);
+	mutex_release(&shrinker_lock);
+}
+
+unsigned long shrink_memory(unsigned long target, bool wait) {
+	if (wait)
+		mutex_acquire(&shrinker_lock);
+	else if (!mutex_try_acquire(&shrinker_lock))
+		return 0;
+
+	unsigned long freed = 0;
+	struct shrinker* shrinker;
+	list_for_each_entry(shrinker, &shrinkers, link) {
+		if (freed >= target)
+			break;
+		if (!shrinker->count(shrinker))
+			continue;
+
+		const unsigned long got = shrinker->scan(shrinker, target - freed);
+		shrinker->calls++;
+		shrinker->freed += got;
+		freed += got;
+	}
+
+	mutex_release(&shrinker_lock);
+	return freed;
+}
+
+void shrinker_dump_stats(void) {
+	mutex_acquire(&shrinker_lock);
+	struct shrinker* shrinker;
+	list_for_each_entry(shrinker, &shrinkers, link) {
+		printk(PRINTK_INFO "mm: shrinker %s: %lu pages freeable, %lu calls, %lu pages freed\n",
+				shrinker->name, shrinker->count(shrinker), shrinker->calls, shrinker->freed);
+	}
+	mutex_release(&shrinker_lock);
+}
@@ -6,64 +6,158 @@
 #include <lunar/trace.h>
 #include <lunar/panic.h>
 #include <lunar/string.h>
+#include <lunar/percpu.h>
+#include <lunar/irq.h>
+
+#include "internal.h"
+
+/*
+ * Small objects are kept on-slab: one block holds the objects, then the bitmap, then the struct slab at the
+ * very end, and whatever doesn't fit an object is left between the objects and the bitmap. Big objects would
+ * waste too much of a block that way, so their slab and bitmap come from slab_meta_cache instead.
+ */
+#define SLAB_OFF_SLAB_MIN (PAGE_SIZE / 8) /* Smallest object size that is kept off-slab */
+#define SLAB_OFF_SLAB_MAX_OBJS 64 /* Off-slab bitmaps are a fixed size */
+#define SLAB_MAX_EXTRA_ORDER 3 /* How many orders past the smallest one that fits an object to try */
+#define SLAB_EMPTY_MAX 2 /* Empty slabs a cache keeps, the rest are released right away */
+
+struct slab_off_slab {
+	struct slab slab;
+	u8 free[SLAB_OFF_SLAB_MAX_OBJS / 8];
+};
+
+static struct slab_cache* slab_meta_cache = NULL; /* Has to be on-slab */
+
+/* Get how many objects fit in a slab of an order, and how many bytes are left over */
+static unsigned long slab_layout(size_t obj_size, bool off_slab, unsigned int order, size_t* waste) {
+	const size_t size = PAGE_SIZE << order;
+	if (off_slab) {
+		unsigned long count = size / obj_size;
+		if (count > SLAB_OFF_SLAB_MAX_OBJS)
+			count = SLAB_OFF_SLAB_MAX_OBJS;
+		*waste = size - count * obj_size;
+		return count;
+	}
 
-/* The maximum size a slab can be before the object count goes to SLAB_AFTER_CUTOFF_COUNT */
-#define SLAB_SIZE_CUTOFF 512
-#define SLAB_AFTER_CUTOFF_OBJ_COUNT 16
-
-static inline void* slab_alloc_struct(mm_t mm_flags, size_t size, struct page** out) {
-	struct page* page = alloc_pages(mm_flags, get_order(size));
-	if (!page)
-		return NULL;
+	/* Every object needs a bit in the bitmap too */
+	const size_t avail = ROUND_DOWN(size - sizeof(struct slab), alignof(struct slab));
+	unsigned long count = (avail * 8) / (obj_size * 8 + 1);
+	while (count && count * obj_size + ((count + 7) >> 3) > avail)
+		count--;
+	*waste = size - count * obj_size - ((count + 7) >> 3) - sizeof(struct slab);
+	return count;
+}
 
-	void* ptr = page_hhdm_virtual(page);
-	memset(ptr, 0, size);
+/*
+ * Use the smallest order that wastes at most an eighth of a slab, or the one that wastes the least otherwise.
+ * The waste is what's left for coloring, every color moves the objects of a slab up by a cache line.
+ */
+static int slab_cache_pick_order(struct slab_cache* cache) {
+	const unsigned int min_order = get_order(cache->obj_size);
+	if (min_order > MAX_ORDER)
+		return -EINVAL;
+
+	unsigned long best_count = 0;
+	size_t best_waste = 0;
+	unsigned int best_order = 0;
+	for (unsigned int order = min_order; order <= min_order + SLAB_MAX_EXTRA_ORDER && order <= MAX_ORDER; order++) {
+		size_t waste;
+		const unsigned long count = slab_layout(cache->obj_size, cache->off_slab, order, &waste);
+		if (count == 0)
+			continue;
+
+		/* Compare the fraction that's wasted, the slabs are different sizes */
+		if (best_count == 0 || (waste << best_order) < (best_waste << order)) {
+			best_count = count;
+			best_waste = waste;
+			best_order = order;
+		}
+		if (waste * 8 <= PAGE_SIZE << order)
+			break;
+	}
 
-	*out = page;
-	return ptr;
+	if (best_count == 0)
+		return -EINVAL;
+	cache->order = best_order;
+	cache->obj_count = best_count;
+	cache->color_step = cache->align > SLAB_ALIGN_CACHE_LINE ? cache->align : SLAB_ALIGN_CACHE_LINE;
+	cache->colors = best_waste / cache->color_step + 1;
+	return 0;
 }
 
-static inline void slab_free_struct(struct page* page) {
-	release_page(page);
+/* Point the struct pages of a slab's objects back at it, so a free can find the slab without a search */
+static void slab_set_pages(struct slab_cache* cache, struct slab* slab) {
+	for (size_t i = 0; i < 1ul << cache->order; i++) {
+		slab->page[i].slab.cache = cache;
+		slab->page[i].slab.slab = slab;
+		page_info_update(&slab->page[i], PAGE_FLAG_SLAB, PAGE_FLAG_SLAB);
+	}
 }
 
-static int slab_init(struct slab_cache* cache, struct page* slab_page, struct slab* slab) {
-	slab->self_page = slab_page;
-
-	size_t map_size = (cache->obj_count + 7) >> 3;
-	size_t slab_size = cache->obj_size * cache->obj_count;
+static void slab_clear_pages(struct slab_cache* cache, struct slab* slab) {
+	for (size_t i = 0; i < 1ul << cache->order; i++) {
+		page_info_update(&slab->page[i], PAGE_FLAG_SLAB, 0);
+		slab->page[i].slab.cache = NULL;
+		slab->page[i].slab.slab = NULL;
+	}
+}
 
-	/* Allocate free list bitmap */
-	slab->free.virtual = slab_alloc_struct(cache->mm_flags, map_size, &slab->free.page);
-	if (!slab->free.virtual)
+static int slab_cache_grow(struct slab_cache* cache) {
+	/* Callers of caches without a constructor may rely on fresh objects being zeroed */
+	struct page* page = alloc_pages(cache->ctor ? cache->mm_flags : cache->mm_flags | MM_ZERO, cache->order);
+	if (!page)
 		return -ENOMEM;
 
-	/* Allocate a virtual address for the slab base */
-	slab->base.virtual = slab_alloc_struct(cache->mm_flags, slab_size, &slab->base.page);
-	if (!slab->base.virtual) {
-		slab_free_struct(slab->free.page);
-		return -ENOMEM;
+	u8* block = page_hhdm_virtual(page);
+	size_t color = 0;
+	if (cache->coloring) {
+		color = cache->color_next * cache->color_step;
+		cache->color_next = (cache->color_next + 1) % cache->colors;
+	}
+
+	struct slab* slab;
+	if (cache->off_slab) {
+		struct slab_off_slab* meta = slab_cache_alloc(slab_meta_cache);
+		if (!meta) {
+			release_page(page);
+			return -ENOMEM;
+		}
+		slab = &meta->slab;
+		slab->free = meta->free;
+	} else {
+		slab = (struct slab*)(block + (PAGE_SIZE << cache->order) - sizeof(*slab));
+		slab->free = (u8*)slab - ((cache->obj_count + 7) >> 3);
 	}
 
+	slab->page = page;
+	slab->base = block + color;
 	slab->in_use = 0;
+	memset(slab->free, 0, (cache->obj_count + 7) >> 3);
 	list_node_init(&slab->link);
+
+	/* Objects stay constructed while they're free, so this is the only time the constructor runs */
+	if (cache->ctor) {
+		for (size_t i = 0; i < cache->obj_count; i++)
+			cache->ctor((u8*)slab->base + cache->obj_size * i);
+	}
+	slab_set_pages(cache, slab);
+	list_add(&cache->empty, &slab->link);
+	cache->empty_slabs++;
 	return 0;
 }
 
-static int slab_cache_grow(struct slab_cache* cache) {
-	struct page* slab_page;
-	struct slab* slab = slab_alloc_struct((cache->mm_flags & MM_ATOMIC) | MM_ZONE_NORMAL, sizeof(*slab), &slab_page);
-	if (!slab)
-		return -ENOMEM;
-
-	int err = slab_init(cache, slab_page, slab);
-	if (err) {
-		slab_free_struct(slab_page);
-		return err;
+/* Give an empty slab's memory back, it has to be off the lists already */
+static void slab_destroy(struct slab_cache* cache, struct slab* slab) {
+	if (cache->dtor) {
+		for (size_t i = 0; i < cache->obj_count; i++)
+			cache->dtor((u8*)slab->base + cache->obj_size * i);
 	}
 
-	list_add(&cache->empty, &slab->link);
-	return 0;
+	struct page* page = slab->page;
+	slab_clear_pages(cache, slab);
+	if (cache->off_slab)
+		slab_cache_free(slab_meta_cache, container_of(slab, struct slab_off_slab, slab));
+	release_page(page);
 }
 
 static void* slab_take(struct slab_cache* cache, struct slab* slab) {
@@ -74,8 +168,8 @@ static void* slab_take(struct slab_cache* cache, struct slab* slab) {
 		size_t byte_index = i >> 3;
 		unsigned int bit_index = i & 7;
 
-		if (!(slab->free.virtual[byte_index] & (1 << bit_index))) {
-			slab->free.virtual[byte_index] |= (1 << bit_index);
+		if (!(slab->free[byte_index] & (1 << bit_index))) {
+			slab->free[byte_index] |= (1 << bit_index);
 			obj_num = i;
 			break;
 		}
@@ -84,35 +178,69 @@ static void* slab_take(struct slab_cache* cache, struct slab* slab) {
 	if (obj_num == SIZE_MAX)
 		return NULL;
 
-	/* Now just get the object's pointer and call its constructor */
-	void* obj = (u8*)slab->base.virtual + cache->obj_size * obj_num;
-	if (cache->ctor)
-		cache->ctor(obj);
-
 	slab->in_use++;
-	return obj;
+	return (u8*)slab->base + cache->obj_size * obj_num;
 }
 
-static struct slab* __slab_find(struct list_head* slabs, unsigned long obj_count, size_t obj_size, void* obj) {
+/* Take up to count objects from a slab with one pass over the bitmap, returns how many were taken */
+static size_t slab_take_bulk(struct slab_cache* cache, struct slab* slab, size_t count, void** objs) {
+	size_t taken = 0;
+	for (size_t i = 0; i < cache->obj_count && taken < count; i++) {
+		size_t byte_index = i >> 3;
+		unsigned int bit_index = i & 7;
+		if (slab->free[byte_index] == 0xff) {
+			i |= 7; /* Skip the whole byte */
+			continue;
+		}
+
+		if (!(slab->free[byte_index] & (1 << bit_index))) {
+			slab->free[byte_index] |= (1 << bit_index);
+			objs[taken++] = (u8*)slab->base + cache->obj_size * i;
+		}
+	}
+
+	slab->in_use += taken;
+	return taken;
+}
+
+/* Get the slab of an object from its struct page, NULL if the object isn't from this cache. Doesn't need the lock. */
+static struct slab* slab_lookup(struct slab_cache* cache, void* obj) {
+	struct page* page = physaddr_to_page(hhdm_physical(obj));
+	if (!page || !(page_flags(page) & PAGE_FLAG_SLAB) || page->slab.cache != cache)
+		return NULL;
+	return page->slab.slab;
+}
+
+#ifdef CONFIG_SLAB_DEBUG
+
+static bool slab_in_list(struct list_head* slabs, struct slab* slab) {
 	struct slab* pos;
 	list_for_each_entry(pos, slabs, link) {
-		void* top = (u8*)pos->base.virtual + obj_count * obj_size;
-		if (obj >= pos->base.virtual && obj < top)
-			return pos;
+		if (pos == slab)
+			return true;
 	}
+	return false;
+}
 
-	return NULL;
+/* Cross check a back pointer with the lists of the cache, which has to be locked */
+static void slab_debug_check(struct slab_cache* cache, struct slab* slab, void* obj) {
+	const uintptr_t offset = (uintptr_t)obj - (uintptr_t)slab->base;
+	if (offset >= cache->obj_count * cache->obj_size || offset % cache->obj_size)
+		panic("Slab object %p isn't the start of an object in slab %p", obj, slab);
+	if (!slab_in_list(&cache->partial, slab) && !slab_in_list(&cache->full, slab) && !slab_in_list(&cache->empty, slab))
+		panic("Slab object %p points to slab %p, which isn't in its cache", obj, slab);
 }
 
-/* Find a slab within a cache */
+#endif /* CONFIG_SLAB_DEBUG */
+
+/* Find a slab within a cache, which has to be locked */
 static struct slab* slab_find(struct slab_cache* cache, void* obj) {
-	struct slab* slab = __slab_find(&cache->partial, cache->obj_count, cache->obj_size, obj);
+	struct slab* slab = slab_lookup(cache, obj);
+#ifdef CONFIG_SLAB_DEBUG
 	if (slab)
-		return slab;
-	slab = __slab_find(&cache->full, cache->obj_count, cache->obj_size, obj);
-	if (slab)
-		return slab;
-	return __slab_find(&cache->empty, cache->obj_count, cache->obj_size, obj);
+		slab_debug_check(cache, slab, obj);
+#endif /* CONFIG_SLAB_DEBUG */
+	return slab;
 }
 
 static struct slab* slab_release(struct slab_cache* cache, void* obj) {
@@ -121,17 +249,14 @@ static struct slab* slab_release(struct slab_cache* cache, void* obj) {
 		return NULL; /* Let the caller do what it wants */
 
 	/* Get the object number and then mark it as free */
-	size_t obj_num = ((uintptr_t)obj - (uintptr_t)slab->base.virtual) / cache->obj_size;
+	size_t obj_num = ((uintptr_t)obj - (uintptr_t)slab->base) / cache->obj_size;
 	size_t byte_index = obj_num >> 3;
 	size_t bit_index = obj_num & 7;
 
 	/* Check for a double free here since the caller can't check directly */
-	bug((slab->free.virtual[byte_index] & (1 << bit_index)) == 0);
-	slab->free.virtual[byte_index] &= ~(1 << bit_index);
+	bug((slab->free[byte_index] & (1 << bit_index)) == 0);
+	slab->free[byte_index] &= ~(1 << bit_index);
 
-	/* Now call the destructor and return the slab the free happened on */
-	if (cache->dtor)
-		cache->dtor(obj);
 	slab->in_use--;
 	return slab;
 }
@@ -150,7 +275,7 @@ static inline void slab_cache_unlock(struct slab_cache* cache, unsigned long* ir
 		mutex_release(&cache->mutex);
 }
 
-void* slab_cache_alloc(struct slab_cache* cache) {
+static void* slab_cache_alloc_slab(struct slab_cache* cache) {
 	unsigned long irq_flags;
 	slab_cache_lock(cache, &irq_flags);
 
@@ -171,16 +296,18 @@ void* slab_cache_alloc(struct slab_cache* cache) {
 	}
 
 	struct slab* slab = list_first_entry(list, struct slab, link);
+	if (slab->in_use == 0)
+		cache->empty_slabs--;
 	ret = slab_take(cache, slab);
 	bug(ret == NULL); /* If this happens something bad has happened since the cache grew successfuly */
 
 	/* Check to see if the slab is in the appropriate list. If not, move it. */
-	if (slab->in_use == 1) {
-		list_remove(&slab->link);
-		list_add(&cache->partial, &slab->link);
-	} else if (slab->in_use == cache->obj_count) {
+	if (slab->in_use == cache->obj_count) {
 		list_remove(&slab->link);
 		list_add(&cache->full, &slab->link);
+	} else if (slab->in_use == 1) {
+		list_remove(&slab->link);
+		list_add(&cache->partial, &slab->link);
 	}
 
 out:
@@ -188,42 +315,488 @@ out:
 	return ret;
 }
 
-void slab_cache_free(struct slab_cache* cache, void* obj) {
+static bool __slab_cache_free_slab(struct slab_cache* cache, void* obj);
+
+/* Fill objs with one lock hold, taking whole slabs at a time. Either every object is allocated or none are. */
+static bool slab_cache_alloc_slab_bulk(struct slab_cache* cache, size_t count, void** objs) {
 	unsigned long irq_flags;
 	slab_cache_lock(cache, &irq_flags);
 
+	size_t got = 0;
+	while (got < count) {
+		struct list_head* list = NULL;
+		if (!list_empty(&cache->partial))
+			list = &cache->partial;
+		else if (!list_empty(&cache->empty))
+			list = &cache->empty;
+		else if (slab_cache_grow(cache) == 0)
+			list = &cache->empty;
+		else
+			break;
+
+		struct slab* slab = list_first_entry(list, struct slab, link);
+		if (slab->in_use == 0)
+			cache->empty_slabs--;
+		got += slab_take_bulk(cache, slab, count - got, objs + got);
+		list_remove(&slab->link);
+		list_add(slab->in_use == cache->obj_count ? &cache->full : &cache->partial, &slab->link);
+	}
+
+	if (got < count) {
+		while (got)
+			__slab_cache_free_slab(cache, objs[--got]);
+	}
+
+	slab_cache_unlock(cache, &irq_flags);
+	return got == count;
+}
+
+/* The cache has to be locked, returns true if the slab of the object was given back */
+static bool __slab_cache_free_slab(struct slab_cache* cache, void* obj) {
 	struct slab* slab = slab_release(cache, obj);
 	if (!slab) {
 		printk(PRINTK_ERR "mm: slab_release returned NULL, invalid object? obj: %p\n", obj);
 		dump_stack();
-		goto out;
+		return false;
 	}
 
-	/* Make sure the slab is in the appropriate list */
+	/* Make sure the slab is in the appropriate list, only a few empty slabs are kept around */
 	if (slab->in_use == 0) {
 		list_remove(&slab->link);
+		if (cache->empty_slabs >= SLAB_EMPTY_MAX) {
+			slab_destroy(cache, slab);
+			return true;
+		}
 		list_add(&cache->empty, &slab->link);
+		cache->empty_slabs++;
 	} else if (slab->in_use == cache->obj_count - 1) {
 		list_remove(&slab->link);
 		list_add(&cache->partial, &slab->link);
 	}
+	return false;
+}
 
-out:
+static void slab_cache_free_slab(struct slab_cache* cache, void* obj) {
+	unsigned long irq_flags;
+	slab_cache_lock(cache, &irq_flags);
+	__slab_cache_free_slab(cache, obj);
 	slab_cache_unlock(cache, &irq_flags);
 }
 
-struct slab_cache* slab_cache_create(size_t obj_size, size_t align, 
+/*
+ * Per-CPU magazines, as in Bonwick's "Magazines and Vmem". Every CPU has a loaded and a previous magazine,
+ * and each of them is always either full, empty, or NULL. Most allocations and frees just pop or push on the
+ * loaded magazine with IRQ's off, and when neither magazine can be used the CPU trades one with the depot.
+ * The slabs only get locked when the depot can't help either.
+ */
+struct slab_magazine {
+	struct slab_magazine* next;
+	unsigned int capacity, count;
+	void* objs[SLAB_MAGAZINE_MAX];
+};
+static_assert(sizeof(struct slab_magazine) == 512, "sizeof(struct slab_magazine) == 512");
+
+struct slab_cpu {
+	struct slab_magazine* loaded, *previous;
+	unsigned long alloc_hits, alloc_misses, free_hits, free_misses;
+};
+
+#define SLAB_DEPOT_MAX_DEFAULT 8
+
+static struct slab_cache* magazine_cache = NULL; /* Doesn't have any magazines itself */
+static LIST_HEAD_DEFINE(slab_caches);
+static MUTEX_DEFINE(slab_caches_lock);
+
+/* Big objects don't get magazines by default, since every magazine would hold on to a lot of memory */
+static unsigned int magazine_size_default(size_t obj_size) {
+	if (obj_size <= 256)
+		return 32;
+	if (obj_size <= 1024)
+		return 16;
+	if (obj_size <= PAGE_SIZE)
+		return 8;
+	return 0;
+}
+
+static inline struct slab_cpu* slab_cpu(struct slab_cache* cache) {
+	return &cache->cpus[current_cpu()->runqueue.sched_id];
+}
+
+static inline bool magazine_is_empty(const struct slab_magazine* mag) {
+	return !mag || mag->count == 0;
+}
+
+static inline bool magazine_is_full(const struct slab_magazine* mag) {
+	return !mag || mag->count == mag->capacity;
+}
+
+/* The depot has to be locked for these */
+static inline void depot_push(struct slab_magazine** list, unsigned long* count, struct slab_magazine* mag) {
+	mag->next = *list;
+	*list = mag;
+	(*count)++;
+}
+
+static inline struct slab_magazine* depot_pop(struct slab_magazine** list, unsigned long* count) {
+	struct slab_magazine* mag = *list;
+	if (mag) {
+		*list = mag->next;
+		(*count)--;
+	}
+	return mag;
+}
+
+/* Safe with IRQ's off, since the magazine cache is atomic */
+static struct slab_magazine* magazine_create(struct slab_cache* cache) {
+	const unsigned int capacity = cache->magazine_size;
+	if (capacity == 0)
+		return NULL;
+
+	struct slab_magazine* mag = slab_cache_alloc(magazine_cache);
+	if (mag) {
+		mag->next = NULL;
+		mag->capacity = capacity;
+		mag->count = 0;
+	}
+	return mag;
+}
+
+/* Give every object in a magazine back to the slabs, and free the magazine */
+static void magazine_destroy(struct slab_cache* cache, struct slab_magazine* mag) {
+	if (mag->count) {
+		unsigned long irq_flags;
+		slab_cache_lock(cache, &irq_flags);
+		while (mag->count)
+			__slab_cache_free_slab(cache, mag->objs[--mag->count]);
+		slab_cache_unlock(cache, &irq_flags);
+	}
+	slab_cache_free(magazine_cache, mag);
+}
+
+static void magazine_destroy_list(struct slab_cache* cache, struct slab_magazine* mag) {
+	while (mag) {
+		struct slab_magazine* next = mag->next;
+		magazine_destroy(cache, mag);
+		mag = next;
+	}
+}
+
+/*
+ * Returns NULL if the magazines are empty and the depot doesn't have a full one. An empty magazine that
+ * doesn't fit in the depot is put in spare, so it can be freed once IRQ's are back on.
+ */
+static void* magazine_alloc(struct slab_cache* cache, struct slab_magazine** spare) {
+	struct slab_cpu* cpu = slab_cpu(cache);
+	if (magazine_is_empty(cpu->loaded)) {
+		if (!magazine_is_empty(cpu->previous)) {
+			struct slab_magazine* tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+		} else {
+			spinlock_acquire(&cache->depot.lock);
+			struct slab_magazine* full = depot_pop(&cache->depot.full, &cache->depot.full_count);
+			if (full) {
+				if (cpu->previous && cache->depot.empty_count < cache->depot_max)
+					depot_push(&cache->depot.empty, &cache->depot.empty_count, cpu->previous);
+				else
+					*spare = cpu->previous;
+				cpu->previous = cpu->loaded;
+				cpu->loaded = full;
+				cache->depot.exchanges++;
+			}
+			spinlock_release(&cache->depot.lock);
+
+			if (!full) {
+				cpu->alloc_misses++;
+				return NULL;
+			}
+		}
+	}
+
+	cpu->alloc_hits++;
+	return cpu->loaded->objs[--cpu->loaded->count];
+}
+
+/* Returns false if the object has to go back to the slabs */
+static bool magazine_free(struct slab_cache* cache, void* obj) {
+	struct slab_cpu* cpu = slab_cpu(cache);
+	if (magazine_is_full(cpu->loaded)) {
+		if (cpu->previous && cpu->previous->count == 0) {
+			struct slab_magazine* tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+		} else {
+			/* The previous magazine is full, and has to go to the depot to make room for an empty one */
+			spinlock_acquire(&cache->depot.lock);
+			const bool room = !cpu->previous || cache->depot.full_count < cache->depot_max;
+			struct slab_magazine* empty = room ? depot_pop(&cache->depot.empty, &cache->depot.empty_count) : NULL;
+			spinlock_release(&cache->depot.lock);
+			if (room && !empty)
+				empty = magazine_create(cache);
+			if (!empty) {
+				cpu->free_misses++;
+				return false;
+			}
+
+			spinlock_acquire(&cache->depot.lock);
+			if (cpu->previous)
+				depot_push(&cache->depot.full, &cache->depot.full_count, cpu->previous);
+			cache->depot.exchanges++;
+			spinlock_release(&cache->depot.lock);
+			cpu->previous = cpu->loaded;
+			cpu->loaded = empty;
+		}
+	}
+
+	cpu->free_hits++;
+	cpu->loaded->objs[cpu->loaded->count++] = obj;
+	return true;
+}
+
+/* Nothing can be using the cache, so the magazines of the other CPU's can be touched */
+static void slab_cache_flush_magazines(struct slab_cache* cache) {
+	for (u32 i = 0; i < cache->cpu_count; i++) {
+		struct slab_cpu* cpu = &cache->cpus[i];
+		if (cpu->loaded)
+			magazine_destroy(cache, cpu->loaded);
+		if (cpu->previous)
+			magazine_destroy(cache, cpu->previous);
+		cpu->loaded = NULL;
+		cpu->previous = NULL;
+	}
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cache->depot.lock, &irq_flags);
+	struct slab_magazine* full = cache->depot.full;
+	struct slab_magazine* empty = cache->depot.empty;
+	cache->depot.full = NULL;
+	cache->depot.empty = NULL;
+	cache->depot.full_count = 0;
+	cache->depot.empty_count = 0;
+	spinlock_release_irq_restore(&cache->depot.lock, &irq_flags);
+
+	magazine_destroy_list(cache, full);
+	magazine_destroy_list(cache, empty);
+}
+
+void* slab_cache_alloc(struct slab_cache* cache) {
+	void* obj = NULL;
+	if (cache->magazine_size) {
+		struct slab_magazine* spare = NULL;
+		unsigned long irq_flags = local_irq_save();
+		obj = magazine_alloc(cache, &spare);
+		local_irq_restore(irq_flags);
+		if (spare)
+			slab_cache_free(magazine_cache, spare);
+	}
+	if (!obj)
+		obj = slab_cache_alloc_slab(cache);
+	return obj;
+}
+
+void slab_cache_free(struct slab_cache* cache, void* obj) {
+#ifdef CONFIG_SLAB_DEBUG
+	/* Catch bad frees before they can hide in a magazine */
+	if (unlikely(!slab_lookup(cache, obj))) {
+		printk(PRINTK_ERR "mm: %s(%p) failed: object isn't from this cache\n", __func__, obj);
+		dump_stack();
+		return;
+	}
+#endif /* CONFIG_SLAB_DEBUG */
+	if (cache->magazine_size) {
+		unsigned long irq_flags = local_irq_save();
+		const bool cached = magazine_free(cache, obj);
+		local_irq_restore(irq_flags);
+		if (cached)
+			return;
+	}
+	slab_cache_free_slab(cache, obj);
+}
+
+void slab_cache_set_coloring(struct slab_cache* cache, bool enable) {
+	unsigned long irq_flags;
+	slab_cache_lock(cache, &irq_flags);
+	cache->coloring = enable;
+	cache->color_next = 0;
+	slab_cache_unlock(cache, &irq_flags);
+}
+
+int slab_cache_alloc_bulk(struct slab_cache* cache, mm_t mm_flags, size_t count, void** objs) {
+	/* A cache that isn't atomic is locked with a mutex, and grows with allocations that can sleep */
+	if (mm_flags & MM_ATOMIC && !(cache->mm_flags & MM_ATOMIC))
+		return -EWOULDBLOCK;
+	/* Zeroing would undo the constructor, and objects have to stay constructed */
+	if (mm_flags & MM_ZERO && cache->ctor)
+		return -EINVAL;
+
+	if (!slab_cache_alloc_slab_bulk(cache, count, objs))
+		return -ENOMEM;
+	if (mm_flags & MM_ZERO) {
+		for (size_t i = 0; i < count; i++)
+			memset(objs[i], 0, cache->obj_size);
+	}
+	return 0;
+}
+
+void slab_cache_free_bulk(struct slab_cache* cache, size_t count, void** objs) {
+	/* Straight to the slabs, the magazines would only take a few of the objects anyway */
+	unsigned long irq_flags;
+	slab_cache_lock(cache, &irq_flags);
+	for (size_t i = 0; i < count; i++)
+		__slab_cache_free_slab(cache, objs[i]);
+	slab_cache_unlock(cache, &irq_flags);
+}
+
+int slab_cache_tune(struct slab_cache* cache, unsigned int magazine_size, unsigned int depot_max) {
+	if (magazine_size > SLAB_MAGAZINE_MAX)
+		return -EINVAL;
+	if (!magazine_cache || cache == magazine_cache)
+		return -ENOTSUP;
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cache->depot.lock, &irq_flags);
+	cache->magazine_size = magazine_size;
+	cache->depot_max = depot_max;
+	struct slab_magazine* full = cache->depot.full;
+	cache->depot.full = NULL;
+	cache->depot.full_count = 0;
+	spinlock_release_irq_restore(&cache->depot.lock, &irq_flags);
+
+	magazine_destroy_list(cache, full);
+	return 0;
+}
+
+void slab_dump_stats(void) {
+	mutex_acquire(&slab_caches_lock);
+	struct slab_cache* cache;
+	list_for_each_entry(cache, &slab_caches, link) {
+		unsigned long alloc_hits = 0, alloc_misses = 0, free_hits = 0, free_misses = 0;
+		for (u32 i = 0; i < cache->cpu_count; i++) {
+			alloc_hits += cache->cpus[i].alloc_hits;
+			alloc_misses += cache->cpus[i].alloc_misses;
+			free_hits += cache->cpus[i].free_hits;
+			free_misses += cache->cpus[i].free_misses;
+		}
+
+		const unsigned long allocs = alloc_hits + alloc_misses;
+		if (!allocs)
+			continue;
+		printk(PRINTK_INFO "mm: slab %zu bytes (mm_flags: %u): order %u, %lu objects%s, %u colors, magazine %u, "
+				"alloc hits %lu/%lu (%lu%%), free hits %lu/%lu, depot %lu full %lu empty, %lu exchanges\n",
+				cache->obj_size, cache->mm_flags, cache->order, cache->obj_count, cache->off_slab ? " off-slab" : "",
+				cache->coloring ? cache->colors : 1, cache->magazine_size, alloc_hits, allocs,
+				alloc_hits * 100 / allocs, free_hits, free_hits + free_misses,
+				cache->depot.full_count, cache->depot.empty_count, cache->depot.exchanges);
+	}
+	mutex_release(&slab_caches_lock);
+}
+
+static inline bool slab_cache_try_lock(struct slab_cache* cache, unsigned long* irq_flags) {
+	if (cache->mm_flags & MM_ATOMIC)
+		return spinlock_try_acquire_irq_save(&cache->spinlock, irq_flags);
+	return mutex_try_acquire(&cache->mutex);
+}
+
+/*
+ * Caches keep a few empty slabs so they don't have to grow again right away, those are given back when memory
+ * runs low. Reclaim can happen while a cache is growing or being created further up the stack, so everything
+ * here only tries to take the locks.
+ */
+static unsigned long slab_shrink_count(struct shrinker* shrinker) {
+	(void)shrinker;
+	if (!mutex_try_acquire(&slab_caches_lock))
+		return 0;
+
+	/* Objects in the depot can free up to a slab each, but they're usually packed into a few */
+	unsigned long pages = 0;
+	struct slab_cache* cache;
+	list_for_each_entry(cache, &slab_caches, link) {
+		const unsigned long depot_objs = cache->depot.full_count * cache->magazine_size;
+		pages += (cache->empty_slabs + depot_objs / cache->obj_count) << cache->order;
+	}
+	mutex_release(&slab_caches_lock);
+	return pages;
+}
+
+/*
+ * Objects sitting in the depot's full magazines keep their slabs partial, so they're given back to the slabs
+ * first. The cache has to be locked. Returns the magazines, which can only be freed once the cache is unlocked.
+ */
+static struct slab_magazine* slab_shrink_depot(struct slab_cache* cache, unsigned long* freed) {
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&cache->depot.lock, &irq_flags);
+	struct slab_magazine* full = cache->depot.full;
+	cache->depot.full = NULL;
+	cache->depot.full_count = 0;
+	spinlock_release_irq_restore(&cache->depot.lock, &irq_flags);
+
+	for (struct slab_magazine* mag = full; mag; mag = mag->next) {
+		while (mag->count) {
+			if (__slab_cache_free_slab(cache, mag->objs[--mag->count]))
+				*freed += 1ul << cache->order;
+		}
+	}
+	return full;
+}
+
+static unsigned long slab_shrink_scan(struct shrinker* shrinker, unsigned long target) {
+	(void)shrinker;
+	if (!mutex_try_acquire(&slab_caches_lock))
+		return 0;
+
+	unsigned long freed = 0;
+	struct slab_cache* cache;
+	list_for_each_entry(cache, &slab_caches, link) {
+		if (freed >= target)
+			break;
+
+		unsigned long irq_flags;
+		if (!slab_cache_try_lock(cache, &irq_flags))
+			continue;
+		struct slab_magazine* drained = slab_shrink_depot(cache, &freed);
+		struct slab* slab, *tmp;
+		list_for_each_entry_safe(slab, tmp, &cache->empty, link) {
+			if (freed >= target)
+				break;
+			list_remove(&slab->link);
+			cache->empty_slabs--;
+			slab_destroy(cache, slab);
+			freed += 1ul << cache->order;
+		}
+		slab_cache_unlock(cache, &irq_flags);
+
+		while (drained) {
+			struct slab_magazine* next = drained->next;
+			slab_cache_free(magazine_cache, drained);
+			drained = next;
+		}
+	}
+
+	mutex_release(&slab_caches_lock);
+	return freed;
+}
+
+static struct shrinker slab_shrinker = {
+	.name = "slab",
+	.count = slab_shrink_count,
+	.scan = slab_shrink_scan
+};
+
+static struct slab_cache* __slab_cache_create(size_t obj_size, size_t align,
 		mm_t mm_flags, void (*ctor)(void*), void (*dtor)(void*)) {
 	if (obj_size == 0)
 		return NULL;
 
 	if (align == 0)
 		align = 8;
-	else if (align & (align - 1))
+	else if (align & (align - 1) || align > PAGE_SIZE)
 		return NULL;
 
+	/* The per-CPU magazines go right after the cache */
 	struct slab_cache* cache;
-	struct page* cache_page = alloc_pages(MM_ZONE_NORMAL | (mm_flags & MM_ATOMIC), get_order(sizeof(*cache)));
+	const u32 cpu_count = arch_get_cpu_count();
+	const size_t size = sizeof(*cache) + cpu_count * sizeof(struct slab_cpu);
+	struct page* cache_page = alloc_pages(MM_ZONE_NORMAL | MM_ZERO | (mm_flags & MM_ATOMIC), get_order(size));
 	if (!cache_page)
 		return NULL;
 
@@ -235,24 +808,62 @@ struct slab_cache* slab_cache_create(size_t obj_size, size_t align,
 	list_head_init(&cache->partial);
 	list_head_init(&cache->empty);
 	cache->obj_size = ROUND_UP(obj_size, align);
-	cache->obj_count = cache->obj_size < SLAB_SIZE_CUTOFF ? (PAGE_SIZE * 2) / cache->obj_size : SLAB_AFTER_CUTOFF_OBJ_COUNT;
 	cache->align = align;
+	cache->off_slab = cache->obj_size >= SLAB_OFF_SLAB_MIN;
+	if (slab_cache_pick_order(cache)) {
+		release_page(cache_page);
+		return NULL;
+	}
+	cache->color_next = 0;
+	cache->coloring = true;
 	cache->mm_flags = mm_flags;
 	if (mm_flags & MM_ATOMIC)
 		spinlock_init(&cache->spinlock);
 	else
 		mutex_init(&cache->mutex);
 
+	cache->cpus = (struct slab_cpu*)(cache + 1);
+	cache->cpu_count = cpu_count;
+	cache->magazine_size = 0;
+	cache->depot_max = SLAB_DEPOT_MAX_DEFAULT;
+	spinlock_init(&cache->depot.lock);
+	list_node_init(&cache->link);
 	return cache;
 }
 
-static inline bool slab_cache_try_lock(struct slab_cache* cache, unsigned long* irq_flags) {
-	if (cache->mm_flags & MM_ATOMIC)
-		return spinlock_try_acquire_irq_save(&cache->spinlock, irq_flags);
-	return mutex_try_acquire(&cache->mutex);
+struct slab_cache* slab_cache_create(size_t obj_size, size_t align,
+		mm_t mm_flags, void (*ctor)(void*), void (*dtor)(void*)) {
+	mutex_acquire(&slab_caches_lock);
+	if (!slab_meta_cache) {
+		slab_meta_cache = __slab_cache_create(sizeof(struct slab_off_slab), alignof(struct slab_off_slab),
+				MM_ZONE_NORMAL | MM_ATOMIC, NULL, NULL);
+		if (!slab_meta_cache) {
+			mutex_release(&slab_caches_lock);
+			return NULL;
+		}
+		list_add(&slab_caches, &slab_meta_cache->link);
+		register_shrinker(&slab_shrinker);
+	}
+	if (!magazine_cache) {
+		magazine_cache = __slab_cache_create(sizeof(struct slab_magazine), alignof(struct slab_magazine),
+				MM_ZONE_NORMAL | MM_ATOMIC, NULL, NULL);
+		if (magazine_cache)
+			list_add(&slab_caches, &magazine_cache->link);
+	}
+
+	struct slab_cache* cache = __slab_cache_create(obj_size, align, mm_flags, ctor, dtor);
+	if (cache) {
+		if (magazine_cache)
+			cache->magazine_size = magazine_size_default(cache->obj_size);
+		list_add(&slab_caches, &cache->link);
+	}
+	mutex_release(&slab_caches_lock);
+	return cache;
 }
 
 int slab_cache_destroy(struct slab_cache* cache) {
+	slab_cache_flush_magazines(cache);
+
 	unsigned long irq_flags;
 	if (!slab_cache_try_lock(cache, &irq_flags))
 		return -EWOULDBLOCK;
@@ -264,12 +875,15 @@ int slab_cache_destroy(struct slab_cache* cache) {
 	struct slab* slab, *tmp;
 	list_for_each_entry_safe(slab, tmp, &cache->empty, link) {
 		list_remove(&slab->link);
-		slab_free_struct(slab->base.page);
-		slab_free_struct(slab->free.page);
-		slab_free_struct(slab->self_page);
+		slab_destroy(cache, slab);
 	}
+	cache->empty_slabs = 0;
 
 	slab_cache_unlock(cache, &irq_flags);
+
+	mutex_acquire(&slab_caches_lock);
+	list_remove(&cache->link);
+	mutex_release(&slab_caches_lock);
 	release_page(cache->self_page);
 	return 0;
 }
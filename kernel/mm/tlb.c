@@ -1,6 +1,7 @@
 #include <lunar/irq.h>
 #include <lunar/proc.h>
 #include <lunar/vmm.h>
+#include <lunar/printk.h>
 #include <arch/processor.h>
 #include <arch/tlb.h>
 #include "internal.h"
@@ -26,23 +27,22 @@ static atomic(size_t) shootdown_page_count;
 static atomic(u32) shootdown_cpus_remaining;
 static MUTEX_DEFINE(shootdown_mtx);
 
+static atomic(unsigned long) shootdown_count, shootdown_ipis;
+
 static void shootdown_ipi(struct isr* isr) {
 	(void)isr;
 	invalidate_local(atomic_load(&shootdown_address), atomic_load(&shootdown_page_count));
 	atomic_sub_fetch(&shootdown_cpus_remaining, 1);
 }
 
-static void invalidate_others(uintptr_t address, size_t page_count) {
-	if (!atomic_load(&shootdown_isr))
-		return;
-
-	mutex_acquire(&shootdown_mtx);
-	preempt_disable();
-
+/* Has to be called with shootdown_mtx held, so no other CPU can be waiting on this one with interrupts disabled */
+static void __invalidate_others(uintptr_t address, size_t page_count) {
 	struct smp_cpus cpus;
 	smp_cpus_read_acquire(&cpus);
 
 	if (cpus.count > 1) {
+		atomic_add_fetch(&shootdown_count, 1);
+		atomic_add_fetch(&shootdown_ipis, cpus.count - 1);
 		atomic_store(&shootdown_address, address);
 		atomic_store(&shootdown_page_count, page_count);
 		atomic_store(&shootdown_cpus_remaining, cpus.count - 1);
@@ -55,7 +55,15 @@ static void invalidate_others(uintptr_t address, size_t page_count) {
 	}
 
 	smp_cpus_read_release(&cpus);
+}
 
+static void invalidate_others(uintptr_t address, size_t page_count) {
+	if (!atomic_load(&shootdown_isr))
+		return;
+
+	mutex_acquire(&shootdown_mtx);
+	preempt_disable();
+	__invalidate_others(address, page_count);
 	preempt_enable();
 	mutex_release(&shootdown_mtx);
 }
@@ -65,6 +73,41 @@ static inline void tlb_invalidate(uintptr_t address, size_t page_count) {
 	invalidate_others(address, page_count);
 }
 
+void tlb_flush_all(void) {
+	tlb_invalidate(0, SIZE_MAX);
+}
+
+unsigned long tlb_shootdown_begin(void) {
+	mutex_acquire(&shootdown_mtx);
+	return local_irq_save();
+}
+
+void tlb_shootdown_page(uintptr_t virtual) {
+	invalidate_local(virtual, 1);
+	if (atomic_load(&shootdown_isr))
+		__invalidate_others(virtual, 1);
+}
+
+void tlb_shootdown_end(unsigned long irq_flags) {
+	local_irq_restore(irq_flags);
+	mutex_release(&shootdown_mtx);
+}
+
+unsigned int tlb_shootdown_ipi_cost(void) {
+	if (!atomic_load(&shootdown_isr))
+		return 0;
+
+	struct smp_cpus cpus;
+	smp_cpus_read_acquire(&cpus);
+	const u32 count = cpus.count;
+	smp_cpus_read_release(&cpus);
+	return count > 1 ? count - 1 : 0;
+}
+
+void tlb_dump_stats(void) {
+	printk(PRINTK_INFO "mm: TLB shootdowns %lu, IPIs sent %lu\n", atomic_load(&shootdown_count), atomic_load(&shootdown_ipis));
+}
+
 static inline void __tlb_batch_init(struct tlb_batch* batch) {
 	batch->first_page_virtual = UINTPTR_MAX;
 	batch->last_page_virtual = 0;
@@ -29,16 +29,122 @@ void vma_destroy(struct list_head* list) {
 	}
 }
 
+/*
+ * The VMA's of an mm are on a list and in a tree, both sorted by address. The list is used to walk through
+ * neighbouring VMA's, and the tree to find where to start. Every VMA remembers the gap before it, and the
+ * largest gap of its subtree, so a hole big enough for a mapping can be found without looking at every VMA.
+ */
+
+static inline struct vma* vma_of(struct avl_node* node) {
+	return node ? avl_entry(node, struct vma, node) : NULL;
+}
+
+void vma_augment(struct avl_node* node) {
+	struct vma* vma = vma_of(node);
+	size_t max_gap = vma->gap;
+	if (node->left && vma_of(node->left)->max_gap > max_gap)
+		max_gap = vma_of(node->left)->max_gap;
+	if (node->right && vma_of(node->right)->max_gap > max_gap)
+		max_gap = vma_of(node->right)->max_gap;
+	vma->max_gap = max_gap;
+}
+
+static inline struct vma* vma_prev(struct mm* mm, struct vma* vma) {
+	return vma->link.prev == &mm->vma_list.node ? NULL : list_entry(vma->link.prev, struct vma, link);
+}
+
+static inline struct vma* vma_next(struct mm* mm, struct vma* vma) {
+	return list_is_last(&mm->vma_list, &vma->link) ? NULL : list_next_entry(vma, link);
+}
+
+/* Has to be called when the start of a VMA or the top of the one before it changes */
+static void vma_update_gap(struct mm* mm, struct vma* vma) {
+	if (!vma)
+		return;
+	struct vma* prev = vma_prev(mm, vma);
+	vma->gap = vma->start - (prev ? prev->top : 0);
+	avl_propagate(&mm->vma_tree, &vma->node);
+}
+
+/* Add a VMA right after another one, or first if prev is NULL */
+static void vma_link(struct mm* mm, struct vma* prev, struct vma* vma) {
+	struct avl_node* parent = NULL;
+	struct avl_node** link = &mm->vma_tree.root;
+	if (prev) {
+		list_add_after(&prev->link, &vma->link);
+		parent = &prev->node;
+		link = &prev->node.right;
+	} else {
+		list_add(&mm->vma_list, &vma->link);
+	}
+
+	/* Right after prev is the leftmost node of its right subtree */
+	while (*link) {
+		parent = *link;
+		link = &parent->left;
+	}
+
+	vma->gap = vma->start - (prev ? prev->top : 0);
+	avl_insert(&mm->vma_tree, &vma->node, parent, link);
+	vma_update_gap(mm, vma_next(mm, vma));
+}
+
+static void vma_unlink(struct mm* mm, struct vma* vma) {
+	struct vma* next = vma_next(mm, vma);
+	list_remove(&vma->link);
+	avl_erase(&mm->vma_tree, &vma->node);
+	vma_update_gap(mm, next);
+}
+
 struct vma* vma_find(struct mm* mm, uintptr_t address) {
-	struct list_node* pos;
-	list_for_each(pos, &mm->vma_list) {
-		struct vma* vma = list_entry(pos, struct vma, link);
-		if (address >= vma->start && address < vma->top)
+	struct avl_node* node = mm->vma_tree.root;
+	while (node) {
+		struct vma* vma = vma_of(node);
+		if (address < vma->start)
+			node = node->left;
+		else if (address >= vma->top)
+			node = node->right;
+		else
 			return vma;
 	}
 	return NULL;
 }
 
+/* Find the first VMA that ends above an address */
+static struct vma* vma_find_above(struct mm* mm, uintptr_t address) {
+	struct vma* ret = NULL;
+	struct avl_node* node = mm->vma_tree.root;
+	while (node) {
+		struct vma* vma = vma_of(node);
+		if (vma->top > address) {
+			ret = vma;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return ret;
+}
+
+/* Find the first VMA ending above base with a hole of at least size before it, not counting anything below base */
+static struct vma* vma_find_gap(struct avl_node* node, uintptr_t base, size_t size) {
+	if (!node || vma_of(node)->max_gap < size)
+		return NULL;
+
+	struct vma* vma = vma_of(node);
+	if (vma->top > base) {
+		struct vma* ret = vma_find_gap(node->left, base, size);
+		if (ret)
+			return ret;
+
+		const uintptr_t hole = vma->start - vma->gap > base ? vma->start - vma->gap : base;
+		if (vma->start >= hole && vma->start - hole >= size)
+			return vma;
+	}
+
+	return vma_find_gap(node->right, base, size);
+}
+
 static int range_grow(struct vmm_range* range, size_t size) {
 	size_t range_size = range->end - range->start;
 	if (range_size >= range->max_size)
@@ -94,10 +200,8 @@ int vma_map(struct mm* mm, uintptr_t hint, size_t size, pgprot_t prot, int vmm_f
 	vma->vmm_flags = vmm_flags;
 
 	if ((vmm_flags & (VMM_FIXED | VMM_NOREPLACE)) == VMM_FIXED) {
-		struct vma* iter;
-		list_for_each_entry(iter, &mm->vma_list, link) {
-			if (iter->top <= base)
-				continue;
+		struct vma* iter = vma_find_above(mm, base);
+		for (; iter; iter = vma_next(mm, iter)) {
 			if (iter->start >= top)
 				break;
 			if (iter->vmm_flags & VMM_SEALED) {
@@ -113,24 +217,20 @@ int vma_map(struct mm* mm, uintptr_t hint, size_t size, pgprot_t prot, int vmm_f
 		}
 	}
 
-	/* Skip VMA's that end at or before the hint */
-	struct vma* prev = NULL;
-	struct vma* iter;
-	list_for_each_entry(iter, &mm->vma_list, link) {
-		if (iter->top > base)
-			break;
-		prev = iter;
-	}
-
-	/* Find a memory hole large enough for the size */
+	/* Find a memory hole large enough for the size, the tree doesn't know about alignment so the hole is checked again */
 	uintptr_t addr = base;
-	list_for_each_entry_cont(iter, &mm->vma_list, link) {
+	struct vma* prev;
+	struct vma* next = vma_find_gap(mm->vma_tree.root, base, size);
+	for (; next; next = vma_find_gap(mm->vma_tree.root, next->top, size)) {
+		prev = vma_prev(mm, next);
+		addr = prev && prev->top > base ? prev->top : base;
 		uintptr_t aligned = ROUND_UP(addr, align);
-		if (aligned >= addr && iter->start >= aligned && iter->start - aligned >= size)
+		if (aligned >= addr && next->start >= aligned && next->start - aligned >= size)
 			break;
-
-		addr = iter->top;
-		prev = iter;
+	}
+	if (!next) {
+		prev = list_empty(&mm->vma_list) ? NULL : list_entry(mm->vma_list.node.prev, struct vma, link);
+		addr = prev && prev->top > base ? prev->top : base;
 	}
 
 	if ((vmm_flags & VMM_FIXED) && (addr != hint)) {
@@ -156,11 +256,7 @@ int vma_map(struct mm* mm, uintptr_t hint, size_t size, pgprot_t prot, int vmm_f
 		return -ERANGE;
 	}
 
-	if (likely(prev))
-		list_add_after(&prev->link, &vma->link);
-	else
-		list_add(&mm->vma_list, &vma->link);
-
+	vma_link(mm, prev, vma);
 	*ret = vma->start;
 	return 0;
 }
@@ -177,13 +273,11 @@ int vma_protect(struct mm* mm, uintptr_t address, size_t size, pgprot_t prot) {
 	end = ROUND_UP(end, PAGE_SIZE);
 
 	/* Find the first and last VMA's overlapping the range */
-	struct vma* pos;
+	struct vma* pos = vma_find_above(mm, address);
 	struct vma* v = NULL;
 	struct vma* u = NULL;
 	uintptr_t expected = address;
-	list_for_each_entry(pos, &mm->vma_list, link) {
-		if (pos->top <= address)
-			continue;
+	for (; pos; pos = vma_next(mm, pos)) {
 		if (pos->start >= end)
 			break;
 		if (pos->start > expected)
@@ -222,9 +316,10 @@ int vma_protect(struct mm* mm, uintptr_t address, size_t size, pgprot_t prot) {
 		start_split->prot = v->prot;
 		start_split->vmm_flags = v->vmm_flags;
 		v->top = address;
-		list_add_after(&v->link, &start_split->link);
+		vma_link(mm, v, start_split);
 		if (u == v)
 			u = start_split;
+		v = start_split;
 	}
 	if (need_end_split) {
 		end_split->start = end;
@@ -232,23 +327,20 @@ int vma_protect(struct mm* mm, uintptr_t address, size_t size, pgprot_t prot) {
 		end_split->prot = u->prot;
 		end_split->vmm_flags = u->vmm_flags;
 		u->top = end;
-		list_add_after(&u->link, &end_split->link);
+		vma_link(mm, u, end_split);
 	}
 
 	/* Apply protection flags */
-	struct vma* adj;
-	list_for_each_entry(adj, &mm->vma_list, link) {
-		if (adj->start >= address && adj->start < end)
-			adj->prot = prot;
-	}
+	for (struct vma* adj = v; adj && adj->start < end; adj = vma_next(mm, adj))
+		adj->prot = prot;
 
-	/* Merge adjecent VMA's with the same protection flags */
-	struct vma* current = list_first_entry(&mm->vma_list, struct vma, link);
-	while (!list_is_last(&mm->vma_list, &current->link)) {
-		struct vma* next = list_next_entry(current, link);
+	/* Merge adjecent VMA's with the same protection flags, everything outside of the range is already merged */
+	struct vma* current = vma_prev(mm, v) ? vma_prev(mm, v) : v;
+	struct vma* next;
+	while (current->start < end && (next = vma_next(mm, current))) {
 		if (current->top == next->start && current->prot == next->prot && current->vmm_flags == next->vmm_flags) {
 			current->top = next->top;
-			list_remove(&next->link);
+			vma_unlink(mm, next);
 			vma_free(next);
 			continue;
 		}
@@ -270,10 +362,9 @@ int vma_unmap(struct mm* mm, uintptr_t address, size_t size) {
 
 	bool overlap_found = false;
 	bool need_split = false;
-	struct vma* iter;
-	list_for_each_entry(iter, &mm->vma_list, link) {
-		if (iter->top <= address)
-			continue;
+	struct vma* const first = vma_find_above(mm, address);
+	struct vma* iter = first;
+	for (; iter; iter = vma_next(mm, iter)) {
 		if (iter->start >= end)
 			break;
 		if (iter->vmm_flags & VMM_SEALED)
@@ -294,25 +385,25 @@ int vma_unmap(struct mm* mm, uintptr_t address, size_t size) {
 	}
 
 	struct vma* tmp;
-	list_for_each_entry_safe(iter, tmp, &mm->vma_list, link) {
-		if (iter->top <= address || iter->start >= end)
-			continue;
-
+	for (iter = first; iter && iter->start < end; iter = tmp) {
+		tmp = vma_next(mm, iter);
 		if (address <= iter->start && end >= iter->top) {
-			list_remove(&iter->link);
+			vma_unlink(mm, iter);
 			vma_free(iter);
 		} else if (address <= iter->start) {
 			iter->start = end;
+			vma_update_gap(mm, iter);
 			break;
 		} else if (end >= iter->top) {
 			iter->top = address;
+			vma_update_gap(mm, tmp);
 		} else {
 			split_vma->start = end;
 			split_vma->top = iter->top;
 			split_vma->prot = iter->prot;
 			split_vma->vmm_flags = iter->vmm_flags;
 			iter->top = address;
-			list_add_after(&iter->link, &split_vma->link);
+			vma_link(mm, iter, split_vma);
 			break;
 		}
 	}
@@ -5,6 +5,7 @@
 #include <lunar/sched.h>
 #include <lunar/trace.h>
 #include <lunar/irq.h>
+#include <lunar/timekeeper.h>
 #include "internal.h"
 
 /* Look up a page by address and add a reference to it if it exists */
@@ -12,7 +13,7 @@ static int hold_page_address(physaddr_t physical, struct page** page, int flags)
 	struct page* tmp;
 	int err = get_page_from_address(physical, &tmp); /* Gives page with a ref added */
 	if (err == 0) {
-		if (flags & VMM_IOMEM && !(tmp->flags & PAGE_FLAG_RESERVED)) {
+		if (flags & VMM_IOMEM && !(page_flags(tmp) & PAGE_FLAG_RESERVED)) {
 			release_page(tmp);
 			err = -EACCES;
 		} else {
@@ -32,6 +33,39 @@ static struct page* get_page_release_lookup_ref(physaddr_t physical) {
 	return page;
 }
 
+/*
+ * Movable pages remember the one place they're mapped, so compaction can copy them to another physical
+ * page and fix up the mapping. Only vmalloc() and vm_map_user() pages are made movable, since other
+ * kernel pages may also be accessed through HHDM.
+ */
+static SPINLOCK_DEFINE(rmap_lock);
+
+static void rmap_set(struct mm* mm, struct page** pages, size_t page_count, uintptr_t virtual) {
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&rmap_lock, &irq_flags);
+	for (size_t i = 0; i < page_count; i++) {
+		struct page* page = pages[i];
+		if (page && !(page_flags(page) & (PAGE_FLAG_HUGETLB | PAGE_FLAG_SLAB)) && !page->mapping.mm) {
+			page->mapping.mm = mm;
+			page->mapping.virtual = virtual + i * PAGE_SIZE;
+		}
+	}
+	spinlock_release_irq_restore(&rmap_lock, &irq_flags);
+}
+
+/* Forget where a page is mapped, a NULL pagetable forgets it no matter where the mapping was */
+static void rmap_clear(struct page* page, const pte_t* pagetable, uintptr_t virtual) {
+	if (page_flags(page) & (PAGE_FLAG_HUGETLB | PAGE_FLAG_SLAB))
+		return;
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&rmap_lock, &irq_flags);
+	struct mm* mm = page->mapping.mm;
+	if (mm && (!pagetable || (mm->pagetable == pagetable && page->mapping.virtual == virtual)))
+		page->mapping.mm = NULL;
+	spinlock_release_irq_restore(&rmap_lock, &irq_flags);
+}
+
 /* Unmap a page, with an optional page argument to release the page without a lookup */
 static void unmap_page(struct tlb_batch* batch, struct page* page, uintptr_t virtual) {
 	physaddr_t physical = arch_pagetable_get_physical(batch->pagetable, virtual);
@@ -41,13 +75,23 @@ static void unmap_page(struct tlb_batch* batch, struct page* page, uintptr_t vir
 	bug(arch_pagetable_unmap(batch->pagetable, virtual) != 0);
 	if (!page)
 		page = get_page_release_lookup_ref(physical);
+	if (page)
+		rmap_clear(page, batch->pagetable, virtual);
 
 	tlb_batch_add(batch, virtual, page);
 }
 
+/* Get the number of pages a mapping covers, huge pages can only start on an aligned address */
+static inline size_t mapping_page_count(pte_t* pagetable, uintptr_t virtual) {
+	uintptr_t next;
+	if (virtual % PMD_SIZE || arch_pagetable_iterate_range(pagetable, virtual, &next) <= PAGE_SIZE)
+		return 1;
+	return (next - virtual) >> PAGE_SHIFT;
+}
+
 /* Unmap several pages, does NOT optimize lookup */
 static inline void unmap_pages(struct tlb_batch* batch, uintptr_t virtual, size_t count) {
-	for (size_t i = 0; i < count; i++)
+	for (size_t i = 0; i < count; i += mapping_page_count(batch->pagetable, virtual + i * PAGE_SIZE))
 		unmap_page(batch, NULL, virtual + i * PAGE_SIZE);
 }
 
@@ -93,7 +137,16 @@ static int map_page(struct tlb_batch* batch, uintptr_t virtual, const struct map
 		}
 	}
 
-	const int err = arch_pagetable_map(batch->pagetable, virtual, physical, false, prot);
+	const bool hugetlb = flags & VMM_HUGETLB;
+	int err = arch_pagetable_map(batch->pagetable, virtual, physical, hugetlb, prot);
+	if (err == -EEXIST && hugetlb) {
+		/* Small pages can leave an empty table behind, which is freed once the TLB's are flushed */
+		physaddr_t table;
+		if (arch_pagetable_prune(batch->pagetable, virtual, &table) == 0) {
+			tlb_batch_add(batch, virtual, get_page_release_lookup_ref(table));
+			err = arch_pagetable_map(batch->pagetable, virtual, physical, hugetlb, prot);
+		}
+	}
 	if (err) {
 		if (page)
 			release_page(page);
@@ -105,21 +158,37 @@ static int map_page(struct tlb_batch* batch, uintptr_t virtual, const struct map
 	return 0;
 }
 
+/* A huge page has to be made of physically contiguous pages, and can't have guard pages */
+static bool pages_are_contiguous(struct page** pages, size_t count) {
+	if (!pages[0])
+		return false;
+	for (size_t i = 1; i < count; i++) {
+		if (pages[i] != pages[0] + i)
+			return false;
+	}
+	return true;
+}
+
 static int map_pages(struct tlb_batch* batch, uintptr_t virtual, const struct map_pages_arg* arg, pgprot_t prot, int flags) {
-	for (size_t mapped_pages = 0; mapped_pages < arg->page_count; mapped_pages++) {
+	const size_t step = flags & VMM_HUGETLB ? PMD_SIZE >> PAGE_SHIFT : 1;
+	for (size_t mapped_pages = 0; mapped_pages < arg->page_count; mapped_pages += step) {
 		struct map_page_arg map_page_arg;
 		map_page_arg.use_page = arg->use_pages;
+		int err = 0;
 		if (arg->use_pages) {
 			map_page_arg.un.page = arg->un.pages[mapped_pages];
-			if (!map_page_arg.un.page)
+			if (step > 1 && !pages_are_contiguous(&arg->un.pages[mapped_pages], step))
+				err = -EINVAL;
+			else if (!map_page_arg.un.page)
 				continue; /* Guard page */
 		} else {
 			map_page_arg.un.physaddr = arg->un.physaddr + mapped_pages * PAGE_SIZE;
 		}
 
-		const int err = map_page(batch, virtual + mapped_pages * PAGE_SIZE, &map_page_arg, prot, flags);
+		if (err == 0)
+			err = map_page(batch, virtual + mapped_pages * PAGE_SIZE, &map_page_arg, prot, flags);
 		if (err) {
-			for (size_t i = 0; i < mapped_pages; i++) {
+			for (size_t i = 0; i < mapped_pages; i += step) {
 				const uintptr_t page_virtual = virtual + i * PAGE_SIZE;
 				if (arg->use_pages)
 					unmap_page(batch, arg->un.pages[i], page_virtual);
@@ -135,18 +204,22 @@ static int map_pages(struct tlb_batch* batch, uintptr_t virtual, const struct ma
 
 void vm_pagetable_teardown_leaf(physaddr_t address) {
 	struct page* page = get_page_release_lookup_ref(address);
-	if (page)
+	if (page) {
+		rmap_clear(page, NULL, 0);
 		release_page(page);
+	}
 }
 
 static void protect_pages(struct tlb_batch* batch, uintptr_t virtual, size_t count, pgprot_t prot) {
-	for (size_t i = 0; i < count; i++) {
+	size_t step;
+	for (size_t i = 0; i < count; i += step) {
 		const uintptr_t page_virtual = virtual + i * PAGE_SIZE;
+		step = mapping_page_count(batch->pagetable, page_virtual);
 		const physaddr_t physical = arch_pagetable_get_physical(batch->pagetable, page_virtual);
 		if (!physical)
 			continue;
 
-		bug(arch_pagetable_update(batch->pagetable, page_virtual, physical, false, prot) != 0);
+		bug(arch_pagetable_update(batch->pagetable, page_virtual, physical, step > 1, prot) != 0);
 		tlb_batch_add(batch, page_virtual, NULL);
 	}
 }
@@ -166,6 +239,7 @@ static void vma_unmap_force(struct mm* mm, uintptr_t virtual, size_t size) {
 static struct mm kernel_mm_struct = {
 	.pagetable = NULL,
 	.vma_list = LIST_HEAD_INITIALIZER(kernel_mm_struct.vma_list),
+	.vma_tree = AVL_TREE_INITIALIZER(vma_augment),
 	.segment = { .start = KERNEL_SPACE_START, .end = KERNEL_SPACE_END, .grows_down = false, .max_size = KERNEL_SPACE_END - KERNEL_SPACE_START },
 	.brk = { .start = KERNEL_SPACE_START, .end = KERNEL_SPACE_END, .grows_down = false, .max_size = KERNEL_SPACE_END - KERNEL_SPACE_START },
 	.mmap = { .start = KERNEL_SPACE_START, .end = KERNEL_SPACE_END, .grows_down = false, .max_size = KERNEL_SPACE_END - KERNEL_SPACE_START },
@@ -190,6 +264,7 @@ struct mm* mm_create(void) {
 		return NULL;
 
 	list_head_init(&mm->vma_list);
+	avl_tree_init(&mm->vma_tree, vma_augment);
 	const struct vmm_range zero_range = { .start = 0, .end = 0, .grows_down = false, .max_size = 0 };
 	mm->segment = zero_range;
 	mm->brk = zero_range;
@@ -201,8 +276,11 @@ struct mm* mm_create(void) {
 }
 
 void mm_destroy(struct mm* mm) {
+	/* Page migration holds the mutex while using the mm */
+	mutex_acquire(&mm->mutex);
 	arch_pagetable_free(mm->pagetable);
 	vma_destroy(&mm->vma_list);
+	mutex_release(&mm->mutex);
 	kfree(mm);
 }
 
@@ -219,9 +297,11 @@ static int check_vm_map_args(uintptr_t hint, size_t page_count, int flags) {
 	if (page_count == 0 || flags & VMM_SEALED || (flags & VMM_FIXED && hint % PAGE_SIZE != 0))
 		return -EINVAL;
 	if (flags & VMM_HUGETLB) {
+		/* Only 2 MiB mappings exist, 1 GiB pages are mapped with several of them */
 		if (flags & VMM_HUGETLB_1GB)
 			return -ENOTSUP;
-		return -ENOSYS;
+		if (page_count % (PMD_SIZE >> PAGE_SHIFT))
+			return -EINVAL;
 	} else if (flags & (VMM_HUGETLB_2MB | VMM_HUGETLB_1GB)) {
 		return -EINVAL;
 	}
@@ -317,6 +397,14 @@ static int __vm_map_physical(uintptr_t hint, physaddr_t physical, size_t page_co
 	return err;
 }
 
+/* Huge pages can't be split, so a range has to cover them completely */
+static bool range_splits_hugepage(struct mm* mm, uintptr_t virtual, size_t size) {
+	const struct vma* first = vma_find(mm, virtual);
+	const struct vma* last = vma_find(mm, virtual + size - 1);
+	return (first && first->vmm_flags & VMM_HUGETLB && virtual % PMD_SIZE) ||
+		(last && last->vmm_flags & VMM_HUGETLB && (virtual + size) % PMD_SIZE);
+}
+
 static int __vm_protect(struct mm* mm, uintptr_t virtual, size_t page_count, pgprot_t prot, int flags) {
 	(void)flags;
 	if (page_count == 0)
@@ -326,7 +414,9 @@ static int __vm_protect(struct mm* mm, uintptr_t virtual, size_t page_count, pgp
 
 	mutex_acquire(&mm->mutex);
 
-	int err = vma_protect(mm, virtual, page_count * PAGE_SIZE, prot);
+	int err = -EINVAL;
+	if (!range_splits_hugepage(mm, virtual, page_count * PAGE_SIZE))
+		err = vma_protect(mm, virtual, page_count * PAGE_SIZE, prot);
 	if (err == 0) {
 		struct tlb_batch tlb_batch;
 		tlb_batch_init(&tlb_batch, mm->pagetable);
@@ -347,7 +437,9 @@ static int __vm_unmap(struct mm* mm, uintptr_t virtual, size_t page_count, int f
 
 	mutex_acquire(&mm->mutex);
 
-	int err = vma_unmap(mm, virtual, page_count * PAGE_SIZE);
+	int err = -EINVAL;
+	if (!range_splits_hugepage(mm, virtual, page_count * PAGE_SIZE))
+		err = vma_unmap(mm, virtual, page_count * PAGE_SIZE);
 	if (err == 0) {
 		struct tlb_batch tlb_batch;
 		tlb_batch_init(&tlb_batch, mm->pagetable);
@@ -388,7 +480,11 @@ void __user* vm_map_user(void __user* hint, struct page** pages, size_t page_cou
 
 	uintptr_t ret;
 	int err = __vm_map(mm, (uintptr_t)hint, pages, page_count, prot, flags, &ret);
-	return (err == 0) ? (void __user*)ret : ERR_PTR_AS(void __user*, err);
+	if (err)
+		return ERR_PTR_AS(void __user*, err);
+
+	rmap_set(mm, pages, page_count, ret);
+	return (void __user*)ret;
 }
 
 int vm_protect_user(void __user* virtual, size_t page_count, pgprot_t prot, int flags) {
@@ -436,21 +532,41 @@ void vm_unmap_force(void* virtual, size_t page_count, int flags) {
 		panic("%s() failed: %d\n", __func__, err);
 }
 
+#define VMALLOC_GUARD_PAGES 1
+
 struct vmalloc_node {
 	void* address;
 	size_t page_count, guard_page_count;
-	struct list_node link;
+	struct avl_node tree_node;
+	struct page** lazy_pages; /* Pages still held after a lazy vfree() */
+	struct list_node lazy_link;
 };
 
-static LIST_HEAD_DEFINE(vmalloc_list);
-static MUTEX_DEFINE(vmalloc_list_mtx);
+/* Regions by address, so vfree() doesn't have to look at all of them */
+static struct avl_tree vmalloc_tree = AVL_TREE_INITIALIZER(NULL);
+static MUTEX_DEFINE(vmalloc_tree_mtx);
+
+static void vmalloc_tree_insert(struct vmalloc_node* node) {
+	mutex_acquire(&vmalloc_tree_mtx);
+	struct avl_node* parent = NULL;
+	struct avl_node** link = &vmalloc_tree.root;
+	while (*link) {
+		parent = *link;
+		if ((uintptr_t)node->address < (uintptr_t)avl_entry(parent, struct vmalloc_node, tree_node)->address)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+	avl_insert(&vmalloc_tree, &node->tree_node, parent, link);
+	mutex_release(&vmalloc_tree_mtx);
+}
 
 void* vmalloc(size_t size) {
 	if (size >= SIZE_MAX - PAGE_SIZE)
 		return NULL;
 	size = ROUND_UP(size, PAGE_SIZE);
 
-	const size_t guard_page_count = 1;
+	const size_t guard_page_count = VMALLOC_GUARD_PAGES;
 	const size_t page_count = size >> PAGE_SHIFT;
 	if (page_count == 0)
 		return NULL;
@@ -463,11 +579,8 @@ void* vmalloc(size_t size) {
 	struct vmalloc_node* node = kmalloc(sizeof(*node), MM_ZONE_NORMAL);
 	if (!node)
 		goto out;
-	for (size_t i = 0; i < page_count; i++) {
-		pages[i] = alloc_page(MM_ZONE_NORMAL);
-		if (!pages[i])
-			goto out;
-	}
+	if (alloc_pages_bulk(MM_ZONE_NORMAL | MM_MOVABLE, page_count, pages) != page_count)
+		goto out;
 
 	/* When vm_map() encounters null on the last page, it will just reserve the VA with no permissions */
 	ret = vm_map(NULL, pages, page_count + guard_page_count, PGPROT_READ | PGPROT_WRITE, 0);
@@ -476,14 +589,12 @@ void* vmalloc(size_t size) {
 		goto out;
 	}
 
+	rmap_set(&kernel_mm_struct, pages, page_count, (uintptr_t)ret);
+
 	node->address = ret;
 	node->page_count = page_count;
 	node->guard_page_count = guard_page_count;
-	list_node_init(&node->link);
-
-	mutex_acquire(&vmalloc_list_mtx);
-	list_add_tail(&vmalloc_list, &node->link);
-	mutex_release(&vmalloc_list_mtx);
+	vmalloc_tree_insert(node);
 
 	node = NULL; /* Prevent kfree() from freeing the node on success */
 out:
@@ -498,23 +609,110 @@ out:
 }
 
 static inline struct vmalloc_node* get_node_and_unlink(void* ptr) {
-	struct vmalloc_node* node = NULL;
-	mutex_acquire(&vmalloc_list_mtx);
-
-	struct list_node* tmp;
-	list_for_each(tmp, &vmalloc_list) {
-		struct vmalloc_node* n = list_entry(tmp, struct vmalloc_node, link);
-		if (n->address == ptr) {
-			node = n;
-			break;
+	mutex_acquire(&vmalloc_tree_mtx);
+	struct avl_node* tree_node = vmalloc_tree.root;
+	while (tree_node) {
+		struct vmalloc_node* node = avl_entry(tree_node, struct vmalloc_node, tree_node);
+		if (ptr == node->address) {
+			avl_erase(&vmalloc_tree, tree_node);
+			mutex_release(&vmalloc_tree_mtx);
+			return node;
 		}
+		tree_node = (uintptr_t)ptr < (uintptr_t)node->address ? tree_node->left : tree_node->right;
+	}
+
+	mutex_release(&vmalloc_tree_mtx);
+	return NULL;
+}
+
+/* Give back the end of a vmalloc() region, the start of the part given back becomes the new guard pages */
+static void vmalloc_shrink(struct vmalloc_node* node, size_t page_count) {
+	u8* const address = node->address;
+	struct page* guard[VMALLOC_GUARD_PAGES] = { NULL };
+
+	/* Replacing the pages keeps the addresses reserved, if it fails the region just stays bigger */
+	void* ret = vm_map(address + (page_count << PAGE_SHIFT), guard, node->guard_page_count,
+			PGPROT_READ | PGPROT_WRITE, VMM_FIXED);
+	if (IS_PTR_ERR(ret))
+		return;
+
+	vm_unmap_force(address + ((page_count + node->guard_page_count) << PAGE_SHIFT), node->page_count - page_count, 0);
+	node->page_count = page_count;
+}
+
+/* Map new pages right after a vmalloc() region, over its guard pages, fails if something else is mapped there */
+static int vmalloc_extend(struct vmalloc_node* node, size_t page_count) {
+	const size_t extra = page_count - node->page_count;
+	struct page** const pages = kzalloc((extra + node->guard_page_count) * sizeof(*pages), MM_ZONE_NORMAL);
+	if (!pages)
+		return -ENOMEM;
+
+	int err = -ENOMEM;
+	if (alloc_pages_bulk(MM_ZONE_NORMAL | MM_MOVABLE, extra, pages) != extra)
+		goto out;
+
+	/* The space after the guard pages is reserved first, the guard pages are already ours */
+	u8* const guard = (u8*)node->address + (node->page_count << PAGE_SHIFT);
+	void* ret = vm_map(guard + (node->guard_page_count << PAGE_SHIFT), pages + node->guard_page_count,
+			extra, PGPROT_READ | PGPROT_WRITE, VMM_FIXED | VMM_NOREPLACE);
+	if (IS_PTR_ERR(ret)) {
+		err = PTR_ERR(ret);
+		goto out;
+	}
+	ret = vm_map(guard, pages, node->guard_page_count, PGPROT_READ | PGPROT_WRITE, VMM_FIXED);
+	if (IS_PTR_ERR(ret)) {
+		err = PTR_ERR(ret);
+		vm_unmap_force(guard + (node->guard_page_count << PAGE_SHIFT), extra, 0);
+		goto out;
 	}
 
-	if (node)
-		list_remove(&node->link);
+	rmap_set(&kernel_mm_struct, pages, extra, (uintptr_t)guard);
+	node->page_count = page_count;
+	err = 0;
+out:
+	for (size_t i = 0; i < extra && pages[i] != NULL; i++)
+		release_page(pages[i]);
+	kfree(pages);
+	return err;
+}
+
+/* Move a vmalloc() region to a bigger range of addresses, the pages it already has are mapped again instead of copied */
+static int vmalloc_remap(struct vmalloc_node* node, size_t page_count) {
+	struct page** const pages = kzalloc((page_count + node->guard_page_count) * sizeof(*pages), MM_ZONE_NORMAL);
+	if (!pages)
+		return -ENOMEM;
+
+	/* Migration needs the mutex, and can't move the pages at all once they're held */
+	struct mm* mm = &kernel_mm_struct;
+	mutex_acquire(&mm->mutex);
+	for (size_t i = 0; i < node->page_count; i++) {
+		const physaddr_t physical = arch_pagetable_get_physical(mm->pagetable, (uintptr_t)node->address + i * PAGE_SIZE);
+		bug(hold_page_address(physical, &pages[i], 0) != 0);
+	}
+	mutex_release(&mm->mutex);
+
+	int err = -ENOMEM;
+	const size_t extra = page_count - node->page_count;
+	if (alloc_pages_bulk(MM_ZONE_NORMAL | MM_MOVABLE, extra, pages + node->page_count) != extra)
+		goto out;
 
-	mutex_release(&vmalloc_list_mtx);
-	return node;
+	void* ret = vm_map(NULL, pages, page_count + node->guard_page_count, PGPROT_READ | PGPROT_WRITE, 0);
+	if (IS_PTR_ERR(ret)) {
+		err = PTR_ERR(ret);
+		goto out;
+	}
+
+	/* The old mapping has to forget the pages before they can remember the new one */
+	vm_unmap_force(node->address, node->page_count + node->guard_page_count, 0);
+	rmap_set(mm, pages, page_count, (uintptr_t)ret);
+	node->address = ret;
+	node->page_count = page_count;
+	err = 0;
+out:
+	for (size_t i = 0; i < page_count && pages[i] != NULL; i++)
+		release_page(pages[i]);
+	kfree(pages);
+	return err;
 }
 
 void* vrealloc(void* ptr, size_t size) {
@@ -530,22 +728,129 @@ void* vrealloc(void* ptr, size_t size) {
 		return NULL;
 	}
 
-	size = ROUND_UP(size, PAGE_SIZE);
-	void* const ret = vmalloc(size);
-	if (!ret) {
-		mutex_acquire(&vmalloc_list_mtx);
-		list_add_tail(&vmalloc_list, &node->link);
-		mutex_release(&vmalloc_list_mtx);
-		return NULL;
+	const size_t page_count = ROUND_UP(size, PAGE_SIZE) >> PAGE_SHIFT;
+	int err = 0;
+	if (page_count < node->page_count)
+		vmalloc_shrink(node, page_count);
+	else if (page_count > node->page_count && vmalloc_extend(node, page_count))
+		err = vmalloc_remap(node, page_count);
+	void* const ret = err ? NULL : node->address;
+
+	vmalloc_tree_insert(node);
+	return ret;
+}
+
+/*
+ * vfree() doesn't flush the TLB's right away. The pages are unmapped and kept, and the addresses stay reserved,
+ * until VMALLOC_LAZY_MAX_PAGES have piled up. Then one full flush on every CPU covers all of them, instead of a
+ * shootdown for every region. Nothing can be mapped where a stale TLB entry still points, and the pages aren't
+ * reused while one can still reach them.
+ */
+#define VMALLOC_LAZY_MAX_PAGES 8192
+
+static LIST_HEAD_DEFINE(vmalloc_lazy_list);
+static SPINLOCK_DEFINE(vmalloc_lazy_lock);
+static size_t vmalloc_lazy_pages;
+static atomic(unsigned long) vmalloc_lazy_frees, vmalloc_purges;
+static atomic(long) vmalloc_ipis_saved;
+
+/* Give everything on the lazy list back after one flush, returns the number of pages released */
+static unsigned long vmalloc_purge(bool wait) {
+	struct mm* mm = &kernel_mm_struct;
+	if (wait)
+		mutex_acquire(&mm->mutex);
+	else if (!mutex_try_acquire(&mm->mutex))
+		return 0;
+
+	struct list_head purge;
+	list_head_init(&purge);
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&vmalloc_lazy_lock, &irq_flags);
+	if (!list_empty(&vmalloc_lazy_list)) {
+		purge.node.next = vmalloc_lazy_list.node.next;
+		purge.node.prev = vmalloc_lazy_list.node.prev;
+		purge.node.next->prev = &purge.node;
+		purge.node.prev->next = &purge.node;
+		list_head_init(&vmalloc_lazy_list);
 	}
+	vmalloc_lazy_pages = 0;
+	spinlock_release_irq_restore(&vmalloc_lazy_lock, &irq_flags);
 
-	const size_t page_count = size >> PAGE_SHIFT;
-	const size_t copy_count = (node->page_count > page_count) ? page_count << PAGE_SHIFT : node->page_count << PAGE_SHIFT;
-	memcpy(ret, ptr, copy_count);
+	if (list_empty(&purge)) {
+		mutex_release(&mm->mutex);
+		return 0;
+	}
 
-	vm_unmap_force(node->address, node->page_count + node->guard_page_count, 0);
-	kfree(node);
-	return ret;
+	tlb_flush_all();
+	atomic_add_fetch(&vmalloc_purges, 1);
+	atomic_sub_fetch(&vmalloc_ipis_saved, tlb_shootdown_ipi_cost());
+
+	struct vmalloc_node* node;
+	list_for_each_entry(node, &purge, lazy_link)
+		vma_unmap_force(mm, (uintptr_t)node->address, (node->page_count + node->guard_page_count) << PAGE_SHIFT);
+	mutex_release(&mm->mutex);
+
+	unsigned long released = 0;
+	struct vmalloc_node* tmp;
+	list_for_each_entry_safe(node, tmp, &purge, lazy_link) {
+		for (size_t i = 0; i < node->page_count; i++) {
+			if (node->lazy_pages[i]) {
+				release_page(node->lazy_pages[i]);
+				released++;
+			}
+		}
+		kfree(node->lazy_pages);
+		kfree(node);
+	}
+	return released;
+}
+
+unsigned long vmalloc_purge_lazy(void) {
+	return vmalloc_purge(false);
+}
+
+/*
+ * Unmap a region without flushing the TLB's, returns false if there's no memory to remember the pages.
+ * Pages that aren't mapped, like the guard page of a stack, are skipped.
+ */
+static bool vmalloc_unmap_lazy(struct vmalloc_node* node) {
+	node->lazy_pages = kmalloc(node->page_count * sizeof(*node->lazy_pages), MM_ZONE_NORMAL);
+	if (!node->lazy_pages)
+		return false;
+
+	/* Holding the mutex keeps the pages from being migrated while they're unmapped */
+	struct mm* mm = &kernel_mm_struct;
+	mutex_acquire(&mm->mutex);
+	for (size_t i = 0; i < node->page_count; i++) {
+		const uintptr_t virtual = (uintptr_t)node->address + i * PAGE_SIZE;
+		const physaddr_t physical = arch_pagetable_get_physical(mm->pagetable, virtual);
+		if (physical == 0) {
+			node->lazy_pages[i] = NULL;
+			continue;
+		}
+		struct page* page = get_page_release_lookup_ref(physical);
+		bug(page == NULL);
+		bug(arch_pagetable_unmap(mm->pagetable, virtual) != 0);
+		rmap_clear(page, mm->pagetable, virtual);
+		node->lazy_pages[i] = page; /* Takes over the reference of the mapping */
+	}
+	mutex_release(&mm->mutex);
+
+	/* What unmapping right away would have cost, tlb_batch_flush() runs for every full batch */
+	const size_t shootdowns = (node->page_count + TLB_BATCH_PAGE_COUNT - 1) / TLB_BATCH_PAGE_COUNT;
+	atomic_add_fetch(&vmalloc_lazy_frees, 1);
+	atomic_add_fetch(&vmalloc_ipis_saved, shootdowns * tlb_shootdown_ipi_cost());
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&vmalloc_lazy_lock, &irq_flags);
+	list_add_tail(&vmalloc_lazy_list, &node->lazy_link);
+	vmalloc_lazy_pages += node->page_count + node->guard_page_count;
+	const bool purge = vmalloc_lazy_pages >= VMALLOC_LAZY_MAX_PAGES;
+	spinlock_release_irq_restore(&vmalloc_lazy_lock, &irq_flags);
+
+	if (purge)
+		vmalloc_purge(true);
+	return true;
 }
 
 void vfree(void* ptr) {
@@ -559,10 +864,145 @@ void vfree(void* ptr) {
 		return;
 	}
 
+	if (vmalloc_unmap_lazy(node))
+		return;
 	vm_unmap_force(node->address, node->page_count + node->guard_page_count, 0);
 	kfree(node);
 }
 
+void vm_unmap_lazy(void* virtual, size_t page_count) {
+	struct vmalloc_node* node = kmalloc(sizeof(*node), MM_ZONE_NORMAL);
+	if (node) {
+		node->address = virtual;
+		node->page_count = page_count;
+		node->guard_page_count = 0;
+		if (vmalloc_unmap_lazy(node))
+			return;
+	}
+
+	vm_unmap_force(virtual, page_count, 0);
+	kfree(node);
+}
+
+static unsigned long vmalloc_lazy_shrink_count(struct shrinker* shrinker) {
+	(void)shrinker;
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&vmalloc_lazy_lock, &irq_flags);
+	const size_t pages = vmalloc_lazy_pages;
+	spinlock_release_irq_restore(&vmalloc_lazy_lock, &irq_flags);
+	return pages;
+}
+
+/* Reclaim can run with the kernel mm locked further up the stack, so this only tries */
+static unsigned long vmalloc_lazy_shrink_scan(struct shrinker* shrinker, unsigned long target) {
+	(void)shrinker;
+	(void)target;
+	return vmalloc_purge(false);
+}
+
+static struct shrinker vmalloc_lazy_shrinker = {
+	.name = "vmalloc_lazy",
+	.count = vmalloc_lazy_shrink_count,
+	.scan = vmalloc_lazy_shrink_scan
+};
+
+long vmalloc_lazy_ipis_saved(void) {
+	return atomic_load(&vmalloc_ipis_saved);
+}
+
+void vmalloc_dump_stats(void) {
+	const time_t seconds = time_fromboot().tv_sec;
+	const long saved = atomic_load(&vmalloc_ipis_saved);
+	printk(PRINTK_INFO "mm: vmalloc lazy frees %lu, purges %lu, IPIs saved %ld (%ld per second since boot)\n",
+			atomic_load(&vmalloc_lazy_frees), atomic_load(&vmalloc_purges), saved, saved / (seconds > 0 ? seconds : 1));
+}
+
+/*
+ * A page being migrated is identified by its mm and virtual address, so a process that happens to use the
+ * same user address isn't stalled. The address is set last and cleared first, so a fault never sees it with
+ * the wrong mm.
+ */
+static atomic(struct mm*) migrating_mm = atomic_init(NULL);
+static atomic(uintptr_t) migrating_address = atomic_init(0);
+static MUTEX_DEFINE(migrate_mtx);
+
+bool vm_fault_is_migration(uintptr_t address) {
+	const uintptr_t migrating = atomic_load(&migrating_address);
+	if (!migrating || ROUND_DOWN(address, PAGE_SIZE) != migrating)
+		return false;
+
+	struct mm* mm = address >= KERNEL_SPACE_START ? &kernel_mm_struct : current_mm();
+	return atomic_load(&migrating_mm) == mm;
+}
+
+int vm_migrate_page(struct page* page, struct page* new) {
+	/* The mapping shares space with the free list links and the slab, so it can only be read while the page is held */
+	if (!try_hold_page(page))
+		return -EBUSY;
+	if (page_flags(page) & PAGE_FLAG_SLAB) {
+		release_page(page);
+		return -EBUSY;
+	}
+
+	/* mm_destroy() has to clear the mapping under rmap_lock before it can free the mm */
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&rmap_lock, &irq_flags);
+	struct mm* mm = page->mapping.mm;
+	const uintptr_t virtual = page->mapping.virtual;
+	const bool locked = mm && mutex_try_acquire(&mm->mutex);
+	spinlock_release_irq_restore(&rmap_lock, &irq_flags);
+	if (!locked) {
+		release_page(page);
+		return -EBUSY;
+	}
+
+	int err = -EBUSY;
+	const physaddr_t physical = page_to_physaddr(page);
+	const struct vma* vma = vma_find(mm, virtual);
+	if (!vma || arch_pagetable_get_physical(mm->pagetable, virtual) != physical)
+		goto out;
+
+	/* The mapping and this hold have to be the only references, and nothing can take a new one while the count is zero */
+	i32 refcnt = 2;
+	if (!atomic_compare_exchange_strong(&page->refcnt, &refcnt, 0))
+		goto out;
+
+	mutex_acquire(&migrate_mtx);
+	atomic_store(&migrating_mm, mm);
+	atomic_store(&migrating_address, virtual);
+
+	/*
+	 * Writes on other CPU's fault while the page is being copied, and the fault handler retries them.
+	 * Interrupts stay disabled here the whole time, since a handler writing the page on this CPU would
+	 * retry forever on a copy that can't finish.
+	 */
+	const unsigned long shootdown_flags = tlb_shootdown_begin();
+	bug(arch_pagetable_update(mm->pagetable, virtual, physical, false, vma->prot & ~PGPROT_WRITE) != 0);
+	tlb_shootdown_page(virtual);
+	memcpy(page_hhdm_virtual(new), page_hhdm_virtual(page), PAGE_SIZE);
+	bug(arch_pagetable_update(mm->pagetable, virtual, page_to_physaddr(new), false, vma->prot) != 0);
+
+	/* Stale entries can still read the old page until this finishes, which has the same contents */
+	tlb_shootdown_page(virtual);
+	tlb_shootdown_end(shootdown_flags);
+
+	atomic_store(&migrating_address, 0);
+	atomic_store(&migrating_mm, NULL);
+	mutex_release(&migrate_mtx);
+
+	spinlock_acquire_irq_save(&rmap_lock, &irq_flags);
+	page->mapping.mm = NULL;
+	new->mapping.mm = mm;
+	new->mapping.virtual = virtual;
+	spinlock_release_irq_restore(&rmap_lock, &irq_flags);
+	err = 0;
+out:
+	mutex_release(&mm->mutex);
+	if (err)
+		release_page(page);
+	return err;
+}
+
 static void vmm_init(void) {
 	arch_pagetable_init();
 
@@ -570,6 +1010,8 @@ static void vmm_init(void) {
 	mm->pagetable = arch_pagetable_get_cpu_current();
 	current_cpu()->mm_struct = mm;
 
+	register_shrinker(&vmalloc_lazy_shrinker);
+
 	/* Give HHDM VMA's that can't be changed */
 	uintptr_t _unused;
 	uintptr_t next;
@@ -0,0 +1,169 @@
+#include <lunar/common.h>
+#include <lunar/mm.h>
+#include <lunar/kthread.h>
+#include <lunar/semaphore.h>
+#include <lunar/spinlock.h>
+#include <lunar/string.h>
+#include <lunar/printk.h>
+#include <lunar/panic.h>
+#include <lunar/cmdline.h>
+#include <lunar/convert.h>
+#include <lunar/init.h>
+
+#include "internal.h"
+
+/*
+ * Pages are zeroed ahead of time by a minimum priority thread, so it only runs when the
+ * CPU's have nothing else to do. MM_ZERO allocations take from here, and only clear the
+ * page themselves when the pool is empty.
+ */
+
+#define ZERO_POOL_CAPACITY 1024
+#define ZERO_POOL_DEFAULT_SIZE 256
+
+static struct page* pool[ZERO_POOL_CAPACITY];
+static unsigned int pool_count = 0;
+static unsigned int pool_size = 0; /* Stays 0 until the thread is running, so nothing is signaled before then */
+static bool refill_pending = false;
+static spinlock_t pool_lock = SPINLOCK_INITIALIZER;
+static SEMAPHORE_DEFINE(pool_sem, 0);
+
+static atomic(unsigned long) pool_hits = atomic_init(0);
+static atomic(unsigned long) pool_misses = atomic_init(0);
+static atomic(unsigned long) pool_zeroed = atomic_init(0);
+
+struct page* zero_pool_take(void) {
+	struct page* page = NULL;
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&pool_lock, &irq_flags);
+	if (pool_count)
+		page = pool[--pool_count];
+	const bool refill = !refill_pending && pool_count < pool_size / 2;
+	if (refill)
+		refill_pending = true;
+	spinlock_release_irq_restore(&pool_lock, &irq_flags);
+
+	if (refill)
+		semaphore_signal(&pool_sem);
+	if (page)
+		atomic_add_fetch(&pool_hits, 1);
+	else
+		atomic_add_fetch(&pool_misses, 1);
+	return page;
+}
+
+/* Put a zeroed page in the pool, returns false if the pool is already full */
+static bool zero_pool_put(struct page* page) {
+	bool ret = false;
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&pool_lock, &irq_flags);
+	if (pool_count < pool_size) {
+		pool[pool_count++] = page;
+		ret = true;
+	}
+	spinlock_release_irq_restore(&pool_lock, &irq_flags);
+
+	return ret;
+}
+
+static void zero_pool_refill(void) {
+	while (1) {
+		struct page* page = alloc_page(MM_ZONE_NORMAL);
+		if (!page)
+			break;
+		memset(page_hhdm_virtual(page), 0, PAGE_SIZE);
+		if (!zero_pool_put(page)) {
+			release_page(page);
+			break;
+		}
+
+		atomic_add_fetch(&pool_zeroed, 1);
+		sched_yield();
+	}
+}
+
+static int zero_pool_thread(void* arg) {
+	(void)arg;
+	while (1) {
+		const int err = semaphore_wait(&pool_sem, 0);
+		if (unlikely(err))
+			continue;
+
+		/* Any allocation that happens after this point will signal again */
+		unsigned long irq_flags;
+		spinlock_acquire_irq_save(&pool_lock, &irq_flags);
+		refill_pending = false;
+		spinlock_release_irq_restore(&pool_lock, &irq_flags);
+
+		zero_pool_refill();
+	}
+
+	return 0;
+}
+
+/* The pool is only a cache, so all of it can go when memory runs low */
+static unsigned long zero_pool_shrink_count(struct shrinker* shrinker) {
+	(void)shrinker;
+	return pool_count;
+}
+
+static unsigned long zero_pool_shrink_scan(struct shrinker* shrinker, unsigned long target) {
+	(void)shrinker;
+	unsigned long freed = 0;
+	while (freed < target) {
+		struct page* page = NULL;
+		unsigned long irq_flags;
+		spinlock_acquire_irq_save(&pool_lock, &irq_flags);
+		if (pool_count)
+			page = pool[--pool_count];
+		spinlock_release_irq_restore(&pool_lock, &irq_flags);
+		if (!page)
+			break;
+
+		release_page(page);
+		freed++;
+	}
+	return freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+	.name = "zero_pool",
+	.count = zero_pool_shrink_count,
+	.scan = zero_pool_shrink_scan
+};
+
+void zero_pool_dump_stats(void) {
+	printk(PRINTK_INFO "mm: zero pool %u/%u pages, hits %lu, misses %lu, zeroed in background %lu\n",
+			pool_count, pool_size, atomic_load(&pool_hits), atomic_load(&pool_misses), atomic_load(&pool_zeroed));
+}
+
+static void zero_pool_init(void) {
+	unsigned long long size = ZERO_POOL_DEFAULT_SIZE;
+	const char* arg = cmdline_get("mm.zero_pool");
+	if (arg && (kstrtoull(arg, 0, &size) || size > ZERO_POOL_CAPACITY)) {
+		printk(PRINTK_WARN "mm: Invalid mm.zero_pool value %s, using %u\n", arg, ZERO_POOL_DEFAULT_SIZE);
+		size = ZERO_POOL_DEFAULT_SIZE;
+	}
+	if (size == 0)
+		return;
+
+	register_shrinker(&zero_pool_shrinker);
+	struct thread* thread = kthread_create(0, zero_pool_thread, NULL, "pagezero");
+	if (!thread)
+		out_of_memory();
+	int err = kthread_run(thread, SCHED_PRIO_MIN);
+	if (err)
+		panic("Failed to run pagezero kthread: %d", err);
+
+	unsigned long irq_flags;
+	spinlock_acquire_irq_save(&pool_lock, &irq_flags);
+	pool_size = size;
+	refill_pending = true;
+	spinlock_release_irq_restore(&pool_lock, &irq_flags);
+	semaphore_signal(&pool_sem);
+}
+
+INIT_TASK_DECLARE(kthread_init_task, sched_init_task, cmdline_init_task);
+INIT_TASK_DEFINE(zero_pool_init_task, INIT_TASK_SCOPE_BSP, zero_pool_init, &kthread_init_task, &sched_init_task, &cmdline_init_task);
@@ -9,8 +9,21 @@
 #include <lunar/mm.h>
 #include <lunar/init.h>
 #include <lunar/string.h>
+#include <lunar/percpu.h>
+#include <lunar/irq.h>
+#include <lunar/cmdline.h>
+#include <lunar/convert.h>
+#include <lunar/numa.h>
+#include <lunar/slab.h>
+#include <lunar/semaphore.h>
+#include <lunar/kthread.h>
+#include <lunar/format.h>
+#include <lunar/timekeeper.h>
 
 #include <arch/asm/errno.h>
+#include <arch/processor.h>
+
+#include "internal.h"
 
 #define DMA32_START 0x1000000
 #define DMA32_END 0x100000000
@@ -242,23 +255,6 @@ static const struct limine_mmap_entry* mmap_get_entry_from_page(physaddr_t page)
 	return ret;
 }
 
-/* Check if a memory region is free or not */
-static bool mmap_region_is_usable_strict(physaddr_t base, size_t size) {
-	if (size == 0)
-		return false;
-	physaddr_t end;
-	if (__builtin_add_overflow(base, size, &end))
-		return false;
-
-	if (end >= PHYSADDR_MAX - PAGE_SIZE)
-		return false;
-	end = ROUND_UP(end, PAGE_SIZE);
-	base = ROUND_DOWN(base, PAGE_SIZE);
-
-	const struct limine_mmap_entry* entry = mmap_get_entry_from_page(base);
-	return (entry && mmap_entry_usable_strict(entry)) ? mmap_entry_check(entry, base, end - base) : false;
-}
-
 /* Get the very last free address according to the memory map */
 static physaddr_t mmap_get_last_ram_address_inclusive(void) {
 	physaddr_t ret = 0;
@@ -270,49 +266,6 @@ static physaddr_t mmap_get_last_ram_address_inclusive(void) {
 	return ret;
 }
 
-/* Return a free address from the memory map, but with a minimum address */
-static physaddr_t mmap_get_free_address_from_size_min_strict(physaddr_t min, size_t size) {
-	for (size_t i = 0; i < sanitized_mmap.entry_count; i++) {
-		struct limine_mmap_entry* entry = &sanitized_mmap.entries[i];
-		if (!mmap_entry_usable_strict(entry))
-			continue;
-
-		physaddr_t base = entry->base;
-		physaddr_t end = entry->base + entry->length;
-		if (base < min)
-			base = min;
-		base = ROUND_UP(base, PAGE_SIZE);
-		if (base < end && end - base >= size)
-			return base;
-	}
-	return 0;
-}
-
-/* Allocate space from the memory map, not safe to use after zone initialization */
-static physaddr_t mmap_alloc(size_t size) {
-	if (size >= SIZE_MAX - PAGE_SIZE)
-		return 0;
-	size = ROUND_UP(size, PAGE_SIZE);
-
-	physaddr_t ret = mmap_get_free_address_from_size_min_strict(NORMAL_START, size);
-	if (ret == 0) {
-		ret = mmap_get_free_address_from_size_min_strict(DMA32_START, size);
-		if (unlikely(ret == 0))
-			ret = mmap_get_free_address_from_size_min_strict(PAGE_SIZE, size);
-	}
-	if (ret) {
-		struct limine_mmap_entry entry = { .base = ret, .length = size, .type = LIMINE_MMAP_EXECUTABLE_AND_MODULES };
-		int err = mmap_add_entry_unsanitized(&entry);
-		if (unlikely(err)) {
-			printk(PRINTK_CRIT "mm: %s() failed to add memory map entry entry, err: %d\n", __func__, err);
-			return 0;
-		}
-		mmap_sanitize();
-	}
-
-	return ret;
-}
-
 /* Return the number of bytes of usable memory, size returned is always a multiple of a page size */
 static u64 mmap_total_usable(void) {
 	u64 ret = 0;
@@ -324,15 +277,31 @@ static u64 mmap_total_usable(void) {
 	return ret;
 }
 
+static struct page* page_array;
+static size_t page_count;
+static size_t page_deferred_pfn = SIZE_MAX; /* First page that zones_init() leaves to the page init jobs */
+
+/*
+ * Check if a block from the buddy allocator is usable. Usability is precomputed into PAGE_FLAG_RESERVED
+ * by page_array_init_range(), and reserved pages never get onto the free lists: area_free_range() is only
+ * given the ranges memblock has free, and page_inactive() never frees a reserved page. So a whole block
+ * is usable if its head is, and only the head has to be checked.
+ */
+static inline bool block_is_usable(physaddr_t addr) {
+	const size_t pfn = addr >> PAGE_SHIFT;
+	return pfn < page_count && !(page_flags(&page_array[pfn]) & PAGE_FLAG_RESERVED);
+}
+
 struct mem_area {
 	physaddr_t base; /* Start of the memory area */
 	u64 size; /* The size of the area rounded to a power of two */
 	u64 real_size; /* The actual size of the area, usually the same as size */
-	atomic(unsigned long) free_blocks[MAX_ORDER + 1]; /* Amount of free blocks on every layer */
+	atomic(unsigned long) free_blocks[MAX_ORDER + 1]; /* Amount of free blocks on every layer (bitmap engine) or order (free list engine) */
 	unsigned long total_blocks; /* Number of blocks the last layer */
 	unsigned int layer_count; /* Usually MAX_ORDER + 1 */
 	struct {
-		unsigned long* free_list;
+		unsigned long* free_list; /* Bitmap tree, only used by the bitmap buddy engine */
+		u32 free_area[MAX_ORDER + 1]; /* Index of the first free block by order, only used by the free list buddy engine */
 		bool atomic; /* Can allocations from this area sleep? */
 		union {
 			spinlock_t spinlock;
@@ -340,13 +309,30 @@ struct mem_area {
 		};
 	} pages; /* For managing the actual memory in the list */
 	atomic(unsigned int) alloc_refcnt; /* How many threads are allocating from this area */
+	atomic(bool) online; /* Set once the struct pages are initialized and the area is given to the buddy allocator */
+	unsigned int node; /* The NUMA node the base of the area belongs to */
+	struct {
+		unsigned long acquired, contended;
+		u64 wait_cycles;
+	} lock_stats; /* Only written with the area locked */
 };
 
 static inline void mem_area_lock(struct mem_area* area, unsigned long* irq_flags) {
+	const bool acquired = area->pages.atomic ? spinlock_try_acquire_irq_save(&area->pages.spinlock, irq_flags) :
+		mutex_try_acquire(&area->pages.mutex);
+	if (likely(acquired)) {
+		area->lock_stats.acquired++;
+		return;
+	}
+
+	const u64 start = arch_cycle_count();
 	if (area->pages.atomic)
 		spinlock_acquire_irq_save(&area->pages.spinlock, irq_flags);
 	else
 		mutex_acquire(&area->pages.mutex);
+	area->lock_stats.acquired++;
+	area->lock_stats.contended++;
+	area->lock_stats.wait_cycles += arch_cycle_count() - start;
 }
 
 static inline void mem_area_unlock(struct mem_area* area, unsigned long* irq_flags) {
@@ -520,47 +506,329 @@ static int _free_block(struct mem_area* area, unsigned int layer, unsigned long
 	return 0;
 }
 
+/* Allocate the first free block on a layer, returns ULONG_MAX if there is nothing free */
+static unsigned long bitmap_alloc_block(struct mem_area* area, unsigned int layer) {
+	if (!atomic_load_explicit(&area->free_blocks[layer], ATOMIC_RELAXED))
+		return ULONG_MAX;
+	unsigned long block = find_first_free(area->pages.free_list, layer);
+	if (block == ULONG_MAX)
+		return ULONG_MAX;
+
+	int err = _alloc_block(area, layer, block);
+	if (err) {
+		printk(PRINTK_ERR "mm: _alloc_block failed in %s with error code %i\n", __func__, err);
+		return ULONG_MAX;
+	}
+	return block;
+}
+
+static inline size_t bitmap_size(unsigned int layer_count) {
+	return ((1ul << layer_count) >> 3) + 1;
+}
+
+/* Everything starts out allocated, including the blocks past the end of the area */
+static void bitmap_init_area(struct mem_area* area) {
+	for (unsigned int layer = 0; layer < area->layer_count; layer++)
+		atomic_store_explicit(&area->free_blocks[layer], 0, ATOMIC_RELAXED);
+	memset(area->pages.free_list, 0xff, bitmap_size(area->layer_count));
+}
+
+static bool bitmap_has_free(struct mem_area* area, unsigned int order) {
+	return !!atomic_load_explicit(&area->free_blocks[area->layer_count - order - 1], ATOMIC_RELAXED);
+}
+
+static physaddr_t bitmap_alloc(struct mem_area* area, unsigned int order) {
+	const unsigned int layer = area->layer_count - order - 1;
+	unsigned long block = bitmap_alloc_block(area, layer);
+	if (block == ULONG_MAX)
+		return 0;
+
+	/* Since the blocks that could be outside of the area are allocated, this should not happen */
+	physaddr_t ret = area->base + (block << (order + PAGE_SHIFT));
+	if (unlikely(ret + (PAGE_SIZE << order) > area->base + area->real_size)) {
+		printk(PRINTK_ERR "mm: Tried allocating a block outside of area!\n");
+		_free_block(area, layer, block);
+		return 0;
+	}
+	return ret;
+}
+
+static int bitmap_free(struct mem_area* area, physaddr_t addr, unsigned int order) {
+	return _free_block(area, area->layer_count - order - 1, (addr - area->base) >> (order + PAGE_SHIFT));
+}
+
+/* Freeing a block marks every block under it free too, so a block inside a bigger free one is marked itself */
+static bool bitmap_is_free(struct mem_area* area, physaddr_t addr, unsigned int order) {
+	const unsigned int layer = area->layer_count - order - 1;
+	return __is_block_free(area->pages.free_list, 1ul << layer, (addr - area->base) >> (order + PAGE_SHIFT));
+}
+
+static int bitmap_reserve(struct mem_area* area, physaddr_t addr) {
+	return _alloc_block(area, area->layer_count - 1, (addr - area->base) >> PAGE_SHIFT);
+}
+
+/* Every free block also has its halves marked free on the layer below, so those don't count */
+static unsigned long bitmap_free_count(struct mem_area* area, unsigned int order) {
+	const unsigned int layer = area->layer_count - order - 1;
+	unsigned long count = atomic_load_explicit(&area->free_blocks[layer], ATOMIC_RELAXED);
+	if (layer)
+		count -= atomic_load_explicit(&area->free_blocks[layer - 1], ATOMIC_RELAXED) * 2;
+	return count;
+}
+
+/*
+ * The free list engine keeps a list of free blocks for every order, threaded through the head struct page
+ * of every free block. The links are page indexes relative to the area, so they fit in 32 bits each. A free
+ * head is marked with PAGE_FLAG_BUDDY_FREE, and its order is in the page's info. Allocating and freeing only
+ * touches the lists and the buddies, so both are O(1) per order.
+ */
+static inline struct page* area_page(struct mem_area* area, unsigned long index) {
+	return &page_array[(area->base >> PAGE_SHIFT) + index];
+}
+
+static inline unsigned long area_page_index(struct mem_area* area, const struct page* page) {
+	return (unsigned long)(page - page_array) - (area->base >> PAGE_SHIFT);
+}
+
+static inline void free_area_push(struct mem_area* area, struct page* page, unsigned int order) {
+	const u32 index = area_page_index(area, page);
+	const u32 next = area->pages.free_area[order];
+	page_info_update(page, PAGE_FLAG_BUDDY_FREE | PAGE_ORDER_MASK, PAGE_FLAG_BUDDY_FREE | (order << PAGE_ORDER_SHIFT));
+	page->link.prev = PAGE_LINK_NONE;
+	page->link.next = next;
+	if (next != PAGE_LINK_NONE)
+		area_page(area, next)->link.prev = index;
+	area->pages.free_area[order] = index;
+	atomic_add_fetch_explicit(&area->free_blocks[order], 1, ATOMIC_RELAXED);
+}
+
+static inline void free_area_remove(struct mem_area* area, struct page* page, unsigned int order) {
+	const u32 prev = page->link.prev;
+	const u32 next = page->link.next;
+	if (prev != PAGE_LINK_NONE)
+		area_page(area, prev)->link.next = next;
+	else
+		area->pages.free_area[order] = next;
+	if (next != PAGE_LINK_NONE)
+		area_page(area, next)->link.prev = prev;
+	page_info_update(page, PAGE_FLAG_BUDDY_FREE | PAGE_ORDER_MASK, 0);
+	atomic_sub_fetch_explicit(&area->free_blocks[order], 1, ATOMIC_RELAXED);
+}
+
+static inline bool page_is_free_head(const struct page* page, unsigned int order) {
+	const u32 info = atomic_load_explicit(&page->info, ATOMIC_RELAXED);
+	return (info & PAGE_FLAG_BUDDY_FREE) && (info & PAGE_ORDER_MASK) >> PAGE_ORDER_SHIFT == order;
+}
+
+/* free_blocks is indexed by order here, and only counts the blocks on that order's list */
+static void lists_init_area(struct mem_area* area) {
+	for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+		area->pages.free_area[order] = PAGE_LINK_NONE;
+		atomic_store_explicit(&area->free_blocks[order], 0, ATOMIC_RELAXED);
+	}
+}
+
+static bool lists_has_free(struct mem_area* area, unsigned int order) {
+	for (unsigned int o = order; o < area->layer_count; o++) {
+		if (atomic_load_explicit(&area->free_blocks[o], ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Only the lower half of a merged block stays a free head, so a double free is caught by looking
+ * for a free block that contains the page on every order rather than just checking its flag.
+ */
+static bool lists_page_is_free(struct mem_area* area, unsigned long index) {
+	for (unsigned int order = 0; order < area->layer_count; order++) {
+		if (page_is_free_head(area_page(area, index & ~((1ul << order) - 1)), order))
+			return true;
+	}
+	return false;
+}
+
+static bool lists_is_free(struct mem_area* area, physaddr_t addr, unsigned int order) {
+	(void)order;
+	return lists_page_is_free(area, (addr - area->base) >> PAGE_SHIFT);
+}
+
+static physaddr_t lists_alloc(struct mem_area* area, unsigned int order) {
+	unsigned int o = order;
+	while (o < area->layer_count && area->pages.free_area[o] == PAGE_LINK_NONE)
+		o++;
+	if (o >= area->layer_count)
+		return 0;
+
+	struct page* page = area_page(area, area->pages.free_area[o]);
+	free_area_remove(area, page, o);
+
+	/* Give the upper halves back until the block is the right size */
+	while (o > order) {
+		o--;
+		free_area_push(area, page + (1ul << o), o);
+	}
+
+	return (physaddr_t)(page - page_array) << PAGE_SHIFT;
+}
+
+static int lists_free(struct mem_area* area, physaddr_t addr, unsigned int order) {
+	const unsigned long pages = area->real_size >> PAGE_SHIFT;
+	unsigned long index = (addr - area->base) >> PAGE_SHIFT;
+	if (index + (1ul << order) > pages)
+		return -EFAULT;
+
+	if (lists_page_is_free(area, index))
+		return -EALREADY;
+
+	/* Merge with the buddy for as long as it's a free block of the same order */
+	while (order < area->layer_count - 1) {
+		unsigned long buddy_index = index ^ (1ul << order);
+		if (buddy_index + (1ul << order) > pages)
+			break;
+		struct page* buddy = area_page(area, buddy_index);
+		if (!page_is_free_head(buddy, order))
+			break;
+
+		free_area_remove(area, buddy, order);
+		index &= ~(1ul << order);
+		order++;
+	}
+
+	free_area_push(area, area_page(area, index), order);
+	return 0;
+}
+
+static int lists_reserve(struct mem_area* area, physaddr_t addr) {
+	const unsigned long index = (addr - area->base) >> PAGE_SHIFT;
+
+	/* Find the free block that contains the page */
+	unsigned int order = 0;
+	unsigned long head = index;
+	while (1) {
+		if (order >= area->layer_count)
+			return -EALREADY;
+		head = index & ~((1ul << order) - 1);
+		if (page_is_free_head(area_page(area, head), order))
+			break;
+		order++;
+	}
+
+	/* Split the block, giving back every half that doesn't contain the page */
+	free_area_remove(area, area_page(area, head), order);
+	while (order--) {
+		unsigned long half = 1ul << order;
+		if (index >= head + half) {
+			free_area_push(area, area_page(area, head), order);
+			head += half;
+		} else {
+			free_area_push(area, area_page(area, head + half), order);
+		}
+	}
+
+	return 0;
+}
+
+static unsigned long lists_free_count(struct mem_area* area, unsigned int order) {
+	return atomic_load_explicit(&area->free_blocks[order], ATOMIC_RELAXED);
+}
+
+struct buddy_engine {
+	const char* name;
+	bool uses_bitmap; /* Needs area->pages.free_list */
+	void (*init_area)(struct mem_area* area); /* Nothing is free until it's given to free() */
+	bool (*has_free)(struct mem_area* area, unsigned int order);
+	physaddr_t (*alloc)(struct mem_area* area, unsigned int order);
+	int (*free)(struct mem_area* area, physaddr_t addr, unsigned int order);
+	bool (*is_free)(struct mem_area* area, physaddr_t addr, unsigned int order); /* Free or inside a free block */
+	int (*reserve)(struct mem_area* area, physaddr_t addr);
+	unsigned long (*free_count)(struct mem_area* area, unsigned int order); /* Free blocks of exactly this order */
+};
+
+static const struct buddy_engine bitmap_engine = {
+	.name = "bitmap",
+	.uses_bitmap = true,
+	.init_area = bitmap_init_area,
+	.has_free = bitmap_has_free,
+	.alloc = bitmap_alloc,
+	.free = bitmap_free,
+	.is_free = bitmap_is_free,
+	.reserve = bitmap_reserve,
+	.free_count = bitmap_free_count
+};
+
+static const struct buddy_engine lists_engine = {
+	.name = "lists",
+	.uses_bitmap = false,
+	.init_area = lists_init_area,
+	.has_free = lists_has_free,
+	.alloc = lists_alloc,
+	.free = lists_free,
+	.is_free = lists_is_free,
+	.reserve = lists_reserve,
+	.free_count = lists_free_count
+};
+
+/* Selected with mm.buddy_engine, can only be changed before any zone is initialized */
+static const struct buddy_engine* buddy = &lists_engine;
+
+enum zone_watermark {
+	ZONE_WMARK_MIN,
+	ZONE_WMARK_LOW,
+	ZONE_WMARK_HIGH,
+	ZONE_WMARK_COUNT
+};
+
 struct zone {
 	mm_t zone_type; /* Has only 1 flag, either MM_ZONE_DMA, MM_ZONE_DMA32, or MM_ZONE_NORMAL */
+	atomic(long) free_pages; /* Pages in the buddy allocator, the per-CPU page caches count as allocated */
+	atomic(unsigned long) managed_pages; /* Every page that was ever given to the buddy allocator */
+	unsigned long watermarks[ZONE_WMARK_COUNT]; /* See zone_set_watermarks() */
 	unsigned long area_count; /* The number of areas the zone has */
 	struct mem_area* areas; /* The array of memory areas, in order by area->base */
+	struct {
+		unsigned long* areas; /* Indexes into the areas array */
+		unsigned long area_count;
+	} nodes[MAX_NUMA_NODES]; /* Only valid once numa_zones_ready is set */
 };
 
+static atomic(bool) numa_zones_ready = atomic_init(false);
+
 /*
- * Selects a memory area to allocate from
+ * Selects a memory area to allocate from out of a set of areas in a zone, indexes is
+ * the set of areas to look at. If indexes is NULL, the first count areas are used.
  *
- * This function will allocate the block of memory, and store the information about that block
- * into layer and block. The atomic parameter will determine whether or not the allocation can sleep,
- * and will always return an area that is marked as atomic. The IRQ flags are used for locking if the
+ * This function will return a locked area that has a free block of at least the requested order.
+ * The atomic parameter will determine whether or not the allocation can sleep, and will always
+ * return an area that is marked as atomic. The IRQ flags are used for locking if the
  * allocation cannot sleep.
  *
  * Acquires area->lock, and increments area->refcnt
  */
-static struct mem_area* select_mem_area(struct zone* zone, unsigned int order,
-		unsigned int* layer, unsigned long* block, bool atomic, unsigned long* irq_flags) {
+static struct mem_area* select_mem_area_from(struct zone* zone, const unsigned long* indexes, unsigned long count,
+		unsigned int order, bool atomic, unsigned long* irq_flags) {
 	const int max_retries = 3;
 	int retries = 0;
 	unsigned long i = 0;
 	while (retries < max_retries) {
 		struct mem_area* best = NULL;
-		unsigned int best_layer = 0;
 		unsigned int best_index = 0;
-		for (; i < zone->area_count; i++) {
-			struct mem_area* a = &zone->areas[i];
+		for (; i < count; i++) {
+			struct mem_area* a = &zone->areas[indexes ? indexes[i] : i];
 			if (a->pages.atomic != atomic)
 				continue;
 			if (unlikely(a->layer_count <= order))
 				continue;
+			if (unlikely(!atomic_load_explicit(&a->online, ATOMIC_ACQUIRE)))
+				continue;
 
-			const unsigned int l = a->layer_count - order - 1;
-			if (!atomic_load_explicit(&a->free_blocks[l], ATOMIC_RELAXED))
+			if (!buddy->has_free(a, order))
 				continue;
 
 			const unsigned int crefs = atomic_load(&a->alloc_refcnt);
 			const bool take_now = (crefs == 0 || retries > 0);
 			if (take_now || !best || crefs < atomic_load(&best->alloc_refcnt)) {
 				best = a;
-				best_layer = l;
 				best_index = i;
 				if (take_now)
 					break;
@@ -575,12 +843,8 @@ static struct mem_area* select_mem_area(struct zone* zone, unsigned int order,
 
 		atomic_add_fetch(&best->alloc_refcnt, 1);
 		mem_area_lock(best, irq_flags);
-		if (atomic_load_explicit(&best->free_blocks[best_layer], ATOMIC_RELAXED)) {
-			*layer = best_layer;
-			*block = find_first_free(best->pages.free_list, best_layer);
-			bug(*block == ULONG_MAX); /* This means the accounting logic is fucked up if this triggers */
+		if (buddy->has_free(best, order))
 			return best;
-		}
 		mem_area_unlock(best, irq_flags);
 		atomic_sub_fetch(&best->alloc_refcnt, 1);
 
@@ -590,6 +854,26 @@ static struct mem_area* select_mem_area(struct zone* zone, unsigned int order,
 	return NULL;
 }
 
+/*
+ * Selects a memory area to allocate from, preferring areas on a NUMA node and falling back
+ * to the other nodes by distance. If node is NUMA_NO_NODE, the areas are tried in address order.
+ */
+static struct mem_area* select_mem_area(struct zone* zone, unsigned int order, int node, bool atomic, unsigned long* irq_flags) {
+	if (node == NUMA_NO_NODE || !atomic_load_explicit(&numa_zones_ready, ATOMIC_ACQUIRE))
+		return select_mem_area_from(zone, NULL, zone->area_count, order, atomic, irq_flags);
+
+	const unsigned int* fallback = numa_fallback_order(node);
+	for (unsigned int i = 0; i < numa_node_count(); i++) {
+		unsigned int n = fallback[i];
+		struct mem_area* area = select_mem_area_from(zone, zone->nodes[n].areas, zone->nodes[n].area_count,
+				order, atomic, irq_flags);
+		if (area)
+			return area;
+	}
+
+	return NULL;
+}
+
 /* Get a memory area based on an address. */
 static struct mem_area* get_mem_area(struct zone* zone, physaddr_t addr) {
 	unsigned long low = 0;
@@ -611,107 +895,60 @@ static struct mem_area* get_mem_area(struct zone* zone, physaddr_t addr) {
 }
 
 /*
- * Allocate pages from a memory zone, this function makes sure the memory
- * region is actually system RAM before returning the address.
+ * Allocate a block from an area that is already locked. Returns 0 when the area has nothing
+ * left for the order. A reserved block on the free lists is a bug, so it's leaked rather than handed out.
  */
-static physaddr_t __alloc_pages(struct zone* zone, mm_t mm_flags, unsigned int order) {
-	size_t alloc_size = PAGE_SIZE << order;
-
-	physaddr_t ret = 0;
-	int err;
-
-	unsigned int layer;
-	unsigned long block;
-	unsigned long irq_flags;
-
-	bool atomic = !!(mm_flags & MM_ATOMIC);
-	struct mem_area* area = select_mem_area(zone, order, &layer, &block, atomic, &irq_flags);
-	if (!area)
-		goto out;
-
-retry:
-	ret = 0;
-
-	/* 
-	 * On the first attempt, select_mem_area will select a block for us. If we need a retry, 
-	 * block is set to ULONG_MAX so that way we know to actually retry.
-	 */
-	if (block == ULONG_MAX) {
-		block = find_first_free(area->pages.free_list, layer);
-		if (block == ULONG_MAX) {
-			mem_area_unlock(area, &irq_flags);
-			area = select_mem_area(zone, order, &layer, &block, atomic, &irq_flags);
-			if (!area)
-				goto out;
-		}
-	}
+static physaddr_t __alloc_block_locked(struct mem_area* area, unsigned int order) {
+	while (1) {
+		physaddr_t ret = buddy->alloc(area, order);
+		if (!ret)
+			return 0;
+		if (likely(block_is_usable(ret)))
+			return ret;
 
-	err = _alloc_block(area, layer, block);
-	if (err) {
-		printk(PRINTK_ERR "mm: _alloc_block failed in %s with error code %i\n", __func__, err);
-		goto out;
+		printk(PRINTK_ERR "mm: Reserved block %#lx (order %u) was on a free list\n", ret, order);
 	}
+}
 
-	ret = area->base + (block * alloc_size);
+/*
+ * Allocate up to count blocks of the same order from a memory zone. The area lock is taken once
+ * for every area the blocks come from, rather than once per block. See select_mem_area() for node.
+ *
+ * Returns the number of blocks stored in out.
+ */
+static size_t __alloc_pages_batch(struct zone* zone, mm_t mm_flags, unsigned int order, int node, physaddr_t* out, size_t count) {
+	const bool atomic = !!(mm_flags & MM_ATOMIC);
+	size_t allocated = 0;
+	while (allocated < count) {
+		unsigned long irq_flags;
+		struct mem_area* area = select_mem_area(zone, order, node, atomic, &irq_flags);
+		if (!area)
+			break;
 
-	/* Since the blocks that could be outside of the area are allocated, this should not happen */
-	if (unlikely(ret + alloc_size > area->base + area->real_size)) {
-		printk(PRINTK_ERR "mm: Tried allocating a block outside of area!\n");
-		_free_block(area, layer, block);
-		ret = 0;
-		goto out;
-	}
-
-	/*
-	 * Now make sure this region is actually marked usable in the memory map.
-	 * These regions are reserved at boot, but this serves as a sanity check
-	 */
-	if (unlikely(!mmap_region_is_usable_strict(ret, alloc_size))) {
-		/* Go through each page, and see what usable pages there are, and free those blocks */
-		for (size_t i = 0; i < alloc_size; i += PAGE_SIZE) {
-			if (mmap_region_is_usable_strict(ret + i, PAGE_SIZE)) {
-				block = ((ret + i) - area->base) >> PAGE_SHIFT;
-				_free_block(area, area->layer_count - 1, block);
+		/* If the area still claims to have free blocks after failing, something is wrong with it, so don't keep selecting it */
+		bool failed = false;
+		while (allocated < count) {
+			physaddr_t addr = __alloc_block_locked(area, order);
+			if (!addr) {
+				failed = buddy->has_free(area, order);
+				break;
 			}
+			out[allocated++] = addr;
 		}
 
-		block = ULONG_MAX;
-		goto retry;
-	}
-out:
-	if (area) {
 		mem_area_unlock(area, &irq_flags);
 		atomic_sub_fetch(&area->alloc_refcnt, 1);
+		if (failed)
+			break;
 	}
-	return ret;
-}
-
-/*
- * Horribly inefficient, but i just want this to work. This shouldn't really run outside of really boot,
- * but in case it does for some reason, do locking
- */
-static int __reserve_pages(struct zone* zone, physaddr_t addr, size_t size) {
-	if (unlikely(size >= SIZE_MAX - PAGE_SIZE))
-		return -ERANGE;
-
-	size = ROUND_UP(size, PAGE_SIZE);
-	for (size = ROUND_UP(size, PAGE_SIZE); size; addr += PAGE_SIZE, size -= PAGE_SIZE) {
-		struct mem_area* area = get_mem_area(zone, addr);
-		if (unlikely(!area))
-			continue;
-
-		unsigned long irq_flags;
-		const unsigned int layer = area->layer_count - 1;
-		unsigned long block = (addr - area->base) >> PAGE_SHIFT;
 
-		mem_area_lock(area, &irq_flags);
-		int err = _alloc_block(area, layer, block);
-		mem_area_unlock(area, &irq_flags);
-		if (err && err != -EALREADY) /* Can happen for things like overlapping reserved regions */
-			printk(PRINTK_WARN "mm: %#16lx error %i\n", addr, err);
-	}
+	return allocated;
+}
 
-	return 0;
+/* Allocate pages from a memory zone */
+static physaddr_t __alloc_pages(struct zone* zone, mm_t mm_flags, unsigned int order, int node) {
+	physaddr_t ret;
+	return __alloc_pages_batch(zone, mm_flags, order, node, &ret, 1) ? ret : 0;
 }
 
 /* Free pages from a specific memory zone. */
@@ -720,20 +957,47 @@ static int __free_pages(struct zone* zone, physaddr_t addr, unsigned int order)
 	if (!area)
 		return -EFAULT;
 
-	unsigned int layer = area->layer_count - order - 1;
-	size_t alloc_size = PAGE_SIZE << order;
-	unsigned long block = (addr - area->base) / alloc_size;
+	if ((addr - area->base) & ((PAGE_SIZE << order) - 1))
+		return -EINVAL;
 
 	unsigned long irq_flags;
 	mem_area_lock(area, &irq_flags);
-	int ret = _free_block(area, layer, block);
+	int ret = buddy->free(area, addr, order);
 	mem_area_unlock(area, &irq_flags);
 	return ret;
 }
 
+/*
+ * Free several blocks of the same order from a memory zone, blocks next to each other in the array that
+ * belong to the same area are freed under a single lock acquisition.
+ */
+static void __free_pages_batch(struct zone* zone, const physaddr_t* addrs, size_t count, unsigned int order) {
+	struct mem_area* locked = NULL;
+	unsigned long irq_flags;
+	for (size_t i = 0; i < count; i++) {
+		struct mem_area* area = get_mem_area(zone, addrs[i]);
+		if (unlikely(!area)) {
+			printk(PRINTK_ERR "mm: %s() no area for %#lx\n", __func__, addrs[i]);
+			continue;
+		}
+		if (area != locked) {
+			if (locked)
+				mem_area_unlock(locked, &irq_flags);
+			mem_area_lock(area, &irq_flags);
+			locked = area;
+		}
+
+		int err = buddy->free(area, addrs[i], order);
+		if (unlikely(err))
+			printk(PRINTK_ERR "mm: %s() failed to free %#lx: %d\n", __func__, addrs[i], err);
+	}
+
+	if (locked)
+		mem_area_unlock(locked, &irq_flags);
+}
+
 #define DMA_SIZE 0x1000000
 #define DMA_AREA_COUNT ((DMA_SIZE >> MAX_ORDER) >> PAGE_SHIFT)
-#define MAX_AREA_BMP_SIZE (((1 << (MAX_ORDER + 1)) >> 3) + 1)
 
 /* Sanity check */
 #if (DMA_SIZE >> MAX_ORDER) < PAGE_SIZE
@@ -741,7 +1005,6 @@ static int __free_pages(struct zone* zone, physaddr_t addr, unsigned int order)
 #endif /* (DMA_SIZE >> MAX_ORDER) < PAGE_SIZE */
 
 static struct mem_area dma_areas[DMA_AREA_COUNT];
-static unsigned long dma_area_free_lists[DMA_AREA_COUNT][MAX_AREA_BMP_SIZE / sizeof(unsigned long)] = { 0 };
 static struct zone dma_zone;
 
 /* 
@@ -808,71 +1071,761 @@ void out_of_memory(void) {
 	panic("Out of memory");
 }
 
-static physaddr_t _alloc_pages(mm_t mm_flags, unsigned int order) {
-	if (order > MAX_ORDER) {
-		dump_stack();
-		printk(PRINTK_ERR "mm: %s(mm_flags: %u, order: %u) failed: bad order\n", __func__, mm_flags, order);
-		return 0;
-	}
+/* Tunables for the per-CPU page cache, indexed by order. The high mark must stay below PAGE_CACHE_CAPACITY. */
+static unsigned int page_cache_high[PAGE_CACHE_MAX_ORDER + 1] = { 48, 24, 12, 6 };
+static unsigned int page_cache_batch[PAGE_CACHE_MAX_ORDER + 1] = { 16, 8, 4, 2 };
 
-	if ((mm_flags & (MM_ZONE_NORMAL | MM_ZONE_DMA32 | MM_ZONE_DMA)) == 0)
-		mm_flags |= MM_ZONE_NORMAL;
-	struct zone* zone = get_zone_mm(mm_flags);
-	if (!zone) {
-		dump_stack();
-		printk(PRINTK_ERR "mm: %s(mm_flags: %u, order: %u) failed: bad flags\n", __func__, mm_flags, order);
-		return 0;
-	}
+static inline unsigned int zone_index(const struct zone* zone) {
+	return __builtin_ctz(zone->zone_type);
+}
 
-	/* For atomic contexts, don't retry at all to avoid latency issues (unless MM_NOFAIL is set (bad idea)) */
-	const unsigned int max_retries = (mm_flags & MM_ATOMIC) ? 0 : 8;
-	unsigned int retries = max_retries;
-	physaddr_t ret = 0;
-	do {
-		ret = __alloc_pages(zone, mm_flags, order);
-		if (ret) {
-			atomic_add_fetch(&pages_in_use, 1ul << order);
-			break;
-		}
-		if (mm_flags & MM_NOFAIL && retries == 0) {
-			retries = 1;
-			if ((mm_flags & MM_ATOMIC) == 0) /* Having MM_ATOMIC set with MM_NOFAIL is dangerous, but legal */
-				out_of_memory();
-			continue;
-		}
-		if (retries < max_retries / 2) {
-			switch (zone->zone_type) {
-			case MM_ZONE_NORMAL:
-				zone = dma32_zone;
-				break;
-			case MM_ZONE_DMA32:
-				zone = &dma_zone;
-				break;
-			case MM_ZONE_DMA:
-				if (mm_flags & MM_ZONE_DMA32)
-					zone = dma32_zone;
-				else if (mm_flags & MM_ZONE_NORMAL)
-					zone = normal_zone;
-				break;
-			default:
-				bug("Invalid zone type");
-			}
-		}
-	} while (retries--);
+/*
+ * Blocks in a page cache are marked with PAGE_FLAG_CACHED, so freeing one twice is caught before it
+ * can be handed out twice. The head is already being written by page_inactive(), so it's cheap.
+ */
+static inline void page_cache_mark(physaddr_t block, bool cached) {
+	page_info_update(&page_array[block >> PAGE_SHIFT], PAGE_FLAG_CACHED, cached ? PAGE_FLAG_CACHED : 0);
+}
 
-	return ret;
+static inline void page_cache_push_hot(struct page_cache_list* list, physaddr_t block) {
+	page_cache_mark(block, true);
+	list->head = (list->head - 1) & (PAGE_CACHE_CAPACITY - 1);
+	list->blocks[list->head] = block;
+	list->count++;
 }
 
-static void _free_pages(physaddr_t addr, unsigned int order) {
-	int err = -EINVAL;
+static inline void page_cache_push_cold(struct page_cache_list* list, physaddr_t block) {
+	page_cache_mark(block, true);
+	list->blocks[(list->head + list->count) & (PAGE_CACHE_CAPACITY - 1)] = block;
+	list->count++;
+}
+
+static inline physaddr_t page_cache_pop_hot(struct page_cache_list* list) {
+	physaddr_t block = list->blocks[list->head];
+	list->head = (list->head + 1) & (PAGE_CACHE_CAPACITY - 1);
+	list->count--;
+	page_cache_mark(block, false);
+	return block;
+}
+
+static inline physaddr_t page_cache_pop_cold(struct page_cache_list* list) {
+	list->count--;
+	physaddr_t block = list->blocks[(list->head + list->count) & (PAGE_CACHE_CAPACITY - 1)];
+	page_cache_mark(block, false);
+	return block;
+}
+
+/*
+ * Allocate a block from the per-CPU page cache. If the cache is empty, it's refilled with a batch
+ * from the buddy allocator. The buddy allocator is called with IRQ's on, since the area lock can be a mutex.
+ * The cache only holds blocks for the CPU's own node, so allocations for other nodes skip it.
+ */
+static physaddr_t page_cache_alloc(struct zone* zone, mm_t mm_flags, unsigned int order, unsigned int node) {
+	const bool atomic = !!(mm_flags & MM_ATOMIC);
+	const unsigned int zindex = zone_index(zone);
+
+	unsigned long irq_flags = local_irq_save();
+	struct cpu* cpu = current_cpu();
+	if (cpu->numa_node != node) {
+		local_irq_restore(irq_flags);
+		return __alloc_pages(zone, mm_flags, order, node);
+	}
+	struct page_cache* cache = &cpu->page_cache;
+	struct page_cache_list* list = &cache->lists[zindex][atomic][order];
+	physaddr_t ret = 0;
+	if (list->count) {
+		ret = page_cache_pop_hot(list);
+		cache->hits[order]++;
+	} else {
+		cache->misses[order]++;
+	}
+	local_irq_restore(irq_flags);
+	if (ret)
+		return ret;
+
+	/* Grab one extra block for the caller */
+	physaddr_t blocks[PAGE_CACHE_CAPACITY + 1];
+	size_t count = __alloc_pages_batch(zone, mm_flags, order, node, blocks, page_cache_batch[order] + 1);
+	if (count == 0)
+		return 0;
+
+	/* The thread may have migrated, so look up the CPU again. Newly refilled blocks are cold. */
+	size_t i = 1;
+	irq_flags = local_irq_save();
+	cache = &current_cpu()->page_cache;
+	list = &cache->lists[zindex][atomic][order];
+	for (; i < count && list->count < page_cache_high[order]; i++)
+		page_cache_push_cold(list, blocks[i]);
+	cache->refills[order]++;
+	local_irq_restore(irq_flags);
+
+	if (i < count)
+		__free_pages_batch(zone, blocks + i, count - i, order);
+	return blocks[0];
+}
+
+/* Free a block to the per-CPU page cache, draining a batch of cold blocks back to the buddy allocator when full */
+static int page_cache_free(struct zone* zone, physaddr_t addr, unsigned int order) {
+	struct mem_area* area = get_mem_area(zone, addr);
+	if (!area)
+		return -EFAULT;
+	if ((addr - area->base) & ((PAGE_SIZE << order) - 1))
+		return -EINVAL;
+	if (page_flags(&page_array[addr >> PAGE_SHIFT]) & PAGE_FLAG_CACHED)
+		return -EALREADY;
+
+	/* The block's own flags don't show it was merged into a bigger free block, the buddy engine has to look */
+	unsigned long irq_flags;
+	mem_area_lock(area, &irq_flags);
+	const bool already_free = buddy->is_free(area, addr, order);
+	mem_area_unlock(area, &irq_flags);
+	if (already_free)
+		return -EALREADY;
+
+	physaddr_t blocks[PAGE_CACHE_CAPACITY];
+	size_t count = 0;
+
+	irq_flags = local_irq_save();
+	struct cpu* cpu = current_cpu();
+	if (cpu->numa_node != area->node) {
+		local_irq_restore(irq_flags);
+		return __free_pages(zone, addr, order);
+	}
+	struct page_cache* cache = &cpu->page_cache;
+	struct page_cache_list* list = &cache->lists[zone_index(zone)][area->pages.atomic][order];
+	page_cache_push_hot(list, addr);
+	if (list->count > page_cache_high[order]) {
+		while (count < page_cache_batch[order] && list->count)
+			blocks[count++] = page_cache_pop_cold(list);
+		cache->drains[order]++;
+	}
+	local_irq_restore(irq_flags);
+
+	if (count)
+		__free_pages_batch(zone, blocks, count, order);
+	return 0;
+}
+
+static inline physaddr_t zone_alloc_pages(struct zone* zone, mm_t mm_flags, unsigned int order, unsigned int node) {
+	if (order <= PAGE_CACHE_MAX_ORDER)
+		return page_cache_alloc(zone, mm_flags, order, node);
+	return __alloc_pages(zone, mm_flags, order, node);
+}
+
+static inline int zone_free_pages(struct zone* zone, physaddr_t addr, unsigned int order) {
+	if (order <= PAGE_CACHE_MAX_ORDER)
+		return page_cache_free(zone, addr, order);
+	return __free_pages(zone, addr, order);
+}
+
+static void page_cache_dump_stats(void) {
+	struct smp_cpus cpus;
+	smp_cpus_read_acquire(&cpus);
+	for (u32 i = 0; i < cpus.count; i++) {
+		const struct page_cache* cache = &cpus.cpus[i]->page_cache;
+		for (unsigned int order = 0; order <= PAGE_CACHE_MAX_ORDER; order++) {
+			unsigned int cached = 0;
+			for (unsigned int z = 0; z < PAGE_CACHE_ZONE_COUNT; z++)
+				cached += cache->lists[z][0][order].count + cache->lists[z][1][order].count;
+			printk(PRINTK_INFO "mm: cpu%u order %u: cached %u, hits %lu, misses %lu, refills %lu, drains %lu\n",
+					cpus.cpus[i]->runqueue.sched_id, order, cached,
+					cache->hits[order], cache->misses[order], cache->refills[order], cache->drains[order]);
+		}
+	}
+	smp_cpus_read_release(&cpus);
+}
+
+static const char* zone_name(const struct zone* zone) {
+	switch (zone->zone_type) {
+	case MM_ZONE_DMA:
+		return "DMA";
+	case MM_ZONE_DMA32:
+		return "DMA32";
+	default:
+		return "Normal";
+	}
+}
+
+/* Get the distinct zones, since DMA32 and normal point to a smaller zone when there's no memory for them */
+static unsigned int get_zones(struct zone** zones) {
+	unsigned int count = 0;
+	zones[count++] = &dma_zone;
+	if (dma32_zone != &dma_zone)
+		zones[count++] = dma32_zone;
+	if (normal_zone != dma32_zone)
+		zones[count++] = normal_zone;
+	return count;
+}
+
+/*
+ * Fragmentation index of a zone for an order, computed the same way as Linux. Values near 0 mean an allocation
+ * of that order would fail because memory is low, values near 1000 mean it would fail because of fragmentation.
+ * Returns -1 if there is a free block that's big enough.
+ */
+static int zone_fragmentation_index(struct zone* zone, unsigned int order) {
+	unsigned long free_pages = 0, free_blocks = 0, suitable = 0;
+	for (unsigned long i = 0; i < zone->area_count; i++) {
+		struct mem_area* area = &zone->areas[i];
+		for (unsigned int o = 0; o < area->layer_count; o++) {
+			const unsigned long count = buddy->free_count(area, o);
+			free_pages += count << o;
+			free_blocks += count;
+			if (o >= order)
+				suitable += count;
+		}
+	}
+
+	if (suitable)
+		return -1;
+	if (!free_blocks)
+		return 0;
+	return 1000 - (int)((1000 + free_pages * 1000 / (1ul << order)) / free_blocks);
+}
+
+/*
+ * Every zone has three watermarks based on how much memory it manages. Dropping below the low one wakes up
+ * kreclaimd, which runs the shrinkers until the zone is back above the high one. Allocations that can sleep
+ * reclaim memory themselves when they fail, or when the zone is below the min watermark, since what's below
+ * that is left for allocations that can't sleep.
+ */
+#define RECLAIM_INTERVAL_US 1000000
+#define WATERMARK_MIN_PAGES 16
+
+static SEMAPHORE_DEFINE(reclaim_sem, 0);
+static atomic(bool) reclaim_pending = atomic_init(false);
+static atomic(unsigned long) reclaim_wakeups = atomic_init(0);
+static atomic(unsigned long) reclaim_background_pages = atomic_init(0);
+static atomic(unsigned long) reclaim_direct_runs = atomic_init(0);
+static atomic(unsigned long) reclaim_direct_pages = atomic_init(0);
+
+/* The min watermark is 1/256 of the zone, low and high are a quarter and a half more than that */
+static void zone_set_watermarks(struct zone* zone) {
+	unsigned long min = atomic_load(&zone->managed_pages) >> 8;
+	if (min < WATERMARK_MIN_PAGES)
+		min = WATERMARK_MIN_PAGES;
+	zone->watermarks[ZONE_WMARK_MIN] = min;
+	zone->watermarks[ZONE_WMARK_LOW] = min + (min >> 2);
+	zone->watermarks[ZONE_WMARK_HIGH] = min + (min >> 1);
+}
+
+/* How many pages a zone is missing to be at a watermark */
+static unsigned long zone_shortage(struct zone* zone, enum zone_watermark watermark) {
+	const long free_pages = atomic_load_explicit(&zone->free_pages, ATOMIC_RELAXED);
+	const long wanted = zone->watermarks[watermark];
+	return free_pages < wanted ? wanted - free_pages : 0;
+}
+
+static void reclaim_wake(void) {
+	bool expected = false;
+	if (atomic_compare_exchange_strong(&reclaim_pending, &expected, true))
+		semaphore_signal(&reclaim_sem);
+}
+
+/* Pages leaving a zone, through _alloc_pages() or alloc_pages_bulk() */
+static inline void zone_account_alloc(struct zone* zone, unsigned long count) {
+	atomic_sub_fetch(&zone->free_pages, count);
+	if (zone_shortage(zone, ZONE_WMARK_LOW))
+		reclaim_wake();
+}
+
+static inline void zone_account_free(struct zone* zone, unsigned long count) {
+	atomic_add_fetch(&zone->free_pages, count);
+}
+
+/* Get at least count pages back, or enough for the zone to reach its low watermark */
+static unsigned long reclaim_direct(struct zone* zone, unsigned long count) {
+	unsigned long target = zone_shortage(zone, ZONE_WMARK_LOW);
+	if (target < count)
+		target = count;
+
+	const unsigned long freed = shrink_memory(target, false);
+	atomic_add_fetch(&reclaim_direct_runs, 1);
+	atomic_add_fetch(&reclaim_direct_pages, freed);
+	return freed;
+}
+
+static int reclaim_thread(void* arg) {
+	(void)arg;
+	while (1) {
+		const int err = semaphore_wait_timed(&reclaim_sem, RECLAIM_INTERVAL_US, 0);
+		if (unlikely(err && err != -ETIME))
+			continue;
+		atomic_store(&reclaim_pending, false);
+
+		struct zone* zones[MM_ZONE_COUNT];
+		const unsigned int zone_count = get_zones(zones);
+		for (unsigned int i = 0; i < zone_count; i++) {
+			if (!zone_shortage(zones[i], ZONE_WMARK_LOW))
+				continue;
+			atomic_add_fetch(&reclaim_wakeups, 1);
+			const unsigned long freed = shrink_memory(zone_shortage(zones[i], ZONE_WMARK_HIGH), true);
+			atomic_add_fetch(&reclaim_background_pages, freed);
+		}
+	}
+
+	return 0;
+}
+
+static void reclaim_dump_stats(void) {
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	for (unsigned int i = 0; i < zone_count; i++) {
+		printk(PRINTK_INFO "mm: zone %s %ld/%lu pages free, watermarks min %lu, low %lu, high %lu\n",
+				zone_name(zones[i]), atomic_load(&zones[i]->free_pages), atomic_load(&zones[i]->managed_pages),
+				zones[i]->watermarks[ZONE_WMARK_MIN], zones[i]->watermarks[ZONE_WMARK_LOW],
+				zones[i]->watermarks[ZONE_WMARK_HIGH]);
+	}
+	printk(PRINTK_INFO "mm: reclaim background runs %lu (%lu pages), direct runs %lu (%lu pages)\n",
+			atomic_load(&reclaim_wakeups), atomic_load(&reclaim_background_pages),
+			atomic_load(&reclaim_direct_runs), atomic_load(&reclaim_direct_pages));
+	shrinker_dump_stats();
+}
+
+/*
+ * Compaction makes a free block of some order by moving the pages that are in use inside of an aligned block
+ * somewhere else. Only movable pages can be moved (see vm_migrate_page()), so blocks with anything else in them
+ * are skipped. The free pages of the block are taken out of the buddy allocator first, so the pages being moved
+ * can't land back inside of it.
+ */
+#define COMPACT_MIN_ORDER (PAGE_CACHE_MAX_ORDER + 1) /* Smaller blocks are mostly sitting in the page caches */
+#define COMPACT_MAX_ATTEMPTS 8 /* Blocks to try before giving up */
+#define COMPACT_BACKGROUND_ORDER 9 /* What the background thread tries to keep free (2 MiB) */
+#define COMPACT_BACKGROUND_THRESHOLD 500 /* Fragmentation index that wakes up the background thread */
+#define COMPACT_BACKGROUND_INTERVAL_US 5000000
+
+#define ULONG_BITS (sizeof(unsigned long) * 8)
+
+static MUTEX_DEFINE(compact_mtx);
+static SEMAPHORE_DEFINE(compact_sem, 0);
+static atomic(unsigned long) compact_runs = atomic_init(0);
+static atomic(unsigned long) compact_successes = atomic_init(0);
+static atomic(unsigned long) compact_failures = atomic_init(0);
+static atomic(unsigned long) compact_migrated = atomic_init(0);
+
+/* Count the pages of a block that have to be moved, returns -1 if there is something that can't be moved */
+static long compact_block_cost(physaddr_t base, unsigned int order) {
+	struct page* pages = &page_array[base >> PAGE_SHIFT];
+	long used = 0;
+	for (size_t i = 0; i < 1ul << order; i++) {
+		struct page* page = &pages[i];
+		if (page_flags(page) & (PAGE_FLAG_RESERVED | PAGE_FLAG_CMA | PAGE_FLAG_HUGETLB | PAGE_FLAG_SLAB) || page_head(page) != page)
+			return -1;
+		if (atomic_load(&page->refcnt) == 0)
+			continue;
+
+		/* Only a hint, vm_migrate_page() does the real checks */
+		if (page_order(page) != 0 || !page->mapping.mm)
+			return -1;
+		used++;
+	}
+	return used;
+}
+
+/* Give every page marked in the isolated bitmap back to the buddy allocator */
+static void compact_putback(struct mem_area* area, physaddr_t base, unsigned int order, const unsigned long* isolated) {
+	unsigned long irq_flags;
+	mem_area_lock(area, &irq_flags);
+	for (size_t i = 0; i < 1ul << order; i++) {
+		if (isolated[i / ULONG_BITS] & (1ul << (i % ULONG_BITS)))
+			bug(buddy->free(area, base + (i << PAGE_SHIFT), 0) != 0);
+	}
+	mem_area_unlock(area, &irq_flags);
+}
+
+static int compact_block(struct zone* zone, struct mem_area* area, physaddr_t base, unsigned int order) {
+	unsigned long isolated[(1ul << MAX_ORDER) / ULONG_BITS] = { 0 };
+	struct page* pages = &page_array[base >> PAGE_SHIFT];
+	const physaddr_t top = base + (PAGE_SIZE << order);
+
+	/* Take the free pages, this fails if any of them are in a page cache */
+	unsigned long irq_flags;
+	mem_area_lock(area, &irq_flags);
+	int err = 0;
+	for (size_t i = 0; i < 1ul << order; i++) {
+		if (atomic_load(&pages[i].refcnt) != 0)
+			continue;
+		err = buddy->reserve(area, base + (i << PAGE_SHIFT));
+		if (err)
+			break;
+		isolated[i / ULONG_BITS] |= 1ul << (i % ULONG_BITS);
+	}
+	mem_area_unlock(area, &irq_flags);
+	if (err) {
+		compact_putback(area, base, order, isolated);
+		return -EBUSY;
+	}
+
+	/* Now move everything else out */
+	unsigned long migrated = 0;
+	for (size_t i = 0; i < 1ul << order; i++) {
+		if (isolated[i / ULONG_BITS] & (1ul << (i % ULONG_BITS)))
+			continue;
+
+		struct page* new = alloc_pages_node(zone->zone_type, 0, area->node);
+		if (!new) {
+			err = -ENOMEM;
+			break;
+		}
+		const physaddr_t new_address = page_to_physaddr(new);
+		if (new_address >= base && new_address < top) {
+			/* Was freed after the block was isolated */
+			release_page(new);
+			err = -EBUSY;
+			break;
+		}
+
+		err = vm_migrate_page(&pages[i], new);
+		if (err) {
+			release_page(new);
+			break;
+		}
+
+		/* The old page wasn't freed, so it can go back with the isolated pages */
+		isolated[i / ULONG_BITS] |= 1ul << (i % ULONG_BITS);
+		migrated++;
+	}
+
+	compact_putback(area, base, order, isolated);
+	atomic_sub_fetch(&pages_in_use, migrated);
+	zone_account_free(zone, migrated);
+	atomic_add_fetch(&compact_migrated, migrated);
+	return err;
+}
+
+/* Try to make a free block of the order in a zone, only looking at the areas atomic allocations would use if atomic is set */
+static int compact_zone(struct zone* zone, unsigned int order, bool atomic) {
+	mutex_acquire(&compact_mtx);
+	atomic_add_fetch(&compact_runs, 1);
+
+	int err = -ENOENT;
+	unsigned int attempts = 0;
+	const long max_cost = 1l << (order - 1); /* Don't bother moving more than half of a block */
+	for (unsigned long i = 0; i < zone->area_count && attempts < COMPACT_MAX_ATTEMPTS; i++) {
+		struct mem_area* area = &zone->areas[i];
+		if (area->pages.atomic != atomic || order >= area->layer_count)
+			continue;
+		if (!atomic_load_explicit(&area->online, ATOMIC_ACQUIRE))
+			continue;
+		if (buddy->has_free(area, order)) {
+			err = 0;
+			break;
+		}
+
+		const physaddr_t end = area->base + area->real_size;
+		for (physaddr_t base = area->base; base + (PAGE_SIZE << order) <= end && attempts < COMPACT_MAX_ATTEMPTS;
+				base += PAGE_SIZE << order) {
+			const long cost = compact_block_cost(base, order);
+			if (cost <= 0 || cost > max_cost)
+				continue;
+
+			attempts++;
+			err = compact_block(zone, area, base, order);
+			if (err == 0 && buddy->has_free(area, order))
+				goto out;
+			if (err == -ENOMEM)
+				goto out;
+			err = -EBUSY;
+		}
+	}
+
+out:
+	mutex_release(&compact_mtx);
+	if (err == 0)
+		atomic_add_fetch(&compact_successes, 1);
+	else
+		atomic_add_fetch(&compact_failures, 1);
+	return err;
+}
+
+static int compact_thread(void* arg) {
+	(void)arg;
+	while (1) {
+		const int err = semaphore_wait_timed(&compact_sem, COMPACT_BACKGROUND_INTERVAL_US, 0);
+		if (unlikely(err && err != -ETIME))
+			continue;
+
+		struct zone* zones[MM_ZONE_COUNT];
+		const unsigned int zone_count = get_zones(zones);
+		for (unsigned int i = 0; i < zone_count; i++) {
+			if (zone_fragmentation_index(zones[i], COMPACT_BACKGROUND_ORDER) < COMPACT_BACKGROUND_THRESHOLD)
+				continue;
+			compact_zone(zones[i], COMPACT_BACKGROUND_ORDER, false);
+			compact_zone(zones[i], COMPACT_BACKGROUND_ORDER, true);
+		}
+	}
+
+	return 0;
+}
+
+static void compact_dump_stats(void) {
+	printk(PRINTK_INFO "mm: compaction runs %lu, successes %lu, failures %lu, pages migrated %lu\n",
+			atomic_load(&compact_runs), atomic_load(&compact_successes),
+			atomic_load(&compact_failures), atomic_load(&compact_migrated));
+
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	for (unsigned int i = 0; i < zone_count; i++) {
+		char buf[(MAX_ORDER + 1) * 6];
+		size_t len = 0;
+		for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+			len += snprintf(buf + len, sizeof(buf) - len, " %d", zone_fragmentation_index(zones[i], order));
+			if (len >= sizeof(buf))
+				break;
+		}
+		printk(PRINTK_INFO "mm: zone %s fragmentation index by order:%s\n", zone_name(zones[i]), buf);
+	}
+}
+
+static inline unsigned int latency_bucket(u64 cycles) {
+	const unsigned int shift = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	if (shift < MM_LATENCY_FIRST_SHIFT)
+		return 0;
+	const unsigned int bucket = shift - MM_LATENCY_FIRST_SHIFT + 1;
+	return bucket < MM_LATENCY_BUCKETS ? bucket : MM_LATENCY_BUCKETS - 1;
+}
+
+/* A NULL zone means the allocation failed */
+static void stats_record_alloc(const struct zone* requested, const struct zone* zone, unsigned int order,
+		unsigned int retries, u64 start) {
+	const unsigned int bucket = latency_bucket(arch_cycle_count() - start);
+	unsigned long irq_flags = local_irq_save();
+	struct mm_stats* stats = &current_cpu()->mm_stats;
+	if (zone) {
+		stats->allocs[zone_index(zone)][order]++;
+		if (zone != requested)
+			stats->fallbacks[zone_index(zone)]++;
+	} else {
+		stats->failures++;
+	}
+	stats->retries += retries;
+	stats->alloc_latency[order][bucket]++;
+	local_irq_restore(irq_flags);
+}
+
+/*
+ * alloc_pages_bulk() splits its blocks into single pages, which are freed one at a time, so they're
+ * counted as order 0 allocations like they would be by _alloc_pages(). The latency is split between them.
+ */
+static void stats_record_bulk_alloc(const struct zone* zone, unsigned long count, u64 start) {
+	const unsigned int bucket = latency_bucket((arch_cycle_count() - start) / count);
+	unsigned long irq_flags = local_irq_save();
+	struct mm_stats* stats = &current_cpu()->mm_stats;
+	stats->allocs[zone_index(zone)][0] += count;
+	stats->alloc_latency[0][bucket] += count;
+	local_irq_restore(irq_flags);
+}
+
+static void stats_record_free(const struct zone* zone, unsigned int order, u64 start) {
+	const unsigned int bucket = latency_bucket(arch_cycle_count() - start);
+	unsigned long irq_flags = local_irq_save();
+	struct mm_stats* stats = &current_cpu()->mm_stats;
+	stats->frees[zone_index(zone)][order]++;
+	stats->free_latency[order][bucket]++;
+	local_irq_restore(irq_flags);
+}
+
+static void stats_dump_latency(const char* what, unsigned int order, const unsigned long* buckets) {
+	char buf[MM_LATENCY_BUCKETS * 24];
+	size_t len = 0;
+	for (unsigned int i = 0; i < MM_LATENCY_BUCKETS && len < sizeof(buf); i++) {
+		if (!buckets[i])
+			continue;
+		if (i == MM_LATENCY_BUCKETS - 1)
+			len += snprintf(buf + len, sizeof(buf) - len, " >=%lu:%lu", 1ul << (MM_LATENCY_FIRST_SHIFT + i - 1), buckets[i]);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, " <%lu:%lu", 1ul << (MM_LATENCY_FIRST_SHIFT + i), buckets[i]);
+	}
+	if (len)
+		printk(PRINTK_INFO "mm: order %u %s cycles:%s\n", order, what, buf);
+}
+
+static void stats_dump(void) {
+	struct mm_stats* total = kzalloc(sizeof(*total), MM_ZONE_NORMAL);
+	if (!total) {
+		printk(PRINTK_ERR "mm: Not enough memory to print allocator statistics\n");
+		return;
+	}
+
+	struct smp_cpus cpus;
+	smp_cpus_read_acquire(&cpus);
+	for (u32 i = 0; i < cpus.count; i++) {
+		const unsigned long* from = (const unsigned long*)&cpus.cpus[i]->mm_stats;
+		unsigned long* to = (unsigned long*)total;
+		for (size_t j = 0; j < sizeof(*total) / sizeof(unsigned long); j++)
+			to[j] += from[j];
+	}
+	smp_cpus_read_release(&cpus);
+
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	for (unsigned int i = 0; i < zone_count; i++) {
+		const unsigned int z = zone_index(zones[i]);
+		for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+			if (total->allocs[z][order] || total->frees[z][order]) {
+				printk(PRINTK_INFO "mm: zone %s order %u: allocs %lu, frees %lu\n",
+						zone_name(zones[i]), order, total->allocs[z][order], total->frees[z][order]);
+			}
+		}
+	}
+	printk(PRINTK_INFO "mm: fallbacks to DMA32 %lu, fallbacks to DMA %lu, retries %lu, failures %lu\n",
+			total->fallbacks[__builtin_ctz(MM_ZONE_DMA32)], total->fallbacks[__builtin_ctz(MM_ZONE_DMA)],
+			total->retries, total->failures);
+
+	for (unsigned int order = 0; order <= MAX_ORDER; order++) {
+		stats_dump_latency("alloc", order, total->alloc_latency[order]);
+		stats_dump_latency("free", order, total->free_latency[order]);
+	}
+
+	kfree(total);
+}
+
+void mm_dump_areas(void) {
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	for (unsigned int i = 0; i < zone_count; i++) {
+		for (unsigned long j = 0; j < zones[i]->area_count; j++) {
+			struct mem_area* area = &zones[i]->areas[j];
+			char buf[(MAX_ORDER + 1) * 12];
+			size_t len = 0;
+			for (unsigned int order = 0; order < area->layer_count && len < sizeof(buf); order++)
+				len += snprintf(buf + len, sizeof(buf) - len, " %lu", buddy->free_count(area, order));
+
+			printk(PRINTK_INFO "mm: %s area %#lx-%#lx node %u%s, free blocks by order:%s, lock acquired %lu, contended %lu, waited %llu cycles\n",
+					zone_name(zones[i]), area->base, area->base + area->real_size, area->node,
+					atomic_load(&area->online) ? "" : " (offline)", buf,
+					area->lock_stats.acquired, area->lock_stats.contended, (unsigned long long)area->lock_stats.wait_cycles);
+		}
+	}
+}
+
+void mm_dump_stats(void) {
+	size_t total_page_count, free_page_count;
+	mm_get_free_pages(&total_page_count, &free_page_count);
+	printk(PRINTK_INFO "mm: %zu/%zu pages free\n", free_page_count, total_page_count);
+	stats_dump();
+	page_cache_dump_stats();
+	zero_pool_dump_stats();
+	compact_dump_stats();
+	reclaim_dump_stats();
+	cma_dump_stats();
+	hugepage_dump_stats();
+	slab_dump_stats();
+	tlb_dump_stats();
+	vmalloc_dump_stats();
+}
+
+static physaddr_t _alloc_pages(mm_t mm_flags, unsigned int order, int node) {
+	if (order > MAX_ORDER) {
+		dump_stack();
+		printk(PRINTK_ERR "mm: %s(mm_flags: %u, order: %u) failed: bad order\n", __func__, mm_flags, order);
+		return 0;
+	}
+	if (node == NUMA_NO_NODE) {
+		node = numa_node_id();
+	} else if (node < 0 || (unsigned int)node >= numa_node_count()) {
+		dump_stack();
+		printk(PRINTK_ERR "mm: %s(mm_flags: %u, order: %u) failed: bad node %d\n", __func__, mm_flags, order, node);
+		return 0;
+	}
+
+	if ((mm_flags & (MM_ZONE_NORMAL | MM_ZONE_DMA32 | MM_ZONE_DMA)) == 0)
+		mm_flags |= MM_ZONE_NORMAL;
+	struct zone* zone = get_zone_mm(mm_flags);
+	if (!zone) {
+		dump_stack();
+		printk(PRINTK_ERR "mm: %s(mm_flags: %u, order: %u) failed: bad flags\n", __func__, mm_flags, order);
+		return 0;
+	}
+
+	/* For atomic contexts, don't retry at all to avoid latency issues (unless MM_NOFAIL is set (bad idea)) */
+	const unsigned int max_retries = (mm_flags & MM_ATOMIC) ? 0 : 8;
+	unsigned int retries = max_retries;
+	unsigned int attempts = 0;
+	bool compacted = false, reclaimed = false;
+	const struct zone* const requested = zone;
+	const u64 start = arch_cycle_count();
+
+	/* What's below the min watermark is left for allocations that can't sleep */
+	if (!(mm_flags & MM_ATOMIC) && zone_shortage(zone, ZONE_WMARK_MIN))
+		reclaim_direct(zone, 1ul << order);
+
+	physaddr_t ret = 0;
+	do {
+		attempts++;
+		ret = zone_alloc_pages(zone, mm_flags, order, node);
+		if (ret) {
+			atomic_add_fetch(&pages_in_use, 1ul << order);
+			zone_account_alloc(zone, 1ul << order);
+			break;
+		}
+
+		/* Every zone it could fall back to is out, so try getting memory back before compacting */
+		if (retries == 0 && !reclaimed) {
+			reclaimed = true;
+			if (mm_flags & MM_ATOMIC) {
+				reclaim_wake();
+			} else if (reclaim_direct(get_zone_mm(mm_flags), 1ul << order)) {
+				zone = get_zone_mm(mm_flags);
+				retries = 1;
+				continue;
+			}
+		}
+
+		/* High order allocations can fail with plenty of memory free, so try making a block before giving up */
+		if (retries == 0 && !compacted && order >= COMPACT_MIN_ORDER) {
+			compacted = true;
+			if (mm_flags & MM_ATOMIC) {
+				semaphore_signal(&compact_sem);
+			} else if (compact_zone(get_zone_mm(mm_flags), order, false) == 0) {
+				zone = get_zone_mm(mm_flags);
+				retries = 1;
+				continue;
+			}
+		}
+		if (mm_flags & MM_NOFAIL && retries == 0) {
+			retries = 1;
+			if ((mm_flags & MM_ATOMIC) == 0) /* Having MM_ATOMIC set with MM_NOFAIL is dangerous, but legal */
+				out_of_memory();
+			continue;
+		}
+		if (retries < max_retries / 2) {
+			switch (zone->zone_type) {
+			case MM_ZONE_NORMAL:
+				zone = dma32_zone;
+				break;
+			case MM_ZONE_DMA32:
+				zone = &dma_zone;
+				break;
+			case MM_ZONE_DMA:
+				if (mm_flags & MM_ZONE_DMA32)
+					zone = dma32_zone;
+				else if (mm_flags & MM_ZONE_NORMAL)
+					zone = normal_zone;
+				break;
+			default:
+				bug("Invalid zone type");
+			}
+		}
+	} while (retries--);
+
+	stats_record_alloc(requested, ret ? zone : NULL, order, attempts - 1, start);
+	return ret;
+}
+
+static void _free_pages(physaddr_t addr, unsigned int order) {
+	const u64 start = arch_cycle_count();
+	struct zone* zone = NULL;
+	int err = -EINVAL;
 	if (order <= MAX_ORDER && addr % PAGE_SIZE == 0 && addr >= PAGE_SIZE) {
 		size_t alloc_size = PAGE_SIZE << order;
-		struct zone* zone = get_zone_addr(addr, alloc_size);
-		err = (zone) ? __free_pages(zone, addr, order) : -EFAULT;
+		zone = get_zone_addr(addr, alloc_size);
+		err = (zone) ? zone_free_pages(zone, addr, order) : -EFAULT;
 	}
 
 	if (err == 0) {
 		atomic_sub_fetch(&pages_in_use, 1ul << order);
+		zone_account_free(zone, 1ul << order);
+		stats_record_free(zone, order, start);
 	} else {
 		dump_stack();
 		printk(PRINTK_ERR "mm: %s(%#lx, %u) failed: %d\n", __func__, addr, order, err);
@@ -890,14 +1843,17 @@ static unsigned int get_layer_count(size_t size) {
 	return layers;
 }
 
-static void alloc_rounded_area(struct mem_area* area) {
-	unsigned long start_block = area->real_size >> PAGE_SHIFT;
-	unsigned long end_block = area->size >> PAGE_SHIFT;
-	for (unsigned long block = start_block; block < end_block; block++)
-		bug(_alloc_block(area, area->layer_count - 1, block) != 0);
+/* The bitmaps of the bitmap engine come from memblock, the free list engine doesn't have one */
+static unsigned long* area_bitmap_alloc(unsigned int layer_count) {
+	if (!buddy->uses_bitmap)
+		return NULL;
+	physaddr_t bitmap = memblock_alloc_raw(bitmap_size(layer_count), sizeof(unsigned long), 0, PHYSADDR_MAX);
+	if (unlikely(!bitmap))
+		out_of_memory();
+	return hhdm_virtual(bitmap);
 }
 
-/* All structures for this zone are statically allocated */
+/* The areas of this zone are statically allocated */
 static void dma_zone_init(physaddr_t last_usable) {
 	dma_zone.zone_type = MM_ZONE_DMA;
 	dma_zone.areas = dma_areas;
@@ -908,14 +1864,13 @@ static void dma_zone_init(physaddr_t last_usable) {
 
 		const size_t max_area_size = (1u << MAX_ORDER) * PAGE_SIZE;
 		area->base = dma_zone.area_count * max_area_size;
-		area->pages.free_list = dma_area_free_lists[dma_zone.area_count];
 		area->size = max_area_size;
 		area->real_size = rest < max_area_size ? rest : max_area_size;
 		area->layer_count = get_layer_count(max_area_size);
+		area->pages.free_list = area_bitmap_alloc(area->layer_count);
 		area->total_blocks = 1u << (area->layer_count - 1);
 		atomic_store_explicit(&area->alloc_refcnt, 0, ATOMIC_RELAXED);
-		for (unsigned int layer = 0; layer < area->layer_count; layer++)
-			atomic_store_explicit(&area->free_blocks[layer], 1ul << layer, ATOMIC_RELAXED);
+		atomic_store_explicit(&area->online, true, ATOMIC_RELAXED);
 
 		const unsigned long atomic_count = 1;
 		area->pages.atomic = dma_zone.area_count < atomic_count;
@@ -924,21 +1879,13 @@ static void dma_zone_init(physaddr_t last_usable) {
 		else
 			mutex_init(&area->pages.mutex);
 
-		if (area->size != area->real_size)
-			alloc_rounded_area(area);
-
+		buddy->init_area(area);
 		rest -= area->real_size;
 	}
-
-	/* Allocate the first page of memory, an error should never happen in this context */
-	bug(_alloc_block(&dma_areas[0], dma_areas[0].layer_count - 1, 0) != 0);
 }
 
-/* 
- * Initialize a memory area, free_list_zone is the zone the free list should be allocated from,
- * so this function can be used when not every zone is initialized yet.
- */
-static int init_area(struct mem_area* area, physaddr_t base, size_t real_size, bool atomic, struct zone* alloc_zone) {
+/* Initialize a memory area, nothing in it is free until zones_init() or a page init job frees it */
+static int init_area(struct mem_area* area, physaddr_t base, size_t real_size, bool atomic) {
 	u64 rounded_size = roundup_pow2_minimum(PAGE_SIZE, real_size);
 	bug(rounded_size == 0);
 
@@ -946,49 +1893,37 @@ static int init_area(struct mem_area* area, physaddr_t base, size_t real_size, b
 	if (layer_count == 1)
 		return -ELOOP;
 
-	size_t free_list_size = ((1 << layer_count) >> 3) + 1;
-	unsigned int order = get_order(free_list_size);
-	physaddr_t free_list = __alloc_pages(alloc_zone, 0, order);
-	if (!free_list) {
-		free_list = __alloc_pages(alloc_zone, MM_ATOMIC, order);
-		if (!free_list)
-			return -ENOMEM;
-	}
-
+	area->pages.free_list = area_bitmap_alloc(layer_count);
 	area->base = base;
 	area->real_size = real_size;
 	area->size = rounded_size;
 	area->layer_count = layer_count;
 	area->total_blocks = 1 << (layer_count - 1);
-	for (unsigned long layer = 0; layer < area->layer_count; layer++)
-		atomic_store_explicit(&area->free_blocks[layer], 1ul << layer, ATOMIC_RELAXED);
-	area->pages.free_list = hhdm_virtual(free_list);
 	area->pages.atomic = atomic;
 	if (atomic)
 		spinlock_init(&area->pages.spinlock);
 	else
 		mutex_init(&area->pages.mutex);
-	memset(area->pages.free_list, 0, free_list_size);
 	atomic_store_explicit(&area->alloc_refcnt, 0, ATOMIC_RELAXED);
 
-	if (rounded_size != real_size)
-		alloc_rounded_area(area);
+	buddy->init_area(area);
+
+	/* The struct pages of deferred areas aren't initialized yet, see page_init_run_job() */
+	atomic_store_explicit(&area->online, (base >> PAGE_SHIFT) < page_deferred_pfn, ATOMIC_RELAXED);
 	return 0;
 }
 
-/* Initialize a memory zone, alloc_zone is the zone to allocate the memory structures from */
-static int zone_init(struct zone* zone, mm_t zone_type,
-		physaddr_t last_usable, physaddr_t min_start, physaddr_t max_end,
-		struct zone* alloc_zone) {
+/* Initialize a memory zone, the areas are allocated from memblock */
+static int zone_init(struct zone* zone, mm_t zone_type, physaddr_t last_usable, physaddr_t min_start, physaddr_t max_end) {
 	if (last_usable < min_start)
 		return -ELOOP;
 	if (last_usable < max_end)
 		max_end = last_usable;
 
-	struct zone* const original_alloc_zone = alloc_zone;
-
-	/* First allocate the array of areas for the zone */
+	/* First allocate the array of areas for the zone, a single page can't be an area */
 	size_t zone_size = max_end - min_start;
+	if (zone_size <= PAGE_SIZE)
+		return -ELOOP;
 	const size_t max_area_size = PAGE_SIZE << (MAX_ORDER);
 	unsigned long area_count = zone_size / max_area_size;
 	if (unlikely(area_count == 0))
@@ -996,13 +1931,9 @@ static int zone_init(struct zone* zone, mm_t zone_type,
 	unsigned long atomic_count = (area_count * 5 + 99) / 100;
 	if (atomic_count == 0)
 		atomic_count = 1;
-	unsigned int area_order = get_order(sizeof(struct mem_area) * area_count);
-	physaddr_t _areas = __alloc_pages(original_alloc_zone, 0, area_order);
-	if (unlikely(!_areas)) {
-		_areas = __alloc_pages(original_alloc_zone, MM_ATOMIC, area_order);
-		if (unlikely(!_areas))
-			return -ENOMEM;
-	}
+	physaddr_t _areas = memblock_alloc(sizeof(struct mem_area) * area_count, _Alignof(struct mem_area), 0, PHYSADDR_MAX);
+	if (unlikely(!_areas))
+		return -ENOMEM;
 
 	struct mem_area* areas = hhdm_virtual(_areas);
 	size_t rest = zone_size;
@@ -1010,63 +1941,20 @@ static int zone_init(struct zone* zone, mm_t zone_type,
 	zone->areas = areas;
 	for (zone->area_count = 0; zone->area_count < area_count; zone->area_count++) {
 		size_t area_size = rest > max_area_size ? max_area_size : rest;
-		int err = init_area(&areas[zone->area_count], min_start, area_size, zone->area_count < atomic_count, alloc_zone);
-
-		if (likely(err == 0)) {
-			min_start += area_size;
-			rest -= area_size;
-			alloc_zone = zone; /* At least one area, so an attempt can be made at using the current zone */
-			continue;
-		} else if (unlikely(err == -ELOOP)) {
-			if (unlikely(--area_count == 0)) /* Don't bother with the zone */
-				__free_pages(original_alloc_zone, _areas, area_order);
-			else
-				break; /* Able to create at least one zone, so it's still usable */
-		} else if (err == -ENOMEM && zone == alloc_zone) {
-			alloc_zone = original_alloc_zone; /* Swap back to the original zone, and try the allocation there */
-			zone->area_count--;
-			continue;
+		int err = init_area(&areas[zone->area_count], min_start, area_size, zone->area_count < atomic_count);
+		if (unlikely(err)) {
+			if (err == -ELOOP && zone->area_count)
+				break; /* Able to create at least one area, so it's still usable */
+			return err;
 		}
 
-		return err;
+		min_start += area_size;
+		rest -= area_size;
 	}
 
 	return 0;
 }
 
-static inline void reserve_pages(physaddr_t addr, size_t size) {
-	int errdma = __reserve_pages(&dma_zone, addr, size);
-	int errdma32 = __reserve_pages(dma32_zone, addr, size);
-	int errnormal = __reserve_pages(normal_zone, addr, size);
-	if (unlikely(errdma || errdma32 || errnormal)) {
-		printk(PRINTK_ERR "mm: Failed to reserve region %#16lx: dma: %i, dma32: %i, normal: %i\n",
-				addr, errdma, errdma32, errnormal);
-	}
-}
-
-static void reserve_unusable_memory(physaddr_t last_ram) {
-	size_t page_count = (last_ram + 1) >> PAGE_SHIFT;
-	physaddr_t address = 0;
-	while (page_count) {
-		const struct limine_mmap_entry* entry = mmap_get_entry_from_page(address);
-		size_t size = PAGE_SIZE;
-		bool usable = false;
-		if (entry) {
-			size = entry->length;
-			bug((size & (PAGE_SIZE - 1)) != 0);
-			usable = mmap_entry_usable_strict(entry);
-		}
-		if (!usable)
-			reserve_pages(address, size);
-
-		address += size;
-		bug(__builtin_sub_overflow(page_count, size >> PAGE_SHIFT, &page_count));
-	}
-}
-
-static struct page* page_array;
-static size_t page_count;
-
 static inline size_t get_pfn_from_address(physaddr_t address) {
 	size_t ret = address >> PAGE_SHIFT;
 	return (ret >= page_count) ? SIZE_MAX : ret;
@@ -1085,9 +1973,215 @@ static inline int get_address_from_pfn(size_t pfn, physaddr_t* out) {
 	return 0;
 }
 
-/* To pair page_head(), but not accessable outside of this file */
-static inline struct page* page_head_set(struct page* page, struct page* head) {
-	return atomic_exchange(&page->buddy.head, head);
+/* To pair page_head(), but not accessable outside of this file, returns the old offset */
+static inline u32 page_head_set(struct page* page, u32 offset) {
+	return atomic_exchange(&page->head, offset);
+}
+
+/* The node isn't known yet, it's filled in by zones_numa_init() or the page init job */
+static inline void page_init(struct page* page, unsigned int flags) {
+	const physaddr_t address = (physaddr_t)(page - page_array) << PAGE_SHIFT;
+	const unsigned int zindex = address < DMA32_START ? 0 : address < DMA32_END ? 1 : 2;
+	atomic_store(&page->info, flags | (zindex << PAGE_ZONE_SHIFT));
+	page_head_set(page, 0);
+	atomic_store(&page->refcnt, 0);
+	page->mapping.mm = NULL;
+	page->mapping.virtual = 0;
+}
+
+static void page_init_free_range(physaddr_t base, physaddr_t end, void* arg) {
+	size_t* pfn = arg;
+	for (; *pfn < base >> PAGE_SHIFT; (*pfn)++)
+		page_init(&page_array[*pfn], PAGE_FLAG_RESERVED);
+	for (; *pfn < end >> PAGE_SHIFT; (*pfn)++)
+		page_init(&page_array[*pfn], 0);
+}
+
+/* Initialize the struct pages in [first, end), only pages that memblock has free are usable */
+static void page_array_init_range(size_t first, size_t end) {
+	size_t pfn = first;
+	memblock_for_each_free((physaddr_t)first << PAGE_SHIFT, (physaddr_t)end << PAGE_SHIFT, page_init_free_range, &pfn);
+	for (; pfn < end; pfn++)
+		page_init(&page_array[pfn], PAGE_FLAG_RESERVED);
+}
+
+/* Give a free range to an area, in the largest naturally aligned blocks that fit */
+static void area_free_range(struct zone* zone, struct mem_area* area, physaddr_t base, physaddr_t end) {
+	const unsigned int max_order = area->layer_count - 1;
+	unsigned long freed = 0;
+	while (base < end) {
+		const unsigned long index = (base - area->base) >> PAGE_SHIFT;
+		const unsigned long pages = (end - base) >> PAGE_SHIFT;
+		unsigned int order = index ? (unsigned int)__builtin_ctzl(index) : max_order;
+		if (order > max_order)
+			order = max_order;
+		while ((1ul << order) > pages)
+			order--;
+
+		int err = buddy->free(area, base, order);
+		if (unlikely(err))
+			printk(PRINTK_WARN "mm: Failed to free %#lx (order %u) to the buddy allocator: %i\n", base, order, err);
+		else
+			freed += 1ul << order;
+		base += PAGE_SIZE << order;
+	}
+
+	atomic_add_fetch(&zone->managed_pages, freed);
+	zone_account_free(zone, freed);
+}
+
+static inline physaddr_t area_end(const struct mem_area* area) {
+	return area->base + ROUND_DOWN(area->real_size, PAGE_SIZE);
+}
+
+/* Copy the node of an area into its struct pages, the area has to be locked so the node can't change under it */
+static void area_set_page_nodes(struct mem_area* area) {
+	const size_t first = area->base >> PAGE_SHIFT;
+	const size_t end = area_end(area) >> PAGE_SHIFT;
+	for (size_t pfn = first; pfn < end; pfn++)
+		page_info_update(&page_array[pfn], PAGE_NODE_MASK, area->node << PAGE_NODE_SHIFT);
+}
+
+/*
+ * Struct pages above mm.page_init_eager (in MiB) aren't initialized by zones_init(). Their memory is split into
+ * jobs, and the areas of a job stay offline until the job has initialized the pages and given the areas to the
+ * buddy allocator. Jobs below mm.page_init_boot are run by the AP's in parallel while they boot, the rest is
+ * done in the background by a minimum priority thread. If get_page_from_address() wants a page that isn't
+ * initialized yet, it runs the job itself.
+ */
+#define PAGE_INIT_MAX_JOBS 1024
+#define PAGE_INIT_JOB_SIZE (1ul << 30) /* Grows if there would be more than PAGE_INIT_MAX_JOBS jobs */
+#define PAGE_INIT_DEFAULT_EAGER_MIB 4096
+#define PAGE_INIT_DEFAULT_BOOT_MIB 65536
+
+enum page_init_state {
+	PAGE_INIT_PENDING,
+	PAGE_INIT_RUNNING,
+	PAGE_INIT_DONE
+};
+
+enum page_init_runner {
+	PAGE_INIT_BY_AP,
+	PAGE_INIT_BY_THREAD,
+	PAGE_INIT_ON_DEMAND,
+	PAGE_INIT_RUNNER_COUNT
+};
+
+struct page_init_job {
+	size_t first_pfn, end_pfn;
+	unsigned long first_area, area_count; /* The areas of the normal zone the job brings online */
+	atomic(int) state;
+};
+
+static struct page_init_job page_init_jobs[PAGE_INIT_MAX_JOBS];
+static size_t page_init_job_count = 0;
+static size_t page_init_boot_jobs = 0; /* The first jobs, which are run by the AP's while booting */
+static size_t page_init_job_pages = 0; /* Pages in every job, the last one can be smaller */
+static atomic(size_t) page_init_left = atomic_init(0);
+static atomic(unsigned long) page_init_runs[PAGE_INIT_RUNNER_COUNT];
+
+static void page_init_free_area(physaddr_t base, physaddr_t end, void* arg) {
+	area_free_range(normal_zone, arg, base, end);
+}
+
+static void page_init_run_job(struct page_init_job* job) {
+	page_array_init_range(job->first_pfn, job->end_pfn);
+
+	/* Nothing else touches an area until it's online, so it only has to be locked against zones_numa_init() */
+	for (unsigned long i = 0; i < job->area_count; i++) {
+		struct mem_area* area = &normal_zone->areas[job->first_area + i];
+		memblock_for_each_free(area->base, area_end(area), page_init_free_area, area);
+
+		unsigned long irq_flags;
+		mem_area_lock(area, &irq_flags);
+		area_set_page_nodes(area);
+		atomic_store_explicit(&area->online, true, ATOMIC_RELEASE);
+		mem_area_unlock(area, &irq_flags);
+	}
+	zone_set_watermarks(normal_zone);
+}
+
+/* Returns false if the job was already taken by someone else */
+static bool page_init_try_run(struct page_init_job* job, enum page_init_runner runner) {
+	int expected = PAGE_INIT_PENDING;
+	if (!atomic_compare_exchange_strong(&job->state, &expected, PAGE_INIT_RUNNING))
+		return false;
+
+	page_init_run_job(job);
+	atomic_store_explicit(&job->state, PAGE_INIT_DONE, ATOMIC_RELEASE);
+	atomic_add_fetch(&page_init_runs[runner], 1);
+
+	if (atomic_sub_fetch(&page_init_left, 1) == 0) {
+		printk(PRINTK_INFO "mm: Deferred struct pages initialized %lld ms after boot (jobs: %lu by AP's, %lu in the background, %lu on demand)\n",
+				(long long)(timespec_ns(time_fromboot()) / 1000000),
+				atomic_load(&page_init_runs[PAGE_INIT_BY_AP]),
+				atomic_load(&page_init_runs[PAGE_INIT_BY_THREAD]),
+				atomic_load(&page_init_runs[PAGE_INIT_ON_DEMAND]));
+	}
+	return true;
+}
+
+/* Make sure the struct page of a deferred pfn is initialized */
+static void page_init_wait(size_t pfn) {
+	struct page_init_job* job = &page_init_jobs[(pfn - page_deferred_pfn) / page_init_job_pages];
+	if (atomic_load_explicit(&job->state, ATOMIC_ACQUIRE) == PAGE_INIT_DONE)
+		return;
+	if (page_init_try_run(job, PAGE_INIT_ON_DEMAND))
+		return;
+	while (atomic_load_explicit(&job->state, ATOMIC_ACQUIRE) != PAGE_INIT_DONE)
+		arch_cpu_relax();
+}
+
+/* Command line values are in MiB, returns a pfn */
+static size_t page_init_cmdline_pfn(const char* arg, unsigned long long def) {
+	char str[24];
+	unsigned long long mib = def;
+	if (cmdline_get_early(arg, str, sizeof(str)) == 0 && kstrtoull(str, 0, &mib)) {
+		printk(PRINTK_ERR "mm: Invalid value for %s: %s\n", arg, str);
+		mib = def;
+	}
+	if (mib > (PHYSADDR_MAX >> 20))
+		mib = PHYSADDR_MAX >> 20;
+	return mib << (20 - PAGE_SHIFT);
+}
+
+/* Split the deferred pages into jobs, needs the normal zone to be initialized */
+static void page_init_jobs_create(void) {
+	if (page_deferred_pfn == SIZE_MAX)
+		return;
+	if (unlikely(normal_zone != &__normal_zone)) {
+		page_deferred_pfn = SIZE_MAX;
+		return;
+	}
+
+	const size_t area_pages = 1ul << MAX_ORDER;
+	const size_t deferred = page_count - page_deferred_pfn;
+	size_t job_pages = PAGE_INIT_JOB_SIZE >> PAGE_SHIFT;
+	if (deferred / job_pages >= PAGE_INIT_MAX_JOBS)
+		job_pages = ROUND_UP(deferred / PAGE_INIT_MAX_JOBS + 1, area_pages);
+
+	const size_t boot_pfn = page_init_cmdline_pfn("mm.page_init_boot", PAGE_INIT_DEFAULT_BOOT_MIB);
+	const unsigned long first_area = ((page_deferred_pfn << PAGE_SHIFT) - NORMAL_START) >> (PAGE_SHIFT + MAX_ORDER);
+	for (size_t pfn = page_deferred_pfn; pfn < page_count; pfn += job_pages) {
+		struct page_init_job* job = &page_init_jobs[page_init_job_count++];
+		job->first_pfn = pfn;
+		job->end_pfn = page_count - pfn > job_pages ? pfn + job_pages : page_count;
+		job->first_area = first_area + (pfn - page_deferred_pfn) / area_pages;
+		job->area_count = 0;
+		if (job->first_area < normal_zone->area_count) {
+			job->area_count = job_pages / area_pages;
+			if (job->area_count > normal_zone->area_count - job->first_area)
+				job->area_count = normal_zone->area_count - job->first_area;
+		}
+		atomic_store_explicit(&job->state, PAGE_INIT_PENDING, ATOMIC_RELAXED);
+		if (pfn < boot_pfn)
+			page_init_boot_jobs++;
+	}
+
+	page_init_job_pages = job_pages;
+	atomic_store_explicit(&page_init_left, page_init_job_count, ATOMIC_RELEASE);
+	printk(PRINTK_INFO "mm: %zu struct pages deferred into %zu jobs, %zu run while booting\n",
+			deferred, page_init_job_count, page_init_boot_jobs);
 }
 
 int get_page_from_address(physaddr_t address, struct page** page) {
@@ -1096,10 +2190,12 @@ int get_page_from_address(physaddr_t address, struct page** page) {
 		return -ENOMEM;
 	if (pfn == 0)
 		return -EACCES;
+	if (unlikely(pfn >= page_deferred_pfn) && atomic_load_explicit(&page_init_left, ATOMIC_ACQUIRE))
+		page_init_wait(pfn);
 
 	struct page* _page = &page_array[pfn];
 	int err = 0;
-	if (mmap_region_is_usable_strict(address, PAGE_SIZE))
+	if (!(page_flags(_page) & PAGE_FLAG_RESERVED))
 		err = try_hold_page(_page) ? 0 : -EACCES;
 	else
 		hold_page(_page);
@@ -1109,23 +2205,120 @@ int get_page_from_address(physaddr_t address, struct page** page) {
 	return err;
 }
 
-struct page* alloc_pages(mm_t mm_flags, unsigned int order) {
-	physaddr_t address = _alloc_pages(mm_flags, order);
-	if (!address)
+struct page* physaddr_to_page(physaddr_t address) {
+	size_t pfn = get_pfn_from_address(address);
+	if (pfn == SIZE_MAX)
 		return NULL;
+	if (unlikely(pfn >= page_deferred_pfn) && atomic_load_explicit(&page_init_left, ATOMIC_ACQUIRE))
+		page_init_wait(pfn);
+	return &page_array[pfn];
+}
 
+void mm_account_pages(long count) {
+	if (count < 0)
+		atomic_sub_fetch(&pages_in_use, -count);
+	else
+		atomic_add_fetch(&pages_in_use, count);
+}
+
+/*
+ * Set up the page structs for a block that was just allocated, and hold it. The mapping shares space
+ * with the free list links, so it has to be cleared here.
+ */
+static struct page* page_from_block(physaddr_t address, unsigned int order) {
 	size_t pfn = get_pfn_from_address(address);
 	struct page* page = &page_array[pfn];
-	for (size_t i = 1; i < 1ul << order; i++) {
-		bug(page_head_set(&page[i], page) != &page[i]);
+	for (size_t i = 0; i < 1ul << order; i++) {
+		bug(page_head_set(&page[i], i) != 0);
 		bug(atomic_load(&page[i].refcnt) != 0);
+		page[i].mapping.mm = NULL;
+		page[i].mapping.virtual = 0;
 	}
-	bug(atomic_exchange(&page->buddy.order, order) != 0);
+	bug(page_info_update(page, PAGE_ORDER_MASK, order << PAGE_ORDER_SHIFT) & PAGE_ORDER_MASK);
 
 	hold_page(page);
 	return page;
 }
 
+struct page* alloc_pages_node(mm_t mm_flags, unsigned int order, int node) {
+	/* Movable pages can borrow from the contiguous memory region while it isn't needed */
+	struct page* page;
+	if (mm_flags & MM_MOVABLE && order == 0 && cma_alloc_movable(mm_flags, 1, &page))
+		return page;
+
+	/* Pages in the zeroed pool can come from any zone or node */
+	if (mm_flags & MM_ZERO && order == 0 && (mm_flags & (MM_ZONE_DMA | MM_ZONE_DMA32)) == 0 && node == NUMA_NO_NODE) {
+		page = zero_pool_take();
+		if (page)
+			return page;
+	}
+
+	physaddr_t address = _alloc_pages(mm_flags, order, node);
+	if (!address)
+		return NULL;
+	if (mm_flags & MM_ZERO)
+		memset(hhdm_virtual(address), 0, PAGE_SIZE << order);
+	return page_from_block(address, order);
+}
+
+#define BULK_BATCH_COUNT 16
+
+size_t alloc_pages_bulk(mm_t mm_flags, size_t count, struct page** out) {
+	if ((mm_flags & (MM_ZONE_NORMAL | MM_ZONE_DMA32 | MM_ZONE_DMA)) == 0)
+		mm_flags |= MM_ZONE_NORMAL;
+	struct zone* zone = get_zone_mm(mm_flags);
+	if (!zone) {
+		dump_stack();
+		printk(PRINTK_ERR "mm: %s(mm_flags: %u, count: %zu) failed: bad flags\n", __func__, mm_flags, count);
+		return 0;
+	}
+
+	const int node = numa_node_id();
+	size_t filled = mm_flags & MM_MOVABLE ? cma_alloc_movable(mm_flags, count, out) : 0;
+	unsigned int order = MAX_ORDER;
+	while (filled < count) {
+		const size_t left = count - filled;
+		const unsigned int max_order = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(left);
+		if (order > max_order)
+			order = max_order;
+
+		/* Single pages go through the per-CPU cache, and get the zone fallback and MM_NOFAIL handling */
+		if (order == 0) {
+			physaddr_t address = _alloc_pages(mm_flags, 0, node);
+			if (!address)
+				break;
+			if (mm_flags & MM_ZERO)
+				memset(hhdm_virtual(address), 0, PAGE_SIZE);
+			out[filled++] = page_from_block(address, 0);
+			continue;
+		}
+
+		/* Take as many blocks as possible from each area, and split them into single pages */
+		physaddr_t blocks[BULK_BATCH_COUNT];
+		size_t want = left >> order;
+		if (want > ARRAY_SIZE(blocks))
+			want = ARRAY_SIZE(blocks);
+		const u64 start = arch_cycle_count();
+		size_t got = __alloc_pages_batch(zone, mm_flags, order, node, blocks, want);
+		if (got == 0) {
+			order--;
+			continue;
+		}
+
+		atomic_add_fetch(&pages_in_use, got << order);
+		zone_account_alloc(zone, got << order);
+		stats_record_bulk_alloc(zone, got << order, start);
+		for (size_t i = 0; i < got; i++) {
+			if (mm_flags & MM_ZERO)
+				memset(hhdm_virtual(blocks[i]), 0, PAGE_SIZE << order);
+			for (size_t j = 0; j < 1ul << order; j++)
+				out[filled++] = page_from_block(blocks[i] + (j << PAGE_SHIFT), 0);
+		}
+	}
+
+	return filled;
+}
+
 void* page_hhdm_virtual(const struct page* page) {
 	void* ret = NULL;
 	size_t pfn = get_pfn_from_page(page);
@@ -1145,15 +2338,24 @@ static void page_inactive(struct page* page) {
 	size_t pfn = get_pfn_from_page(page);
 	if (pfn == SIZE_MAX)
 		return;
+	const unsigned int flags = page_flags(page);
+	if (flags & PAGE_FLAG_RESERVED)
+		return;
+	if (flags & PAGE_FLAG_CMA) {
+		cma_release_page(page);
+		return;
+	}
+	if (flags & PAGE_FLAG_HUGETLB) {
+		hugepage_free(page);
+		return;
+	}
 	physaddr_t address;
 	bug(get_address_from_pfn(pfn, &address) != 0);
-	if (!mmap_region_is_usable_strict(address, PAGE_SIZE))
-		return;
 
-	/* Make all the page's head pointers point to itself */
-	unsigned int order = atomic_exchange(&page->buddy.order, 0);
+	/* Make every page of the block its own head again */
+	unsigned int order = (page_info_update(page, PAGE_ORDER_MASK, 0) & PAGE_ORDER_MASK) >> PAGE_ORDER_SHIFT;
 	for (size_t i = 1; i < 1ul << order; i++)
-		page_head_set(&page[i], &page[i]);
+		page_head_set(&page[i], 0);
 
 	_free_pages(address, order);
 }
@@ -1165,7 +2367,7 @@ void hold_page(struct page* page) {
 
 bool try_hold_page(struct page* page) {
 	page = page_head(page);
-	long refcnt = atomic_load(&page->refcnt);
+	i32 refcnt = atomic_load(&page->refcnt);
 	do {
 		if (refcnt <= 0)
 			return false;
@@ -1175,33 +2377,91 @@ bool try_hold_page(struct page* page) {
 
 void release_page(struct page* page) {
 	page = page_head(page);
-	long refcnt = atomic_sub_fetch(&page->refcnt, 1);
+	i32 refcnt = atomic_sub_fetch(&page->refcnt, 1);
 	bug(refcnt < 0);
 	if (refcnt == 0)
 		page_inactive(page);
 }
 
+/*
+ * The pages below mm.page_init_eager are initialized by zones_init() once everything is allocated from memblock,
+ * see page_init_jobs_create() for the rest
+ */
 static void create_page_array(physaddr_t last_ram) {
 	page_count = (last_ram + 1) >> PAGE_SHIFT;
-	page_array = hhdm_virtual(mmap_alloc(page_count * sizeof(*page_array)));
-	if (!page_array)
+	physaddr_t phys = memblock_alloc_raw(page_count * sizeof(*page_array), PAGE_SIZE, 0, PHYSADDR_MAX);
+	if (!phys)
 		out_of_memory();
+	page_array = hhdm_virtual(phys);
+
+	/* The DMA32 zone is never deferred, and deferring starts on an area boundary so every area has one owner */
+	size_t eager = page_init_cmdline_pfn("mm.page_init_eager", PAGE_INIT_DEFAULT_EAGER_MIB);
+	if (eager < (NORMAL_START >> PAGE_SHIFT))
+		eager = NORMAL_START >> PAGE_SHIFT;
+	eager = ROUND_UP(eager, 1ul << MAX_ORDER);
+	if (eager < page_count)
+		page_deferred_pfn = eager;
+}
 
+/*
+ * Make sure the usability precomputed into the page array matches the memory map and memblock. This looks up
+ * the entry of every page on its own, so it doesn't share any code with page_array_init_range(). Only the pages
+ * below end are checked, so deferred pages aren't touched.
+ */
+static void page_array_self_check(size_t end) {
+	size_t mismatches = 0;
 	const struct limine_mmap_entry* entry = NULL;
-	for (size_t i = 0; i < page_count; i++) {
-		if (!entry || !mmap_entry_check(entry, PAGE_SIZE * i, PAGE_SIZE))
-			entry = mmap_get_entry_from_page(PAGE_SIZE * i);
+	for (size_t pfn = 0; pfn < end; pfn++) {
+		if (!entry || !mmap_entry_check(entry, pfn << PAGE_SHIFT, PAGE_SIZE))
+			entry = mmap_get_entry_from_page(pfn << PAGE_SHIFT);
+
+		const bool usable = entry && mmap_entry_usable_strict(entry) && !memblock_is_reserved(pfn << PAGE_SHIFT, PAGE_SIZE);
+		const unsigned int expected = usable ? 0 : PAGE_FLAG_RESERVED;
+		mismatches += (page_flags(&page_array[pfn]) & PAGE_FLAG_RESERVED) != expected;
+	}
+
+	if (unlikely(mismatches))
+		panic("%zu pages disagree with the memory map", mismatches);
+}
+
+/* Give a free range to the areas of every zone it's in, pages that aren't in any area are left alone */
+static void zones_free_range(physaddr_t base, physaddr_t end, void* arg) {
+	(void)arg;
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	while (base < end) {
+		struct mem_area* area = NULL;
+		struct zone* zone = NULL;
+		for (unsigned int i = 0; i < zone_count && !area; i++) {
+			zone = zones[i];
+			area = get_mem_area(zone, base);
+		}
+		if (unlikely(!area || base >= area_end(area))) {
+			base += PAGE_SIZE;
+			continue;
+		}
 
-		struct page* page = &page_array[i];
-		if (!entry || !mmap_entry_usable_strict(entry))
-			page->flags |= PAGE_FLAG_RESERVED;
-		page_head_set(page, page);
-		atomic_store(&page->buddy.order, 0);
-		atomic_store(&page->refcnt, 0);
+		const physaddr_t stop = end < area_end(area) ? end : area_end(area);
+		area_free_range(zone, area, base, stop);
+		base = stop;
 	}
 }
 
+static void select_buddy_engine(void) {
+	char name[16];
+	if (cmdline_get_early("mm.buddy_engine", name, sizeof(name)) == 0) {
+		if (strcmp(name, bitmap_engine.name) == 0)
+			buddy = &bitmap_engine;
+		else if (strcmp(name, lists_engine.name) == 0)
+			buddy = &lists_engine;
+		else
+			printk(PRINTK_ERR "mm: Unknown buddy engine %s\n", name);
+	}
+	printk(PRINTK_INFO "mm: Using %s buddy engine\n", buddy->name);
+}
+
 static void zones_init(void) {
+	const u64 start = arch_cycle_count();
 	struct limine_mmap_response* response = mmap_request.response;
 	if (unlikely(!response || response->entry_count == 0))
 		panic("Where the fuck is the memory map");
@@ -1218,13 +2478,20 @@ static void zones_init(void) {
 		printk(PRINTK_INFO "mm: %#lx-%#lx: %s\n", base, base + entry->length, mmap_entry_type_to_string(entry->type));
 	}
 
+	for (size_t i = 0; i < sanitized_mmap.entry_count; i++) {
+		struct limine_mmap_entry* entry = &sanitized_mmap.entries[i];
+		if (mmap_entry_usable_strict(entry) && memblock_add(entry->base, entry->length))
+			panic("Failed to add %#lx-%#lx to memblock", entry->base, entry->base + entry->length);
+	}
+
 	mem_total = mmap_total_usable();
 	physaddr_t last_address = mmap_get_last_ram_address_inclusive();
+	select_buddy_engine();
 	create_page_array(last_address);
 
 	dma_zone_init(last_address);
 
-	int err = zone_init(&__dma32_zone, MM_ZONE_DMA32, last_address, DMA32_START, DMA32_END, &dma_zone);
+	int err = zone_init(&__dma32_zone, MM_ZONE_DMA32, last_address, DMA32_START, DMA32_END);
 	if (unlikely(err)) {
 		if (unlikely(err == -ELOOP)) {
 			dma32_zone = &dma_zone;
@@ -1235,7 +2502,7 @@ static void zones_init(void) {
 	}
 	dma32_zone = &__dma32_zone;
 
-	err = zone_init(&__normal_zone, MM_ZONE_NORMAL, last_address, NORMAL_START, NORMAL_END, dma32_zone);
+	err = zone_init(&__normal_zone, MM_ZONE_NORMAL, last_address, NORMAL_START, NORMAL_END);
 	if (err) {
 		if (likely(err == -ELOOP)) {
 			normal_zone = dma32_zone;
@@ -1250,8 +2517,146 @@ out:
 		printk(PRINTK_DBG "mm: DMA32 linked to DMA\n");
 	else if (dma32_zone == normal_zone)
 		printk(PRINTK_DBG "mm: Normal linked to DMA32\n");
-	reserve_unusable_memory(last_address);
+	page_init_jobs_create();
+
+	/* The page init jobs would overwrite the flags of a region in deferred memory */
+	const size_t initialized = page_deferred_pfn < page_count ? page_deferred_pfn : page_count;
+	hugepage_reserve((physaddr_t)initialized << PAGE_SHIFT);
+	cma_reserve((physaddr_t)initialized << PAGE_SHIFT);
+
+	/* Nothing else comes from memblock, so everything it has free can go to the buddy allocator */
+	memblock_freeze();
+	page_array_init_range(0, initialized);
+	memblock_for_each_free(0, (physaddr_t)initialized << PAGE_SHIFT, zones_free_range, NULL);
+	struct zone* zones[MM_ZONE_COUNT];
+	const unsigned int zone_count = get_zones(zones);
+	for (unsigned int i = 0; i < zone_count; i++)
+		zone_set_watermarks(zones[i]);
+	page_array_self_check(initialized);
+	cma_init();
+	hugepage_init();
+	printk(PRINTK_INFO "mm: Initialized %zu struct pages in %llu cycles\n",
+			initialized, (unsigned long long)(arch_cycle_count() - start));
+}
+
+static void zone_numa_init(struct zone* zone) {
+	unsigned long counts[MAX_NUMA_NODES] = { 0 };
+	for (unsigned long i = 0; i < zone->area_count; i++) {
+		struct mem_area* area = &zone->areas[i];
+
+		/* The page init job of an area that isn't online yet copies the node into the pages itself */
+		unsigned long irq_flags;
+		mem_area_lock(area, &irq_flags);
+		area->node = numa_node_of_address(area->base);
+		if (atomic_load_explicit(&area->online, ATOMIC_ACQUIRE))
+			area_set_page_nodes(area);
+		mem_area_unlock(area, &irq_flags);
+
+		if (unlikely(area->node != numa_node_of_address(area->base + area->real_size - 1))) {
+			printk(PRINTK_WARN "mm: Area %#lx-%#lx spans multiple nodes, using node %u\n",
+					area->base, area->base + area->real_size, area->node);
+		}
+		counts[area->node]++;
+	}
+
+	for (unsigned int node = 0; node < numa_node_count(); node++) {
+		zone->nodes[node].area_count = 0;
+		zone->nodes[node].areas = NULL;
+		if (counts[node])
+			zone->nodes[node].areas = kmalloc(counts[node] * sizeof(unsigned long), MM_ZONE_NORMAL | MM_NOFAIL);
+	}
+	for (unsigned long i = 0; i < zone->area_count; i++) {
+		unsigned int node = zone->areas[i].node;
+		zone->nodes[node].areas[zone->nodes[node].area_count++] = i;
+	}
+}
+
+/* Called by numa_init() once the SRAT has been parsed, splits every zone by node */
+void zones_numa_init(void) {
+	zone_numa_init(&dma_zone);
+	if (dma32_zone != &dma_zone)
+		zone_numa_init(dma32_zone);
+	if (normal_zone != dma32_zone)
+		zone_numa_init(normal_zone);
+	atomic_store_explicit(&numa_zones_ready, true, ATOMIC_RELEASE);
+}
+
+static unsigned int page_cache_cmdline_value(const char* arg, unsigned int def, unsigned int max) {
+	const char* str = cmdline_get(arg);
+	if (!str)
+		return def;
+
+	unsigned long long value;
+	if (kstrtoull(str, 0, &value) || value == 0 || value > max) {
+		printk(PRINTK_ERR "mm: Invalid value for %s: %s\n", arg, str);
+		return def;
+	}
+	return value;
+}
+
+/* The command line values are for order 0, higher orders are scaled down */
+static void page_cache_init(void) {
+	unsigned int high = page_cache_cmdline_value("mm.pcp_high", page_cache_high[0], PAGE_CACHE_CAPACITY - 1);
+	unsigned int batch = page_cache_cmdline_value("mm.pcp_batch", page_cache_batch[0], high);
+	for (unsigned int order = 0; order <= PAGE_CACHE_MAX_ORDER; order++) {
+		page_cache_high[order] = (high >> order) ? high >> order : 1;
+		page_cache_batch[order] = (batch >> order) ? batch >> order : 1;
+	}
+	printk(PRINTK_DBG "mm: Per-CPU page cache high %u, batch %u\n", page_cache_high[0], page_cache_batch[0]);
+}
+
+static void reclaim_init(void) {
+	struct thread* thread = kthread_create(0, reclaim_thread, NULL, "kreclaimd");
+	if (!thread)
+		out_of_memory();
+	int err = kthread_run(thread, SCHED_PRIO_DEFAULT);
+	if (err)
+		panic("Failed to run kreclaimd: %d", err);
+}
+
+static void compact_init(void) {
+	struct thread* thread = kthread_create(0, compact_thread, NULL, "kcompactd");
+	if (!thread)
+		out_of_memory();
+	int err = kthread_run(thread, SCHED_PRIO_MIN);
+	if (err)
+		panic("Failed to run kcompactd: %d", err);
+}
+
+/* Run the boot jobs on every AP, whoever gets to a job first runs it */
+static void page_init_ap(void) {
+	for (size_t i = 0; i < page_init_boot_jobs; i++)
+		page_init_try_run(&page_init_jobs[i], PAGE_INIT_BY_AP);
+}
+
+/* Picks up everything the AP's didn't, including the boot jobs if there are no AP's */
+static int page_init_thread(void* arg) {
+	(void)arg;
+	for (size_t i = 0; i < page_init_job_count; i++) {
+		page_init_try_run(&page_init_jobs[i], PAGE_INIT_BY_THREAD);
+		sched_yield();
+	}
+	return 0;
 }
 
-INIT_TASK_DECLARE(stack_tracer_init_task, hhdm_init_task);
+static void page_init_thread_init(void) {
+	if (!atomic_load(&page_init_left))
+		return;
+
+	struct thread* thread = kthread_create(0, page_init_thread, NULL, "pageinit");
+	if (!thread)
+		out_of_memory();
+	int err = kthread_run(thread, SCHED_PRIO_MIN);
+	if (err)
+		panic("Failed to run pageinit kthread: %d", err);
+}
+
+INIT_TASK_DECLARE(stack_tracer_init_task, hhdm_init_task, cmdline_init_task);
 INIT_TASK_DEFINE(zones_init_task, INIT_TASK_SCOPE_BSP, zones_init, &stack_tracer_init_task, &hhdm_init_task);
+INIT_TASK_DEFINE(page_cache_init_task, INIT_TASK_SCOPE_BSP, page_cache_init, &cmdline_init_task, &zones_init_task);
+
+INIT_TASK_DECLARE(kthread_init_task, sched_init_task);
+INIT_TASK_DEFINE(compact_init_task, INIT_TASK_SCOPE_BSP, compact_init, &kthread_init_task, &sched_init_task);
+INIT_TASK_DEFINE(reclaim_init_task, INIT_TASK_SCOPE_BSP, reclaim_init, &kthread_init_task, &sched_init_task);
+INIT_TASK_DEFINE(page_init_thread_init_task, INIT_TASK_SCOPE_BSP, page_init_thread_init, &kthread_init_task, &sched_init_task);
+INIT_TASK_DEFINE(page_init_ap_task, INIT_TASK_SCOPE_AP, page_init_ap, &zones_init_task);
@@ -22,6 +22,8 @@ static int reaper(void* arg) {
 			}
 		}
 
+		if (zombie)
+			list_remove(&zombie->state.block_link);
 		spinlock_release_preempt_enable(&rq->zombie_lock);
 		if (zombie) {
 			sched_thread_detach(zombie);
@@ -6,30 +6,31 @@
 #include "internal.h"
 
 int alloc_stack(void** bottom, void** top) {
-	struct page* pages = alloc_pages(MM_ZONE_NORMAL, get_order(THREAD_STACK_SIZE));
-	if (!pages)
-		return -ENOMEM;
-
+	/* The first page is the guard page, the stack doesn't need to be physically contiguous */
 	struct page* page_array[(THREAD_STACK_SIZE >> PAGE_SHIFT) + 1];
 	page_array[0] = NULL;
-	for (size_t i = 1; i < ARRAY_SIZE(page_array); i++)
-		page_array[i] = pages + i - 1;
-
-	int err = 0;
-	u8* mapping = vm_map(NULL, page_array, ARRAY_SIZE(page_array), PGPROT_READ | PGPROT_WRITE, VMM_STACK);
-	if (!IS_PTR_ERR(mapping)) {
-		*bottom = mapping;
-		*top = mapping + THREAD_STACK_SIZE + PAGE_SIZE;
-	} else {
-		err = PTR_ERR(mapping);
+	const size_t page_count = ARRAY_SIZE(page_array) - 1;
+	size_t allocated = alloc_pages_bulk(MM_ZONE_NORMAL, page_count, page_array + 1);
+
+	int err = -ENOMEM;
+	if (allocated == page_count) {
+		u8* mapping = vm_map(NULL, page_array, ARRAY_SIZE(page_array), PGPROT_READ | PGPROT_WRITE, VMM_STACK);
+		if (!IS_PTR_ERR(mapping)) {
+			*bottom = mapping;
+			*top = mapping + THREAD_STACK_SIZE + PAGE_SIZE;
+			err = 0;
+		} else {
+			err = PTR_ERR(mapping);
+		}
 	}
 
-	release_page(pages);
+	for (size_t i = 0; i < allocated; i++)
+		release_page(page_array[i + 1]);
 	return err;
 }
 
 void free_stack(void* bottom) {
-	vm_unmap_force(bottom, (THREAD_STACK_SIZE + PAGE_SIZE) >> PAGE_SHIFT, 0);
+	vm_unmap_lazy(bottom, (THREAD_STACK_SIZE + PAGE_SIZE) >> PAGE_SHIFT);
 }
 
 int alloc_thread_stack(struct thread* thread, size_t off, void** bottom, void** top) {
@@ -52,6 +53,14 @@ void free_thread_stack(struct thread* thread) {
 
 static struct slab_cache* thread_cache = NULL;
 
+/* A thread is detached from its process and off every list by the time it's freed, so these stay the same */
+static void thread_ctor(void* obj) {
+	struct thread* thread = obj;
+	atomic_store(&thread->proc, NULL);
+	list_node_init(&thread->proc_link);
+	list_node_init(&thread->state.block_link);
+}
+
 struct thread* alloc_thread(int flags) {
 	struct thread* ret = slab_cache_alloc(thread_cache);
 	if (!ret)
@@ -72,8 +81,6 @@ struct thread* alloc_thread(int flags) {
 	bug(topology_set_cpu(&ret->topology, cpu) != 0);
 
 	ret->mm_struct = NULL;
-	atomic_store(&ret->proc, NULL);
-	list_node_init(&ret->proc_link);
 	atomic_store(&ret->prio, 0);
 	ret->preempt_count = 0;
 
@@ -81,7 +88,6 @@ struct thread* alloc_thread(int flags) {
 	atomic_store(&ret->state.flags, 0);
 	atomic_store(&ret->state.wakeup_errno, 0);
 	atomic_store(&ret->state.sleep_gen, 0);
-	list_node_init(&ret->state.block_link);
 
 	atomic_store(&ret->refcnt, 1);
 	atomic_store(&ret->policy_priv, NULL);
@@ -91,12 +97,13 @@ struct thread* alloc_thread(int flags) {
 
 void free_thread(struct thread* thread) {
 	bug(atomic_load(&thread->refcnt) != 0);
+	bug(atomic_load(&thread->proc) || list_node_linked(&thread->proc_link) || list_node_linked(&thread->state.block_link));
 	arch_context_destroy(&thread->context);
 	slab_cache_free(thread_cache, thread);
 }
 
 void sched_thread_cache_init(void) {
-	thread_cache = slab_cache_create(sizeof(struct thread), alignof(struct thread), MM_ZONE_NORMAL, NULL, NULL);
+	thread_cache = slab_cache_create(sizeof(struct thread), alignof(struct thread), MM_ZONE_NORMAL, thread_ctor, NULL);
 	if (unlikely(!thread_cache))
 		out_of_memory();
 }